@@ -0,0 +1,70 @@
+/* async_commit.c - time spent in the commit call by synchronous and
+ * asynchronous commits, and the total time until all are in the log
+ *
+ * usage: async_commit [range size in bytes] [transactions] [direct log]
+ */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SEGNAME "benchseg"
+
+static double now()
+{
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char* name, int async, int direct, int range, int ntrans)
+{
+     rvm_t rvm;
+     char* segs[1];
+     rvm_commit_t last = 0;
+     double in_commit = 0;
+     int t;
+
+     rvm = rvm_init("rvm_bench");
+     rvm_set_option(rvm, RVM_OPT_DIRECT_LOG, direct);
+     segs[0] = (char *) rvm_map(rvm, SEGNAME, range);
+
+     double t0 = now();
+     for (t = 0; t < ntrans; t++) {
+	  trans_t trans = rvm_begin_trans(rvm, 1, (void **) segs);
+	  rvm_about_to_modify(trans, segs[0], 0, range);
+	  memset(segs[0], t, range);
+	  double c0 = now();
+	  if (async)
+	       last = rvm_commit_trans_async(trans);
+	  else
+	       rvm_commit_trans(trans);
+	  in_commit += now() - c0;
+     }
+     if (async)
+	  rvm_wait(last);
+     double elapsed = now() - t0;
+
+     printf("%-8s %14.2f %12.1f\n", name, in_commit / ntrans * 1e6, ntrans / elapsed);
+
+     rvm_unmap(rvm, segs[0]);
+     rvm_truncate_log(rvm);
+     rvm_close(rvm);
+}
+
+int main(int argc, char **argv)
+{
+     int range = argc > 1 ? atoi(argv[1]) : 4096;
+     int ntrans = argc > 2 ? atoi(argv[2]) : 20000;
+     int direct = argc > 3 ? atoi(argv[3]) : 1;
+
+     printf("%d transactions modifying %d bytes each, %s log\n", ntrans, range,
+	    direct ? "direct" : "buffered");
+     printf("%-8s %14s %12s\n", "mode", "commit us", "commits/s");
+     run("sync", 0, direct, range, ntrans);
+     run("async", 1, direct, range, ntrans);
+     return 0;
+}
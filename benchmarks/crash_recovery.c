@@ -0,0 +1,203 @@
+/* crash_recovery.c - crash the library at random writes and crash
+ * points, with torn writes, and check what recovery brings back. Each
+ * trial runs a child that recovers the segment, commits transactions
+ * and truncates now and then until the injected fault ends it. The
+ * parent recovers after it, times the recovery against the log size
+ * and compares the segment with a model of the committed transactions:
+ * it must hold every acknowledged commit, plus at most the one that
+ * was in flight. A last sweep times recovery of growing logs.
+ *
+ * Needs the fault build of the library: make fault
+ *
+ * usage: crash_recovery [trials] [seed]
+ */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define DIRNAME "rvm_crash"
+#define SEGNAME "crashseg"
+#define SEGSIZE (64 * 4096)
+#define TRANS_PER_TRIAL 300
+#define TRUNCATE_EVERY 64
+#define MAX_RANGE 3000
+
+/* progress of a child, shared with the parent */
+typedef struct {
+     long long acked; /* transactions whose commit returned */
+     long long events; /* fault events counted by a calibration run */
+} progress_t;
+
+static progress_t* progress;
+
+static double now()
+{
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* transaction n writes a few ranges derived from n alone, so the
+ * parent can replay it on the model */
+static int ranges_of(long long n, int* offsets, int* sizes)
+{
+     unsigned int seed = (unsigned int) (n * 2654435761u + 1);
+     int count = 1 + rand_r(&seed) % 3;
+     int i;
+     for (i = 0; i < count; i++) {
+	  sizes[i] = 1 + rand_r(&seed) % MAX_RANGE;
+	  offsets[i] = rand_r(&seed) % (SEGSIZE - sizes[i]);
+     }
+     return count;
+}
+
+static void apply_trans(char* mem, long long n)
+{
+     int offsets[3], sizes[3];
+     int count = ranges_of(n, offsets, sizes);
+     int i;
+     for (i = 0; i < count; i++)
+	  memset(mem + offsets[i], (int) ((n * 7 + i) & 0xff), sizes[i]);
+}
+
+/* the child: recover, then commit from transaction base on,
+ * truncating every so many commits unless that is 0 */
+static void run_child(long long base, int ntrans, int truncate_every, long long event, int torn)
+{
+     rvm_fault_arm(event, torn);
+     rvm_t rvm = rvm_init(DIRNAME);
+     char* segs[1];
+     segs[0] = (char *) rvm_map(rvm, SEGNAME, SEGSIZE);
+     if (!segs[0])
+	  _exit(2);
+
+     long long n;
+     for (n = base; n < base + ntrans; n++) {
+	  int offsets[3], sizes[3];
+	  int count = ranges_of(n, offsets, sizes);
+	  int i;
+	  trans_t trans = rvm_begin_trans(rvm, 1, (void **) segs);
+	  if (n % 4 == 0) /* an empty range declared first is logged last */
+	       rvm_about_to_modify(trans, segs[0], offsets[0], 0);
+	  for (i = 0; i < count; i++)
+	       rvm_about_to_modify(trans, segs[0], offsets[i], sizes[i]);
+	  apply_trans(segs[0], n);
+	  rvm_commit_trans(trans);
+	  progress->acked = n + 1;
+	  if (truncate_every && (n + 1) % truncate_every == 0)
+	       rvm_truncate_log(rvm);
+     }
+     progress->events = rvm_fault_events();
+     _exit(0);
+}
+
+static int fork_child(long long base, int ntrans, int truncate_every, long long event, int torn)
+{
+     progress->acked = base;
+     int pid = fork();
+     if (pid < 0) {
+	  perror("fork");
+	  exit(2);
+     }
+     if (pid == 0)
+	  run_child(base, ntrans, truncate_every, event, torn);
+     int status;
+     waitpid(pid, &status, 0);
+     return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/* recover in this process, returning the time taken and the log size
+ * found before it. The image must hold every acknowledged commit and
+ * maybe the one in flight; the model and base move past what it holds */
+static const char* recover(char* model, char* image, long long* base,
+			   long long* log_bytes, double* elapsed)
+{
+     struct stat st;
+     *log_bytes = stat(DIRNAME "/" SEGNAME ".log", &st) == 0 ? st.st_size : 0;
+
+     double t0 = now();
+     rvm_t rvm = rvm_init(DIRNAME);
+     char* seg = (char *) rvm_map(rvm, SEGNAME, SEGSIZE);
+     *elapsed = now() - t0;
+
+     memcpy(image, seg, SEGSIZE);
+     rvm_unmap(rvm, seg);
+     rvm_close(rvm);
+
+     long long n, acked = progress->acked;
+     for (n = *base; n < acked; n++)
+	  apply_trans(model, n);
+     *base = acked;
+     if (memcmp(image, model, SEGSIZE) == 0)
+	  return "acked";
+     apply_trans(model, acked);
+     *base = acked + 1;
+     if (memcmp(image, model, SEGSIZE) == 0)
+	  return "in-flight";
+     memcpy(model, image, SEGSIZE); /* go on from what is there */
+     return "MISMATCH";
+}
+
+int main(int argc, char **argv)
+{
+     int trials = argc > 1 ? atoi(argv[1]) : 200;
+     unsigned int seed = argc > 2 ? atoi(argv[2]) : (unsigned int) time(NULL);
+     char* model = (char *) malloc(SEGSIZE);
+     char* image = (char *) malloc(SEGSIZE);
+     long long base = 0, log_bytes;
+     double elapsed;
+     const char* state;
+     int t, failures = 0, in_flight = 0;
+
+     progress = (progress_t *) mmap(NULL, sizeof(progress_t), PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+     rvm_t rvm = rvm_init(DIRNAME);
+     rvm_destroy(rvm, SEGNAME);
+     rvm_close(rvm);
+     memset(model, '0', SEGSIZE); /* new segments are filled with '0' */
+
+     /* a run without faults counts the events of a trial */
+     fork_child(base, TRANS_PER_TRIAL, TRUNCATE_EVERY, 0, 0);
+     long long events = progress->events;
+     recover(model, image, &base, &log_bytes, &elapsed);
+     printf("seed %u, %lld events per trial\n", seed, events);
+     printf("%6s %8s %5s %10s %12s %10s\n", "trial", "event", "torn", "log KB", "recover ms", "state");
+
+     for (t = 0; t < trials; t++) {
+	  long long event = 1 + rand_r(&seed) % events;
+	  int torn = rand_r(&seed) % 2;
+	  int rc = fork_child(base, TRANS_PER_TRIAL, TRUNCATE_EVERY, event, torn);
+	  state = recover(model, image, &base, &log_bytes, &elapsed);
+	  if (state[0] == 'i')
+	       in_flight++;
+	  if (state[0] == 'M')
+	       failures++;
+	  printf("%6d %8lld %5d %10.1f %12.3f %10s%s\n", t, event, torn, log_bytes / 1024.0,
+		 elapsed * 1e3, state, rc == RVM_FAULT_EXIT ? "" : " (no fault)");
+     }
+     printf("%d trials, %d recovered the commit in flight, %d mismatches\n",
+	    trials, in_flight, failures);
+
+     /* recovery time against log size, the logs never truncated */
+     printf("\n%8s %10s %12s %10s\n", "commits", "log KB", "recover ms", "state");
+     int ntrans;
+     for (ntrans = 256; ntrans <= 16384; ntrans *= 2) {
+	  fork_child(base, ntrans, 0, 0, 0);
+	  state = recover(model, image, &base, &log_bytes, &elapsed);
+	  if (state[0] == 'M')
+	       failures++;
+	  printf("%8d %10.1f %12.3f %10s\n", ntrans, log_bytes / 1024.0, elapsed * 1e3, state);
+     }
+
+     free(model);
+     free(image);
+     return failures ? 1 : 0;
+}
@@ -0,0 +1,77 @@
+/* direct_log.c - commit latency of buffered and O_DIRECT log appends
+ * across record sizes
+ *
+ * usage: direct_log [transactions per size]
+ */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SEGNAME "benchseg"
+#define SEGSIZE (16 * 1024 * 1024)
+
+static double now()
+{
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void* a, const void* b)
+{
+     double x = *(const double*) a, y = *(const double*) b;
+     return x < y ? -1 : x > y;
+}
+
+static void run(int direct, int size, int ntrans)
+{
+     rvm_t rvm;
+     char* segs[1];
+     double* lat = malloc(ntrans * sizeof(double));
+     double total = 0;
+     int t;
+
+     rvm = rvm_init("rvm_bench");
+     rvm_set_option(rvm, RVM_OPT_DIRECT_LOG, direct);
+     segs[0] = (char *) rvm_map(rvm, SEGNAME, SEGSIZE);
+
+     for (t = 0; t < ntrans; t++) {
+	  int off = (t * (long) size) % (SEGSIZE - size);
+	  double t0 = now();
+	  trans_t trans = rvm_begin_trans(rvm, 1, (void **) segs);
+	  rvm_about_to_modify(trans, segs[0], off, size);
+	  memset(segs[0] + off, t, size);
+	  rvm_commit_trans(trans);
+	  lat[t] = now() - t0;
+	  total += lat[t];
+     }
+     qsort(lat, ntrans, sizeof(double), cmp_double);
+
+     printf("%-9s %8d %12.1f %10.1f %10.1f %10.1f\n",
+	    direct ? "direct" : "buffered", size, ntrans / total,
+	    total / ntrans * 1e6, lat[ntrans / 2] * 1e6, lat[ntrans * 99 / 100] * 1e6);
+
+     rvm_unmap(rvm, segs[0]);
+     rvm_truncate_log(rvm);
+     rvm_close(rvm);
+     free(lat);
+}
+
+int main(int argc, char **argv)
+{
+     static const int sizes[] = { 64, 512, 4096, 65536 };
+     int ntrans = argc > 1 ? atoi(argv[1]) : 5000;
+     int i;
+
+     printf("%-9s %8s %12s %10s %10s %10s\n",
+	    "log", "bytes", "commits/s", "mean us", "p50 us", "p99 us");
+     for (i = 0; i < (int) (sizeof(sizes) / sizeof(sizes[0])); i++) {
+	  run(0, sizes[i], ntrans);
+	  run(1, sizes[i], ntrans);
+     }
+     return 0;
+}
@@ -0,0 +1,100 @@
+/* hugepage.c - random access and commit throughput of a large segment
+ * backed by regular, transparent huge or hugetlb pages
+ *
+ * usage: hugepage [segment size in MB] [random accesses] [transactions]
+ */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SEGNAME "benchseg"
+#define RANGES_PER_TRANS 16
+#define RANGE_SIZE 64
+
+static const char* mode_name[] = { "pages", "thp", "hugetlb" };
+static const char* policy_name[] = { "off", "transparent", "explicit" };
+
+static double now()
+{
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift, deterministic across runs */
+static unsigned long next_rand(unsigned long* state)
+{
+     unsigned long x = *state;
+     x ^= x << 13;
+     x ^= x >> 7;
+     x ^= x << 17;
+     return *state = x;
+}
+
+static void run(int policy, int size, long accesses, int ntrans)
+{
+     rvm_t rvm;
+     segstat_t stats;
+     char* segs[1];
+     unsigned long rng = 88172645463325252UL;
+     unsigned long sum = 0;
+     long i;
+     int t, r;
+
+     rvm = rvm_init("rvm_bench");
+     rvm_set_option(rvm, RVM_OPT_HUGEPAGES, policy);
+
+     double t0 = now();
+     segs[0] = (char *) rvm_map(rvm, SEGNAME, size);
+     double map_time = now() - t0;
+     rvm_seg_stats(rvm, segs[0], &stats);
+
+     /* random 8 byte read-modify-write over the whole segment */
+     t0 = now();
+     for (i = 0; i < accesses; i++) {
+	  long* p = (long*) (segs[0] + (next_rand(&rng) % (size - 8) & ~7UL));
+	  sum += *p;
+	  *p = sum;
+     }
+     double access_time = now() - t0;
+
+     /* transactions of small random ranges */
+     t0 = now();
+     for (t = 0; t < ntrans; t++) {
+	  trans_t trans = rvm_begin_trans(rvm, 1, (void **) segs);
+	  for (r = 0; r < RANGES_PER_TRANS; r++) {
+	       int off = next_rand(&rng) % (size - RANGE_SIZE);
+	       rvm_about_to_modify(trans, segs[0], off, RANGE_SIZE);
+	       memset(segs[0] + off, t, RANGE_SIZE);
+	  }
+	  rvm_commit_trans(trans);
+     }
+     double commit_time = now() - t0;
+
+     printf("%-12s %-8s %10.3f %14.1f %14.1f   (%lx)\n",
+	    policy_name[policy], mode_name[stats.alloc_mode], map_time,
+	    accesses / access_time / 1e6, ntrans / commit_time, sum & 0xf);
+
+     rvm_unmap(rvm, segs[0]);
+     rvm_truncate_log(rvm);
+}
+
+int main(int argc, char **argv)
+{
+     int size_mb = argc > 1 ? atoi(argv[1]) : 256;
+     long accesses = argc > 2 ? atol(argv[2]) : 20000000;
+     int ntrans = argc > 3 ? atoi(argv[3]) : 2000;
+     int policy;
+
+     printf("segment %d MB, %ld random accesses, %d transactions of %d x %d bytes\n",
+	    size_mb, accesses, ntrans, RANGES_PER_TRANS, RANGE_SIZE);
+     printf("%-12s %-8s %10s %14s %14s\n",
+	    "policy", "backing", "map (s)", "Macc/s", "commits/s");
+     for (policy = RVM_HUGEPAGES_OFF; policy <= RVM_HUGEPAGES_EXPLICIT; policy++)
+	  run(policy, size_mb * 1024 * 1024, accesses, ntrans);
+     return 0;
+}
@@ -0,0 +1,125 @@
+/* index.c - throughput of the recoverable hash map and B+-tree with one
+ * transaction per operation, and the log bytes each operation costs.
+ * Keys are random; puts insert them, gets and dels find them again.
+ * The log is truncated between phases
+ *
+ * usage: index [operations] [segment size in MB]
+ */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define SEGNAME "benchseg"
+#define LOGNAME "rvm_bench/" SEGNAME ".log"
+
+typedef struct {
+     const char* name;
+     int (*create)(trans_t, void*);
+     int (*put)(trans_t, void*, int, long long, long long);
+     int (*get)(void*, int, long long, long long*);
+     int (*del)(trans_t, void*, int, long long);
+} index_ops_t;
+
+static int hash_create(trans_t tid, void* segbase)
+{
+     return rvm_hash_create(tid, segbase, 0);
+}
+
+static const index_ops_t indexes[] = {
+     { "hash", hash_create, rvm_hash_put, rvm_hash_get, rvm_hash_del },
+     { "btree", rvm_btree_create, rvm_btree_put, rvm_btree_get, rvm_btree_del },
+};
+
+static double now()
+{
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long long log_size()
+{
+     struct stat st;
+     return stat(LOGNAME, &st) == 0 ? st.st_size : 0;
+}
+
+static void report(const char* name, const char* op, int nops, double elapsed, long long bytes)
+{
+     printf("%-8s %-6s %12.0f %14.1f\n", name, op, nops / elapsed, (double) bytes / nops);
+}
+
+static void run(const index_ops_t* ix, long long* keys, int nops, int size)
+{
+     rvm_t rvm;
+     trans_t trans;
+     char* segs[1];
+     long long value;
+     int i;
+
+     rvm = rvm_init("rvm_bench");
+     rvm_destroy(rvm, SEGNAME);
+     segs[0] = (char *) rvm_map(rvm, SEGNAME, size);
+
+     trans = rvm_begin_trans(rvm, 1, (void **) segs);
+     int index = ix->create(trans, segs[0]);
+     rvm_commit_trans(trans);
+     rvm_truncate_log(rvm);
+
+     double t0 = now();
+     for (i = 0; i < nops; i++) {
+	  trans = rvm_begin_trans(rvm, 1, (void **) segs);
+	  if (ix->put(trans, segs[0], index, keys[i], i) < 0) {
+	       printf("put failed, segment full?\n");
+	       exit(2);
+	  }
+	  rvm_commit_trans(trans);
+     }
+     report(ix->name, "put", nops, now() - t0, log_size());
+     rvm_truncate_log(rvm);
+
+     t0 = now();
+     for (i = 0; i < nops; i++)
+	  if (ix->get(segs[0], index, keys[i], &value) != 1) {
+	       printf("key lost\n");
+	       exit(2);
+	  }
+     report(ix->name, "get", nops, now() - t0, log_size());
+
+     t0 = now();
+     for (i = 0; i < nops; i++) {
+	  trans = rvm_begin_trans(rvm, 1, (void **) segs);
+	  ix->del(trans, segs[0], index, keys[i]);
+	  rvm_commit_trans(trans);
+     }
+     report(ix->name, "del", nops, now() - t0, log_size());
+
+     rvm_truncate_log(rvm);
+     rvm_unmap(rvm, segs[0]);
+     rvm_destroy(rvm, SEGNAME);
+     rvm_close(rvm);
+}
+
+int main(int argc, char **argv)
+{
+     int nops = argc > 1 ? atoi(argv[1]) : 100000;
+     int size_mb = argc > 2 ? atoi(argv[2]) : 64;
+     long long* keys = (long long *) malloc(nops * sizeof(long long));
+     unsigned int seed = 1;
+     unsigned int i;
+
+     for (i = 0; i < (unsigned int) nops; i++)
+	  keys[i] = ((long long) rand_r(&seed) << 31 | rand_r(&seed)) * 2 + 1;
+
+     printf("%d operations, one per transaction, %d MB segment\n", nops, size_mb);
+     printf("%-8s %-6s %12s %14s\n", "index", "op", "ops/sec", "log bytes/op");
+     for (i = 0; i < sizeof(indexes) / sizeof(indexes[0]); i++)
+	  run(&indexes[i], keys, nops, size_mb * 1024 * 1024);
+
+     free(keys);
+     return 0;
+}
@@ -0,0 +1,66 @@
+/* mem_checkpoint.c - truncation time after many small commits to a
+ * few hot pages, replaying the log versus writing dirty pages from
+ * memory
+ *
+ * usage: mem_checkpoint [segment size in MB] [transactions] [hot pages]
+ */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define SEGNAME "benchseg"
+
+static double now()
+{
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char* name, int mem, int size, int ntrans, int hot)
+{
+     rvm_t rvm;
+     char* segs[1];
+     struct stat st;
+     int t;
+
+     rvm = rvm_init("rvm_bench");
+     rvm_set_option(rvm, RVM_OPT_MEM_CHECKPOINT, mem);
+     segs[0] = (char *) rvm_map(rvm, SEGNAME, size);
+
+     for (t = 0; t < ntrans; t++) {
+	  int offset = (t % hot) * (size / hot) + (t / hot) % 512 * 8;
+	  trans_t trans = rvm_begin_trans(rvm, 1, (void **) segs);
+	  rvm_about_to_modify(trans, segs[0], offset, 256);
+	  memset(segs[0] + offset, t, 256);
+	  rvm_commit_trans(trans);
+     }
+     stat("rvm_bench/" SEGNAME ".log", &st);
+
+     double t0 = now();
+     rvm_truncate_log(rvm);
+     double elapsed = now() - t0;
+
+     printf("%-8s %12.1f %12.2f\n", name, st.st_size / (1024.0 * 1024), elapsed * 1e3);
+
+     rvm_unmap(rvm, segs[0]);
+     rvm_close(rvm);
+}
+
+int main(int argc, char **argv)
+{
+     int size_mb = argc > 1 ? atoi(argv[1]) : 64;
+     int ntrans = argc > 2 ? atoi(argv[2]) : 100000;
+     int hot = argc > 3 ? atoi(argv[3]) : 64;
+
+     printf("%d transactions on %d pages of a %d MB segment\n", ntrans, hot, size_mb);
+     printf("%-8s %12s %12s\n", "mode", "log MB", "truncate ms");
+     run("replay", 0, size_mb * 1024 * 1024, ntrans, hot);
+     run("memory", 1, size_mb * 1024 * 1024, ntrans, hot);
+     return 0;
+}
@@ -0,0 +1,59 @@
+/* redo_only.c - commit throughput of large-range transactions with and
+ * without pre-image capture
+ *
+ * usage: redo_only [range size in KB] [transactions]
+ */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SEGNAME "benchseg"
+
+static double now()
+{
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char* name, int flags, int range, int ntrans)
+{
+     rvm_t rvm;
+     char* segs[1];
+     int t;
+
+     rvm = rvm_init("rvm_bench");
+     segs[0] = (char *) rvm_map(rvm, SEGNAME, range);
+
+     double t0 = now();
+     for (t = 0; t < ntrans; t++) {
+	  trans_t trans = rvm_begin_trans_flags(rvm, 1, (void **) segs, flags);
+	  rvm_about_to_modify(trans, segs[0], 0, range);
+	  memset(segs[0], t, range);
+	  rvm_commit_trans(trans);
+     }
+     double elapsed = now() - t0;
+
+     printf("%-10s %12.1f %12.1f\n", name, ntrans / elapsed,
+	    (double) range * ntrans / elapsed / (1024 * 1024));
+
+     rvm_unmap(rvm, segs[0]);
+     rvm_truncate_log(rvm);
+     rvm_close(rvm);
+}
+
+int main(int argc, char **argv)
+{
+     int range_kb = argc > 1 ? atoi(argv[1]) : 4096;
+     int ntrans = argc > 2 ? atoi(argv[2]) : 200;
+
+     printf("%d transactions modifying %d KB each\n", ntrans, range_kb);
+     printf("%-10s %12s %12s\n", "mode", "commits/s", "MB/s");
+     run("undo", 0, range_kb * 1024, ntrans);
+     run("redo-only", RVM_TRANS_NOUNDO, range_kb * 1024, ntrans);
+     return 0;
+}
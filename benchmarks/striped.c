@@ -0,0 +1,118 @@
+/* striped.c - commit throughput and recovery time of a segment striped
+ * over 1, 2 and 4 directories, against a plain segment. Large commits
+ * span many stripes and are written in parallel, small ones touch a
+ * single stripe and pay for the commit record on top of its log.
+ * Recovery maps the segment with its logs untruncated. Stripe
+ * directories default to subdirectories of the working directory, put
+ * them on separate devices to see the scaling
+ *
+ * usage: striped [segment size in MB] [large commits] [small commits] [dir ...]
+ */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SEGNAME "benchseg"
+#define STRIPE (1024 * 1024)
+#define SMALL 256
+#define MAX_DIRS 4
+
+static double now()
+{
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char* map(rvm_t rvm, int size, int ndirs, const char** dirs)
+{
+     if (!ndirs)
+	  return (char *) rvm_map(rvm, SEGNAME, size);
+     return (char *) rvm_map_striped(rvm, SEGNAME, size, STRIPE, ndirs, dirs);
+}
+
+static void run(int size, int nlarge, int nsmall, int ndirs, const char** dirs)
+{
+     rvm_t rvm;
+     char* segs[1];
+     int t;
+
+     rvm = rvm_init("rvm_bench");
+     rvm_destroy(rvm, SEGNAME);
+     segs[0] = map(rvm, size, ndirs, dirs);
+     if (!segs[0]) {
+	  printf("map failed\n");
+	  exit(2);
+     }
+
+     /* whole segment commits */
+     double t0 = now();
+     for (t = 0; t < nlarge; t++) {
+	  trans_t trans = rvm_begin_trans(rvm, 1, (void **) segs);
+	  rvm_about_to_modify(trans, segs[0], 0, size);
+	  memset(segs[0], t, size);
+	  rvm_commit_trans(trans);
+     }
+     double large = now() - t0;
+     rvm_truncate_log(rvm);
+
+     /* small commits scattered over the stripes */
+     t0 = now();
+     for (t = 0; t < nsmall; t++) {
+	  int offset = (int) ((t * 2654435761u) % (unsigned) (size - SMALL));
+	  trans_t trans = rvm_begin_trans(rvm, 1, (void **) segs);
+	  rvm_about_to_modify(trans, segs[0], offset, SMALL);
+	  memset(segs[0] + offset, t, SMALL);
+	  rvm_commit_trans(trans);
+     }
+     double small = now() - t0;
+
+     /* one more large commit left in the logs for recovery */
+     trans_t trans = rvm_begin_trans(rvm, 1, (void **) segs);
+     rvm_about_to_modify(trans, segs[0], 0, size);
+     memset(segs[0], 'r', size);
+     rvm_commit_trans(trans);
+     rvm_close(rvm);
+
+     rvm = rvm_init("rvm_bench");
+     t0 = now();
+     segs[0] = map(rvm, size, ndirs, dirs);
+     double recover = now() - t0;
+     if (!segs[0] || segs[0][size - 1] != 'r') {
+	  printf("recovery failed\n");
+	  exit(2);
+     }
+
+     char name[16];
+     sprintf(name, ndirs ? "%d dirs" : "plain", ndirs);
+     printf("%-8s %14.1f %14.0f %14.2f\n", name, nlarge * (size / (1024.0 * 1024)) / large,
+	    nsmall / small, recover * 1e3);
+
+     rvm_unmap(rvm, segs[0]);
+     rvm_destroy(rvm, SEGNAME);
+     rvm_close(rvm);
+}
+
+int main(int argc, char **argv)
+{
+     int size_mb = argc > 1 ? atoi(argv[1]) : 64;
+     int nlarge = argc > 2 ? atoi(argv[2]) : 8;
+     int nsmall = argc > 3 ? atoi(argv[3]) : 2000;
+     const char* dirs[MAX_DIRS] = { "rvm_bench_s0", "rvm_bench_s1", "rvm_bench_s2", "rvm_bench_s3" };
+     int i, ndirs;
+
+     for (i = 0; i < MAX_DIRS && 4 + i < argc; i++)
+	  dirs[i] = argv[4 + i];
+
+     printf("%d MB segment, %d KB stripes, %d large and %d small commits\n",
+	    size_mb, STRIPE / 1024, nlarge, nsmall);
+     printf("%-8s %14s %14s %14s\n", "layout", "large MB/s", "small/s", "recover ms");
+     run(size_mb * 1024 * 1024, nlarge, nsmall, 0, dirs);
+     for (ndirs = 1; ndirs <= MAX_DIRS; ndirs *= 2)
+	  run(size_mb * 1024 * 1024, nlarge, nsmall, ndirs, dirs);
+     return 0;
+}
@@ -2,8 +2,10 @@
  * Implementation for RVM
  */
 
+#define _GNU_SOURCE /* O_DIRECT, fallocate */
 
 #include <string.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
@@ -11,8 +13,14 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <time.h>
+#include <pthread.h>
 #include "rvm.h"
 #include "rvm_internal.h"
+#include "rvm_lz.h"
 
 /* private syscall wrappers */
 static int Open(const char* path, int oflag);
@@ -23,6 +31,8 @@ static void* Malloc(size_t size);
 static void Free(void* ptr);
 static DIR *Opendir(const char *name); 
 static int Closedir(DIR *dirp);
+static ssize_t Write(int fd, const void* buf, size_t n);
+static ssize_t Pwrite(int fd, const void* buf, size_t n, off_t offset);
 
 /* definition for a simple list used by RVM */
 typedef struct node_t {
@@ -67,323 +77,3877 @@ int ST_destroy(ST_t* st);
 
 /* private helper functions */
 static void get_logpath(char* logpath, char* path);
-static void apply_log(char* logpath, char* segpath);
-static void check_segment(char* filename, int size_to_create);
-static int check_addr(trans_t tid, void* segbase);
-static void* recover_data(char* path);
+static int find_logdir(const char* dir, char* logdir);
+static int apply_log(char* logpath, char* segpath, int budget, int* used);
+static int truncate_logs(rvm_t rvm, int budget);
+static int truncate_dir(const char* dir, int budget);
+static void get_ckptpath(char* ckptpath, char* segpath);
+static void read_ckpt(char* segpath, ckpt_t* ck);
+static void write_ckpt(char* segpath, ckpt_t* ck);
+static int check_segment(char* filename, int size_to_create, int sparse);
+static int data_header(int fd, int* size);
+static int load_data(int fd, int off, char* dst, size_t size, int sparse);
+static int is_zero(const char* p, size_t n);
+static int punch_hole(int fd, off_t at, size_t n);
+static segment_t* check_addr(trans_t tid, void* segbase);
+static int compare_range(const void* a, const void* b);
+static void* recover_data(char* path, segment_t* seg, int hugepages, size_t reserve);
+static void* alloc_segment(size_t size, int hugepages, size_t reserve, segment_t* seg);
+static size_t sys_page_size(void);
+static int grow_memory(void* segbase, segment_t* seg, int size, int loaded);
+static void free_segment(void* segbase, segment_t* seg);
+static int fill_segment(int fd, int count);
+static void* map_lazy(char* path, segment_t* seg);
+static void unmap_lazy(lazy_t* lz);
+static void lazy_load_page(lazy_t* lz, int page);
+static void lazy_prefault(lazy_t* lz, int offset, int size);
+static void lazy_fault(int sig, siginfo_t* info, void* ctx);
+static void write_record(logbuf_t* lb, char* data, int offset, int len,
+        int compress_min, long long* lsn, int more);
+static int log_end(char* logpath);
+static void logbuf_init(logbuf_t* lb);
+static int logbuf_open(logbuf_t* lb, char* logpath, int direct);
+static int logbuf_reserve(logbuf_t* lb, int n);
+static void logbuf_append(logbuf_t* lb, const void* data, int n);
+static void logbuf_flush(logbuf_t* lb);
+static void logbuf_close(logbuf_t* lb);
+static void reset_log_writers();
+static int open_marked_log(logbuf_t* lb, const char* dir, const char* name, char* logpath);
+static int copy_file(char* src, char* dst, off_t limit);
+static int dir_lock(const char* dir, int op);
+static void dir_unlock(int fd);
+static void* map_shared(char* path, segment_t* seg);
+static void shm_name(char* name, struct stat* st);
+static void shm_lock(segment_t* seg);
+static void shm_reload(segment_t* seg);
+static int compare_shm(const void* a, const void* b);
+static void snap_preserve(segment_t* seg, void* segbase, int offset, int size);
+static void snap_free(snapseg_t* ss);
+static void mark_dirty(segment_t* seg, int offset, int size);
+static int checkpoint_segment(segment_t* seg, void* segbase);
+static void manifest_init(manifest_t* m);
+static mentry_t* manifest_add(manifest_t* m, const char* name);
+static int manifest_load(const char* dir, manifest_t* m);
+static void manifest_scan(const char* dir, manifest_t* m);
+static void manifest_save(const char* dir, manifest_t* m);
+static mentry_t* manifest_find(manifest_t* m, const char* name);
+static int manifest_update(const char* dir, const char* name, int size, int dirty);
+static void manifest_set(const char* dir, const char* name, int size, int dirty);
+static void manifest_remove(const char* dir, const char* name);
+static int log_next(char* log, int log_len, int* pos, logrec_t* rec);
+static int log_decode(char* log, int log_len, int* pos, logrec_t* rec);
+static int frame_decode(char* log, int log_len, int* pos, int p, logrec_t* rec);
+static void logrec_init(logrec_t* rec);
+static int varint_put(char* buf, unsigned long long v);
+static int varint_get(char* log, int log_len, int* p, unsigned long long* v);
+
+/* per rvm instance state */
+typedef struct {
+    char directory[MAXLINE];
+    ST_t segments; /* segbase -> segment_t mapping */
+    int hugepages; /* RVM_HUGEPAGES_* policy for newly mapped segments */
+    int compress_min; /* compress log records of at least this size, 0 = off */
+    int direct_log; /* stage log records and append them with O_DIRECT */
+    int lazy; /* map segments without replay, pages load on first access */
+    int mem_checkpoint; /* truncation writes dirty pages of mapped segments from memory */
+    int shared; /* map segments into memory shared with other processes */
+    long undo_budget; /* bytes of pre-images kept in memory, 0 = no limit */
+    long long undo_bytes; /* bytes of pre-images in memory now */
+    long reserve; /* address space reserved for each new segment, 0 = none */
+    int sparse; /* create new segments as sparse files */
+    char standby[MAXLINE]; /* directory the logs are shipped to, empty = off */
+    int standby_apply; /* the standby applier replays shipped records */
+    struct timespec ship_start; /* when shipping was turned on */
+} instance_t;
+
+/* a registry slot. rvm_t carries the slot index and the generation
+ * the slot had when the instance was created, so handles of a closed
+ * instance are rejected even after the slot is reused */
+typedef struct {
+    instance_t* inst;
+    int gen;
+    int next_free; /* next slot on the free list, -1 terminates */
+} slot_t;
+
+static instance_t* get_instance(rvm_t rvm);
+static void release_segment(void* segbase, segment_t* seg);
+static void* load_segment(instance_t* inst, char* path, segment_t* seg);
+static void register_segment(instance_t* inst, void* addr, segment_t* seg,
+        char* path, const char* segname, int size);
+static void* map_worker(void* arg);
+static void run_workers(void* (*fn)(void*), void* job, int nworkers);
+static void checkpoint_segments(instance_t* inst);
+static void open_seg_log(segment_t* seg, instance_t* inst);
+static int undo_charge(instance_t* inst, int bytes);
+static void undo_spill(segment_t* seg, log_t* log, char* src);
+static void undo_read(segment_t* seg, log_t* log, char* dst, int from, int n);
+static void undo_free(instance_t* inst, log_t* log);
+static void undo_reset(segment_t* seg);
+static void close_seg_log(segment_t* seg);
+static void close_ship_log(segment_t* seg);
+static int seed_standby(instance_t* inst, segment_t* seg);
+static void standby_kick(const char* dir);
+static void* standby_applier(void* arg);
+static void log_striped(segment_t* seg, instance_t* inst, list_t* logs, char* segbase);
+static void* stripe_writer(void* arg);
+static void* stripe_loader(void* arg);
+static int truncate_stripe(segment_t* stripe);
+static int write_stripe_commit(segment_t* seg);
+static long long* read_stripe_commit(const char* path, int* n, long long* seq);
+static void cut_stripe_log(segment_t* stripe, long long limit);
+static int read_layout(const char* path, layout_t* lay);
+static int write_layout(const char* path, layout_t* lay);
+static void get_stripe_path(char* path, layout_t* lay, const char* segname, int k);
+static void get_standby_path(char* path, instance_t* inst, segment_t* seg);
+
+/* a transaction handed to the log writer by rvm_commit_trans_async.
+ * logs[i] holds the redo images of segs[i], copied at commit */
+typedef struct commit_job_t {
+    struct commit_job_t* next;
+    rvm_commit_t ticket;
+    instance_t* inst;
+    int numsegs;
+    void** segs;
+    list_t* logs;
+} commit_job_t;
+
+static void* async_writer(void* arg);
+static rvm_commit_t write_jobs(commit_job_t* job);
+static void async_drain();
+
+/* the committed pieces of a transaction that fall in one stripe */
+typedef struct {
+    char* data;
+    int offset; /* in the stripe */
+    int size;
+} piece_t;
+
+typedef struct {
+    segment_t* stripe;
+    piece_t* pieces;
+    int n;
+} stripe_write_t;
+
+/* per stripe work of a striped segment, for stripe_writer or
+ * stripe_loader */
+typedef struct {
+    instance_t* inst;
+    stripe_write_t* writes;
+    segment_t** stripes;
+    char* base; /* memory of the striped segment */
+    int count;
+    int next; /* next stripe to work on, taken atomically */
+    int failed;
+} stripe_job_t;
+
+/* a batch of segments loaded by rvm_map_many */
+typedef struct {
+    instance_t* inst;
+    char (*paths)[MAXLINE];
+    segment_t** segs;
+    void** bases;
+    int count;
+    int next; /* next segment to load, taken atomically */
+} map_job_t;
 
 /* global variable */
-static int rvm_id = 0;
-static ST_t segment_table[MAXDIR];
+static lazy_t* lazy_segs = NULL; /* lazily recovered segments, for the fault handler */
+static struct sigaction lazy_old_action;
+static slot_t* registry = NULL;
+static int registry_size = 0;
+static int free_slot = -1;
+/* data directories whose logs live elsewhere, looked up by get_logpath */
+static logdir_t* logdirs = NULL;
+static int nlogdirs = 0;
+static pthread_mutex_t logdir_lock = PTHREAD_MUTEX_INITIALIZER;
+/* async commit queue, served in order by a single writer thread */
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_work = PTHREAD_COND_INITIALIZER; /* jobs queued */
+static pthread_cond_t async_done_cond = PTHREAD_COND_INITIALIZER; /* jobs written */
+static commit_job_t* async_head = NULL;
+static commit_job_t* async_tail = NULL;
+static rvm_commit_t async_issued = 0; /* last ticket handed out */
+static rvm_commit_t async_done = 0; /* last ticket in the log */
+static int async_started = 0;
+/* the standby applier: a thread replaying the logs of the standby
+ * directories in the pending list, which commits add to */
+static pthread_mutex_t standby_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t standby_work = PTHREAD_COND_INITIALIZER;
+static char (*standby_pending)[MAXLINE] = NULL;
+static int standby_npending = 0;
+static int standby_cap = 0;
+static int standby_started = 0;
+/* guards the snapshots of all segments against readers in other threads */
+static pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+rvm_t rvm_init(const char *directory)
+{
+    return rvm_init_dirs(directory, NULL);
+}
+
+/* like rvm_init, with the logs in their own directory. The choice is
+ * recorded in the data directory, so later rvm_init calls find the logs
+ * and a different log_dir cannot strand the records of the first one */
+rvm_t rvm_init_dirs(const char *directory, const char *log_dir)
+{   /* if the dir does not exist, create one */
+    rvm_t rvm;
+
+    /* take a slot from the free list, or grow the registry */
+    if (free_slot == -1) {
+        int n = registry_size ? registry_size * 2 : REGISTRY_INIT;
+        slot_t* grown = (slot_t*) realloc(registry, n * sizeof(slot_t));
+        if (!grown) {
+            fprintf(stderr, "cannot grow the instance registry\n");
+            rvm.rid = -1; /* rejected by get_instance */
+            rvm.gen = 0;
+            return rvm;
+        }
+        registry = grown;
+        int i;
+        for (i = n - 1; i >= registry_size; i--) {
+            registry[i].inst = NULL;
+            registry[i].gen = 0;
+            registry[i].next_free = free_slot;
+            free_slot = i;
+        }
+        registry_size = n;
+    }
+    rvm.rid = free_slot;
+    free_slot = registry[rvm.rid].next_free;
+    rvm.gen = ++registry[rvm.rid].gen;
+
+    struct stat st;
+    if (stat(directory, &st) == -1)
+        mkdir(directory, 0777); /* create directory if it does not exist */
+
+    char recpath[MAXLINE + 16], recorded[MAXLINE];
+    sprintf(recpath, "%s/%s", directory, LOGDIR_NAME);
+    FILE* fp = fopen(recpath, "r");
+    recorded[0] = '\0';
+    if (fp) {
+        if (fgets(recorded, MAXLINE, fp))
+            recorded[strcspn(recorded, "\n")] = '\0';
+        fclose(fp);
+    }
+    if (log_dir && recorded[0] && strcmp(log_dir, recorded) != 0)
+        fprintf(stderr, "logs of %s stay in %s\n", directory, recorded);
+    if (log_dir && !recorded[0] && strcmp(log_dir, directory) != 0) {
+        if (stat(log_dir, &st) == -1)
+            mkdir(log_dir, 0777);
+        char tmppath[MAXLINE + 32];
+        sprintf(tmppath, "%s.tmp", recpath);
+        fp = fopen(tmppath, "w");
+        if (fp) {
+            fprintf(fp, "%s\n", log_dir);
+            fflush(fp);
+            fdatasync(fileno(fp));
+            fclose(fp);
+            if (rename(tmppath, recpath) == 0)
+                strcpy(recorded, log_dir);
+        }
+        if (!recorded[0])
+            fprintf(stderr, "cannot record log directory %s\n", log_dir);
+    }
+    if (recorded[0] && find_logdir(directory, NULL) < 0) {
+        pthread_mutex_lock(&logdir_lock);
+        logdirs = (logdir_t*) realloc(logdirs, (nlogdirs + 1) * sizeof(logdir_t));
+        strcpy(logdirs[nlogdirs].data, directory);
+        strcpy(logdirs[nlogdirs].log, recorded);
+        nlogdirs++;
+        pthread_mutex_unlock(&logdir_lock);
+    }
+
+    strcpy(rvm.directory, directory); /* copy the directory name */
+    instance_t* inst = (instance_t*) Malloc(sizeof(instance_t));
+    strcpy(inst->directory, directory);
+    ST_init(&inst->segments); /* init the segment lookup table */
+    inst->hugepages = RVM_HUGEPAGES_OFF;
+    inst->compress_min = 0;
+    inst->direct_log = 0;
+    inst->lazy = 0;
+    inst->mem_checkpoint = 0;
+    inst->shared = 0;
+    inst->undo_budget = 0;
+    inst->reserve = 0;
+    inst->sparse = 0;
+    inst->standby_apply = 0;
+    inst->undo_bytes = 0;
+    inst->standby[0] = '\0';
+    registry[rvm.rid].inst = inst;
+    return rvm;
+}
+
+int rvm_close(rvm_t rvm)
+{
+    instance_t* inst = get_instance(rvm);
+    if (!inst)
+        return -1;
+    async_drain();
+
+    /* refuse to close while a transaction is still open */
+    item_t* item;
+    for (item = inst->segments.head; item; item = item->next) {
+        if (((segment_t*) item->value)->modified) {
+            fprintf(stderr, "cannot close rvm with an open transaction\n");
+            return -1;
+        }
+        if (((segment_t*) item->value)->snaps) {
+            fprintf(stderr, "cannot close rvm with an open read snapshot\n");
+            return -1;
+        }
+    }
+
+    /* unmap whatever the application left mapped */
+    while (!ST_empty(&inst->segments)) {
+        void* segbase = inst->segments.head->key;
+        release_segment(segbase, (segment_t*) inst->segments.head->value);
+        ST_erase(&inst->segments, segbase);
+    }
+    Free(inst);
+
+    registry[rvm.rid].inst = NULL;
+    registry[rvm.rid].next_free = free_slot;
+    free_slot = rvm.rid;
+    return 0;
+}
+
+int rvm_set_option(rvm_t rvm, int option, long value)
+{
+    instance_t* inst = get_instance(rvm);
+    if (!inst)
+        return -1;
+
+    switch (option) {
+    case RVM_OPT_HUGEPAGES:
+        if (value < RVM_HUGEPAGES_OFF || value > RVM_HUGEPAGES_EXPLICIT) {
+            fprintf(stderr, "invalid huge page policy\n");
+            return -1;
+        }
+        inst->hugepages = (int) value;
+        return 0;
+    case RVM_OPT_COMPRESS:
+        if (value < 0 || value > LOG_MAX_RECORD) {
+            fprintf(stderr, "invalid compression threshold\n");
+            return -1;
+        }
+        inst->compress_min = (int) value;
+        return 0;
+    case RVM_OPT_DIRECT_LOG:
+        inst->direct_log = value != 0;
+        return 0;
+    case RVM_OPT_LAZY_RECOVERY:
+        inst->lazy = value != 0;
+        return 0;
+    case RVM_OPT_MEM_CHECKPOINT:
+        inst->mem_checkpoint = value != 0;
+        return 0;
+    case RVM_OPT_SHARED:
+        inst->shared = value != 0;
+        return 0;
+    case RVM_OPT_UNDO_BUDGET:
+        if (value < 0) {
+            fprintf(stderr, "invalid undo budget\n");
+            return -1;
+        }
+        inst->undo_budget = value;
+        return 0;
+    case RVM_OPT_RESERVE:
+        if (value < 0) {
+            fprintf(stderr, "invalid address space reservation\n");
+            return -1;
+        }
+        inst->reserve = value;
+        return 0;
+    case RVM_OPT_SPARSE:
+        inst->sparse = value != 0;
+        return 0;
+    case RVM_OPT_STANDBY_APPLY:
+        inst->standby_apply = value != 0;
+        if (inst->standby_apply && inst->standby[0])
+            standby_kick(inst->standby); /* records shipped so far */
+        return 0;
+    default:
+        fprintf(stderr, "unknown rvm option %d\n", option);
+        return -1;
+    }
+}
+
+void *rvm_map(rvm_t rvm, const char *segname, int size_to_create)
+{   /* use a symbol table to store segname and addr mapping */
+    instance_t* inst = get_instance(rvm);
+    if (!inst)
+        return NULL;
+    async_drain();
+
+    char path[MAXLINE];
+    strcpy(path, rvm.directory);
+    strcat(path, "/");
+    strcat(path, segname);
+
+    int size = check_segment(path, size_to_create, inst->sparse);
+    if (size < 0)
+        return NULL;
+    manifest_update(rvm.directory, segname, size, -1);
+    if (!inst->lazy)
+        rvm_truncate_log(rvm);
+
+    /* create the in memory segment data structure, allocate memory for
+     * segment and recover data from backing store. Then insert the
+     * addr->segment pair in segment table */
+    segment_t* seg = (segment_t*) Malloc(sizeof(segment_t));
+    void* addr = load_segment(inst, path, seg);
+    if (!addr) {
+        Free(seg);
+        return NULL;
+    }
+    register_segment(inst, addr, seg, path, segname, size_to_create);
+    return addr; 
+}
+
+int rvm_map_many(rvm_t rvm, int count, const char **segnames, int *sizes, void **segbases)
+{
+    instance_t* inst = get_instance(rvm);
+    if (!inst)
+        return -1;
+    async_drain();
+
+    /* create or extend every segment and record them in the manifest
+     * with a single rewrite */
+    char (*paths)[MAXLINE] = Malloc(count * sizeof(*paths));
+    int lock = dir_lock(rvm.directory, LOCK_EX);
+    manifest_t m;
+    if (manifest_load(rvm.directory, &m) < 0)
+        manifest_scan(rvm.directory, &m);
+    int changed = m.scanned;
+    int* found = (int*) Malloc(count * sizeof(int));
+    int i;
+    for (i = 0; i < count; i++) {
+        sprintf(paths[i], "%s/%s", rvm.directory, segnames[i]);
+        found[i] = check_segment(paths[i], sizes[i], inst->sparse);
+        if (found[i] < 0) { /* fail the batch before the manifest changes */
+            Free(found);
+            Free(m.entries);
+            dir_unlock(lock);
+            Free(paths);
+            for (i = 0; i < count; i++)
+                segbases[i] = NULL;
+            return -1;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        int size = found[i];
+        mentry_t* e = manifest_find(&m, segnames[i]);
+        if (!e)
+            e = manifest_add(&m, segnames[i]);
+        if (e->size != size) {
+            e->size = size;
+            changed = 1;
+        }
+    }
+    if (changed)
+        manifest_save(rvm.directory, &m);
+    Free(found);
+    Free(m.entries);
+    dir_unlock(lock);
+
+    /* one truncation pass for the whole batch */
+    if (!inst->lazy)
+        rvm_truncate_log(rvm);
+
+    /* load the segments on a pool of workers. Lazy segments only index
+     * their logs and install the fault handler, which stays serial */
+    map_job_t job;
+    job.inst = inst;
+    job.paths = paths;
+    job.segs = (segment_t**) Malloc(count * sizeof(segment_t*));
+    job.bases = segbases;
+    job.count = count;
+    job.next = 0;
+    for (i = 0; i < count; i++) {
+        job.segs[i] = (segment_t*) Malloc(sizeof(segment_t));
+        segbases[i] = NULL;
+    }
+
+    long nworkers = inst->lazy ? 1 : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers > count)
+        nworkers = count;
+    run_workers(map_worker, &job, nworkers);
+
+    /* publish the segments, or undo the whole batch if one failed */
+    int failed = 0;
+    for (i = 0; i < count; i++)
+        if (!segbases[i])
+            failed = 1;
+    for (i = 0; i < count; i++) {
+        if (failed) {
+            if (segbases[i])
+                free_segment(segbases[i], job.segs[i]);
+            Free(job.segs[i]);
+            segbases[i] = NULL;
+        } else {
+            register_segment(inst, segbases[i], job.segs[i], paths[i], segnames[i], sizes[i]);
+        }
+    }
+    Free(job.segs);
+    Free(paths);
+    return failed ? -1 : 0;
+}
+
+void *rvm_map_striped(rvm_t rvm, const char *segname, int size_to_create,
+        int stripe_size, int ndirs, const char **dirs)
+{
+    instance_t* inst = get_instance(rvm);
+    if (!inst)
+        return NULL;
+    async_drain();
+
+    /* an existing layout wins over the arguments, so the stripes are
+     * found where they were written */
+    char path[MAXLINE], layoutpath[MAXLINE + 8];
+    layout_t lay;
+    strcpy(path, rvm.directory);
+    strcat(path, "/");
+    strcat(path, segname);
+    sprintf(layoutpath, "%s.stripes", path);
+    if (read_layout(layoutpath, &lay) < 0) {
+        if (stripe_size <= 0 || stripe_size % PAGE_SIZE || ndirs <= 0) {
+            fprintf(stderr, "invalid stripe layout\n");
+            return NULL;
+        }
+        lay.stripe_size = stripe_size;
+        lay.size = 0;
+        lay.nstripes = 0;
+        lay.ndirs = ndirs;
+        lay.dirs = (char (*)[MAXLINE]) Malloc(ndirs * sizeof(*lay.dirs));
+        int d;
+        for (d = 0; d < ndirs; d++)
+            strcpy(lay.dirs[d], dirs[d]);
+    }
+    if (size_to_create > lay.size)
+        lay.size = size_to_create;
+    lay.nstripes = (lay.size + lay.stripe_size - 1) / lay.stripe_size;
+    if (write_layout(layoutpath, &lay) < 0) {
+        Free(lay.dirs);
+        return NULL;
+    }
+
+    /* every stripe is an ordinary segment in its directory */
+    segment_t* seg = (segment_t*) Malloc(sizeof(segment_t));
+    seg->nstripes = lay.nstripes;
+    seg->stripes = (segment_t**) Malloc(lay.nstripes * sizeof(segment_t*));
+    seg->stripe_size = lay.stripe_size;
+    seg->lazy = NULL;
+    seg->shm = NULL;
+    seg->parent = NULL;
+    int k;
+    for (k = 0; k < lay.nstripes; k++) {
+        segment_t* st = (segment_t*) Malloc(sizeof(segment_t));
+        memset(st, 0, sizeof(segment_t));
+        struct stat sb;
+        if (stat(lay.dirs[k % lay.ndirs], &sb) == -1)
+            mkdir(lay.dirs[k % lay.ndirs], 0777);
+        strcpy(st->dir, lay.dirs[k % lay.ndirs]);
+        sprintf(st->name, "%s.%d", segname, k);
+        get_stripe_path(st->path, &lay, segname, k);
+        st->stripe_offset = k * lay.stripe_size;
+        st->length = lay.size - st->stripe_offset < lay.stripe_size
+            ? lay.size - st->stripe_offset : lay.stripe_size;
+        st->parent = seg;
+        logbuf_init(&st->writer);
+        logbuf_init(&st->ship);
+        st->log_lock = -1;
+        int size = check_segment(st->path, st->length, inst->sparse);
+        manifest_update(st->dir, st->name, size, -1);
+        seg->stripes[k] = st;
+    }
+    Free(lay.dirs);
+
+    /* records from the next lsn of the last commit record on belong to a
+     * commit that did not reach every stripe, they are dropped */
+    char commitpath[MAXLINE + 8];
+    sprintf(commitpath, "%s.commit", path);
+    int ncommit;
+    seg->commit_seq = 0;
+    long long* limits = read_stripe_commit(commitpath, &ncommit, &seg->commit_seq);
+    for (k = 0; limits && k < ncommit && k < seg->nstripes; k++)
+        cut_stripe_log(seg->stripes[k], limits[k]);
+    Free(limits);
+
+    /* replay and load the stripes in parallel */
+    char* addr = (char*) alloc_segment(lay.size, inst->hugepages, 0, seg);
+    if (addr) {
+        stripe_job_t job;
+        job.inst = inst;
+        job.stripes = seg->stripes;
+        job.base = addr;
+        job.count = seg->nstripes;
+        job.next = 0;
+        job.failed = 0;
+        run_workers(stripe_loader, &job, seg->nstripes);
+        /* the logs are applied, so the record starts over for the
+         * current number of stripes, in both slots so that either one
+         * can be read on its own */
+        seg->commit_fd = job.failed ? -1 : open(commitpath, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (seg->commit_fd < 0 || write_stripe_commit(seg) < 0 || write_stripe_commit(seg) < 0) {
+            if (seg->commit_fd >= 0)
+                Close(seg->commit_fd);
+            free_segment(addr, seg);
+            addr = NULL;
+        }
+    }
+    if (!addr) {
+        for (k = 0; k < seg->nstripes; k++)
+            Free(seg->stripes[k]);
+        Free(seg->stripes);
+        Free(seg);
+        return NULL;
+    }
+
+    register_segment(inst, addr, seg, path, segname, lay.size);
+    return addr;
+}
+
+void rvm_unmap(rvm_t rvm, void *segbase)
+{
+    instance_t* inst = get_instance(rvm);
+    if (!inst)
+        return;
+    async_drain();
+
+    segment_t* seg = (segment_t*) ST_get(&inst->segments, segbase);
+    if (!seg) {
+        fprintf(stderr, "segment address does not exist\n");
+        return;
+    }
+    if (seg->snaps) {
+        fprintf(stderr, "cannot unmap a segment with an open read snapshot\n");
+        return;
+    }
+
+    release_segment(segbase, seg);
+    ST_erase(&inst->segments, segbase);
+}
+
+/* grow a mapped segment to new_size bytes without moving it. The data
+ * file is extended by the added bytes only, nothing is reloaded */
+int rvm_resize(rvm_t rvm, void* segbase, int new_size)
+{
+    instance_t* inst = get_instance(rvm);
+    if (!inst)
+        return -1;
+    async_drain();
+
+    segment_t* seg = (segment_t*) ST_get(&inst->segments, segbase);
+    if (!seg) {
+        fprintf(stderr, "segment address does not exist\n");
+        return -1;
+    }
+    if (new_size <= seg->length)
+        return 0; /* segments never shrink, as with rvm_map */
+    if (seg->lazy || seg->shm || seg->nstripes || seg->snaps) {
+        fprintf(stderr, "cannot resize a lazy, shared, striped or snapshotted segment\n");
+        return -1;
+    }
+
+    /* a segment mapped smaller than its data file holds the rest of the
+     * file already, only what the file lacks is filled */
+    int loaded = 0;
+    int fd = Open(seg->path, O_RDONLY);
+    int off = fd < 0 ? -1 : data_header(fd, &loaded);
+    if (fd >= 0)
+        Close(fd);
+    if (off < 0)
+        return -1;
+    if (loaded < seg->length)
+        loaded = seg->length;
+
+    /* memory first, if it cannot grow in place nothing has changed. A
+     * data file grown before a later failure keeps its size, as files
+     * never shrink */
+    size_t map_len = seg->map_len;
+    if (grow_memory(segbase, seg, new_size, loaded) < 0)
+        return -1;
+    int grown = check_segment(seg->path, new_size, 0) >= 0;
+    char path[MAXLINE];
+    int lock = -1;
+    if (grown && inst->standby[0]) { /* shipped records may land in the new part */
+        get_standby_path(path, inst, seg);
+        lock = dir_lock(inst->standby, LOCK_EX);
+        grown = check_segment(path, new_size, 0) >= 0;
+        if (!grown) {
+            fprintf(stderr, "cannot grow standby segment %s\n", path);
+            dir_unlock(lock);
+        }
+    }
+    if (!grown) {
+        /* the added memory goes back to the reservation */
+        if (seg->map_len > map_len)
+            mprotect((char*) segbase + map_len, seg->map_len - map_len, PROT_NONE);
+        seg->map_len = map_len;
+        return -1;
+    }
+    if (inst->standby[0]) {
+        manifest_set(inst->standby, seg->name, new_size, -1);
+        dir_unlock(lock);
+    }
+    manifest_update(seg->dir, seg->name, new_size, -1);
+
+    int old_bytes = (seg->length + PAGE_SIZE - 1) / PAGE_SIZE / 8 + 1;
+    int bytes = (new_size + PAGE_SIZE - 1) / PAGE_SIZE / 8 + 1;
+    seg->dirty_pages = (unsigned char*) realloc(seg->dirty_pages, bytes);
+    memset(seg->dirty_pages + old_bytes, 0, bytes - old_bytes);
+    seg->length = new_size;
+    return 0;
+}
+
+int rvm_seg_stats(rvm_t rvm, void* segbase, segstat_t* stats)
+{
+    instance_t* inst = get_instance(rvm);
+    if (!inst)
+        return -1;
+
+    segment_t* seg = (segment_t*) ST_get(&inst->segments, segbase);
+    if (!seg) {
+        fprintf(stderr, "segment address does not exist\n");
+        return -1;
+    }
+
+    stats->length = seg->length;
+    stats->alloc_mode = seg->alloc_mode;
+    stats->mapped_bytes = seg->map_len;
+    stats->pages_total = seg->lazy ? seg->lazy->npages
+            : (int) ((seg->length + sys_page_size() - 1) / sys_page_size());
+    stats->pages_loaded = seg->lazy ? seg->lazy->loaded : stats->pages_total;
+    return 0;
+}
+
+void rvm_destroy(rvm_t rvm, const char *segname)
+{
+    char path[MAXLINE], logpath[MAXLINE], ckptpath[MAXLINE];
+    strcpy(path, rvm.directory);
+    strcat(path, "/");
+    strcat(path, segname); 
+    get_logpath(logpath, path);
+    get_ckptpath(ckptpath, path);
+    async_drain();
+
+    /* a striped segment is destroyed stripe by stripe */
+    char layoutpath[MAXLINE + 8];
+    layout_t lay;
+    sprintf(layoutpath, "%s.stripes", path);
+    if (read_layout(layoutpath, &lay) == 0) {
+        int k;
+        for (k = 0; k < lay.nstripes; k++) {
+            char stripe[MAXLINE], stripelog[MAXLINE], stripeckpt[MAXLINE], name[MAXLINE];
+            get_stripe_path(stripe, &lay, segname, k);
+            get_logpath(stripelog, stripe);
+            get_ckptpath(stripeckpt, stripe);
+            remove(stripe);
+            remove(stripelog);
+            remove(stripeckpt);
+            sprintf(name, "%s.%d", segname, k);
+            manifest_remove(lay.dirs[k % lay.ndirs], name);
+        }
+        Free(lay.dirs);
+        char commitpath[MAXLINE + 8];
+        sprintf(commitpath, "%s.commit", path);
+        remove(commitpath);
+        remove(layoutpath);
+        return;
+    }
+
+    /* check if the file exists */
+    struct stat sb;
+    if (stat(path, &sb) == -1) {
+        return;
+    }
+
+    /* processes still attached keep their mapping */
+    char name[MAXLINE];
+    shm_name(name, &sb);
+    shm_unlink(name);
+
+    if (remove(path) != 0)
+        fprintf(stderr, "remove error\n");
+    if (remove(logpath) != 0)
+        fprintf(stderr, "remove error\n"); 
+    remove(ckptpath); /* only exists once the log was truncated */
+    manifest_remove(rvm.directory, segname);
+}
+
+trans_t rvm_begin_trans(rvm_t rvm, int numsegs, void **segbases)
+{
+    return rvm_begin_trans_flags(rvm, numsegs, segbases, 0);
+}
+
+trans_t rvm_begin_trans_flags(rvm_t rvm, int numsegs, void **segbases, int flags)
+{
+    instance_t* inst = get_instance(rvm);
+    if (!inst)
+        return (trans_t) -1;
+
+    trans_t curr = (trans_t) Malloc(sizeof(trans));
+    curr->segs = (void**) Malloc(numsegs * sizeof(void*));
+
+    /* check if segments have already been modified */
+    int i;
+    for(i = 0; i < numsegs; i++) {
+        segment_t* seg = (segment_t*) ST_get(&inst->segments, segbases[i]);
+        if (!seg)
+            fprintf(stderr, "Cannot find segbase [%lu]\n", (unsigned long) segbases[i]);
+        else if (seg->modified != 0)
+            fprintf(stderr, "Segment already modified\n");
+        if (!seg || seg->modified != 0) {
+            /* give back the segments claimed so far */
+            while (--i >= 0)
+                ((segment_t*) curr->segs[i])->modified = 0;
+            Free(curr->segs);
+            Free(curr);
+            return (trans_t) -1;
+        }
+        seg->modified = 1;
+        curr->segs[i] = seg;
+    }
+
+    /* shared segments stay locked against other processes until commit
+     * or abort. They are locked in one global order to avoid deadlocks */
+    segment_t** shared = (segment_t**) Malloc(numsegs * sizeof(segment_t*));
+    int nshared = 0;
+    for (i = 0; i < numsegs; i++)
+        if (((segment_t*) curr->segs[i])->shm)
+            shared[nshared++] = (segment_t*) curr->segs[i];
+    qsort(shared, nshared, sizeof(segment_t*), compare_shm);
+    for (i = 0; i < nshared; i++)
+        shm_lock(shared[i]);
+    Free(shared);
+
+    curr->rid = rvm.rid;
+    curr->segbases = segbases;
+    curr->numsegs = numsegs;
+    curr->flags = flags;
+    return curr;
+}
+
+void rvm_about_to_modify(trans_t tid, void *segbase, int offset, int size)
+{
+    /* check if segbase is initialized by rvm_begin_trans */
+    segment_t* seg = check_addr(tid, segbase);
+    if (!seg)
+        return;
+    if (size == 0) /* nothing to restore or log, and no record may be empty */
+        return;
+    
+    /* create and push the in memory undo log into undo logs list. A
+     * redo-only transaction only records the range for commit. Read
+     * snapshots keep their own copy of the pages before they change */
+    pthread_mutex_lock(&snap_lock);
+    if (seg->snaps)
+        snap_preserve(seg, segbase, offset, size);
+    instance_t* inst = registry[tid->rid].inst;
+    log_t* log = (log_t*) Malloc(sizeof(log_t));
+    log->size = size;
+    log->offset = offset;
+    log->data = NULL;
+    log->spill = -1;
+    log->charged = 0;
+    if (!(tid->flags & RVM_TRANS_NOUNDO) && undo_charge(inst, size)) {
+        log->data = (char*) Malloc(size);
+        log->charged = size;
+        memcpy(log->data, (char*) segbase + offset, size);
+    } else if (!(tid->flags & RVM_TRANS_NOUNDO)) {
+        undo_spill(seg, log, (char*) segbase + offset);
+    }
+    log->block = log->data;
+    list_push(seg->undo_log, log);
+    pthread_mutex_unlock(&snap_lock);
+}
+
+int rvm_about_to_modify_v(trans_t tid, range_t *ranges, int count)
+{
+    /* validate every range before declaring any of them */
+    range_t* sorted = (range_t*) Malloc(count * sizeof(range_t));
+    int i;
+    for (i = 0; i < count; i++) {
+        segment_t* seg = check_addr(tid, ranges[i].segbase);
+        if (!seg)
+            goto fail;
+        if (ranges[i].offset < 0 || ranges[i].size < 0
+                || ranges[i].offset > seg->length - ranges[i].size) {
+            fprintf(stderr, "range [%d, +%d) outside of segment\n", ranges[i].offset, ranges[i].size);
+            goto fail;
+        }
+        sorted[i] = ranges[i];
+    }
+
+    /* sort by segment and offset, then merge overlapping and adjacent
+     * ranges in place */
+    qsort(sorted, count, sizeof(range_t), compare_range);
+    int n = 0;
+    for (i = 0; i < count; i++) {
+        if (sorted[i].size == 0)
+            continue;
+        range_t* last = n ? &sorted[n - 1] : NULL;
+        if (last && last->segbase == sorted[i].segbase
+                && sorted[i].offset <= last->offset + last->size) {
+            int end = sorted[i].offset + sorted[i].size;
+            if (end > last->offset + last->size)
+                last->size = end - last->offset;
+        } else {
+            sorted[n++] = sorted[i];
+        }
+    }
+
+    /* one pass per segment: a single buffer holds every pre-image of the
+     * segment and the first log of the group owns it. The group is pushed
+     * in order, so abort frees the owner only after the other ranges */
+    pthread_mutex_lock(&snap_lock);
+    int start = 0;
+    while (start < n) {
+        int end = start, bytes = 0;
+        while (end < n && sorted[end].segbase == sorted[start].segbase)
+            bytes += sorted[end++].size;
+
+        segment_t* seg = check_addr(tid, sorted[start].segbase);
+        for (i = start; seg->snaps && i < end; i++)
+            snap_preserve(seg, sorted[i].segbase, sorted[i].offset, sorted[i].size);
+        int undo = !(tid->flags & RVM_TRANS_NOUNDO);
+        char* block = NULL;
+        if (undo && undo_charge(registry[tid->rid].inst, bytes))
+            block = (char*) Malloc(bytes);
+
+        char* p = block;
+        for (i = start; i < end; i++) {
+            log_t* log = (log_t*) Malloc(sizeof(log_t));
+            log->size = sorted[i].size;
+            log->offset = sorted[i].offset;
+            log->data = NULL;
+            log->spill = -1;
+            log->charged = i == start && block ? bytes : 0;
+            log->block = i == start ? block : NULL;
+            if (block) {
+                log->data = p;
+                memcpy(p, (char*) sorted[i].segbase + sorted[i].offset, sorted[i].size);
+                p += sorted[i].size;
+            } else if (undo) { /* over the budget */
+                undo_spill(seg, log, (char*) sorted[i].segbase + sorted[i].offset);
+            }
+            list_push(seg->undo_log, log);
+        }
+        start = end;
+    }
+    pthread_mutex_unlock(&snap_lock);
+
+    Free(sorted);
+    return 0;
+
+fail:
+    Free(sorted);
+    return -1;
+}
+
+void rvm_commit_trans(trans_t tid)
+{   /* apply changes in current transactions one by one */ 
+    instance_t* inst = registry[tid->rid].inst;
+
+    /* earlier async commits reach the log first */
+    async_drain();
+
+    /* take the undo logs of all segments at once, a read snapshot
+     * begun from here on sees the transaction as committed */
+    list_t* logs = (list_t*) Malloc(tid->numsegs * sizeof(list_t));
+    int i;
+    pthread_mutex_lock(&snap_lock);
+    for (i = 0; i < tid->numsegs; i++) {
+        segment_t* seg = (segment_t*) tid->segs[i];
+        logs[i] = *(list_t*) seg->undo_log;
+        list_init(seg->undo_log);
+    }
+    pthread_mutex_unlock(&snap_lock);
+
+    for (i = 0; i < tid->numsegs; i++) {   /* for each data segment */
+        segment_t* seg = (segment_t*) tid->segs[i]; 
+        if (seg->nstripes) {
+            node_t* node;
+            for (node = logs[i].front; node; node = node->next)
+                mark_dirty(seg, ((log_t*) node->value)->offset, ((log_t*) node->value)->size);
+            log_striped(seg, inst, &logs[i], tid->segbases[i]);
+            undo_reset(seg);
+            seg->modified = 0;
+            continue;
+        }
+        open_seg_log(seg, inst);
+        long long* lsn = seg->shm ? &seg->shm->next_lsn : &seg->next_lsn;
+        /* write modified segments according to the offset and size
+         * in undo logs. Then clear undo logs */
+        while (!list_empty(&logs[i])) {
+            log_t* log = (log_t*) list_pop_front(&logs[i]);
+            if (seg->lazy) /* the log write reads the range in the kernel */
+                lazy_prefault(seg->lazy, log->offset, log->size);
+            mark_dirty(seg, log->offset, log->size);
+            write_record(&seg->writer, (char*) tid->segbases[i] + log->offset,
+                    log->offset, log->size, inst->compress_min, lsn, !list_empty(&logs[i]));
+            undo_free(inst, log);
+            FAULT_POINT(); /* records staged, not yet written */
+        }
+        undo_reset(seg);
+        seg->modified = 0; /* reset modified bit for next transaction */
+        close_seg_log(seg);
+        FAULT_POINT(); /* one segment of several logged */
+        if (seg->shm)
+            pthread_mutex_unlock(&seg->shm->lock);
+    }
+
+    /* clear the entire transaction */
+    Free(logs);
+    Free(tid->segs);
+    Free(tid);
+}
+
+rvm_commit_t rvm_commit_trans_async(trans_t tid)
+{
+    /* other processes may not see a shared segment unlocked before its
+     * records are in the log, so those commit right away */
+    int i;
+    for (i = 0; i < tid->numsegs; i++) {
+        if (((segment_t*) tid->segs[i])->shm) {
+            rvm_commit_trans(tid);
+            pthread_mutex_lock(&async_lock);
+            rvm_commit_t ticket = ++async_issued;
+            /* a ticket is done only once all earlier ones are */
+            while (async_done < ticket - 1)
+                pthread_cond_wait(&async_done_cond, &async_lock);
+            if (async_done < ticket)
+                async_done = ticket;
+            pthread_cond_broadcast(&async_done_cond);
+            pthread_mutex_unlock(&async_lock);
+            return ticket;
+        }
+    }
+
+    commit_job_t* job = (commit_job_t*) Malloc(sizeof(commit_job_t));
+    job->next = NULL;
+    job->inst = registry[tid->rid].inst;
+    job->numsegs = tid->numsegs;
+    job->segs = tid->segs;
+    job->logs = (list_t*) Malloc(tid->numsegs * sizeof(list_t));
+
+    /* copy the redo images now, the caller may modify the segments
+     * again as soon as this returns. The first log of a segment owns
+     * the copy of all its ranges */
+    pthread_mutex_lock(&snap_lock);
+    for (i = 0; i < tid->numsegs; i++) {
+        segment_t* seg = (segment_t*) tid->segs[i];
+        list_init(&job->logs[i]);
+
+        int bytes = 0;
+        node_t* node;
+        for (node = ((list_t*) seg->undo_log)->front; node; node = node->next)
+            bytes += ((log_t*) node->value)->size;
+        char* block = bytes ? (char*) Malloc(bytes) : NULL;
+
+        char* p = block;
+        while (!list_empty(seg->undo_log)) {
+            log_t* log = (log_t*) list_pop_front(seg->undo_log);
+            Free(log->block); /* owners come last, see rvm_about_to_modify_v */
+            __atomic_sub_fetch(&job->inst->undo_bytes, log->charged, __ATOMIC_RELAXED);
+            log->charged = 0;
+            log->spill = -1;
+            memcpy(p, (char*) tid->segbases[i] + log->offset, log->size);
+            mark_dirty(seg, log->offset, log->size);
+            log->data = p;
+            log->block = list_empty(&job->logs[i]) ? block : NULL;
+            list_enqueue(&job->logs[i], log);
+            p += log->size;
+        }
+        undo_reset(seg);
+        seg->modified = 0;
+    }
+    pthread_mutex_unlock(&snap_lock);
+    Free(tid);
+
+    /* queue the job behind earlier ones. If no writer thread can be
+     * started the job is written here */
+    pthread_mutex_lock(&async_lock);
+    job->ticket = ++async_issued;
+    if (!async_started) {
+        pthread_t writer;
+        if (pthread_create(&writer, NULL, async_writer, NULL) == 0) {
+            pthread_detach(writer);
+            async_started = 1;
+        }
+    }
+    if (!async_started) {
+        while (async_done < job->ticket - 1)
+            pthread_cond_wait(&async_done_cond, &async_lock);
+        pthread_mutex_unlock(&async_lock);
+        rvm_commit_t ticket = write_jobs(job);
+        pthread_mutex_lock(&async_lock);
+        if (async_done < ticket)
+            async_done = ticket;
+        pthread_cond_broadcast(&async_done_cond);
+        pthread_mutex_unlock(&async_lock);
+        return ticket;
+    }
+    if (async_tail)
+        async_tail->next = job;
+    else
+        async_head = job;
+    async_tail = job;
+    rvm_commit_t ticket = job->ticket;
+    pthread_cond_signal(&async_work);
+    pthread_mutex_unlock(&async_lock);
+    return ticket;
+}
+
+int rvm_wait(rvm_commit_t handle)
+{
+    pthread_mutex_lock(&async_lock);
+    if (handle <= 0 || handle > async_issued) {
+        pthread_mutex_unlock(&async_lock);
+        fprintf(stderr, "invalid commit handle\n");
+        return -1;
+    }
+    while (async_done < handle)
+        pthread_cond_wait(&async_done_cond, &async_lock);
+    pthread_mutex_unlock(&async_lock);
+    return 0;
+}
+
+int rvm_poll(rvm_commit_t handle)
+{
+    pthread_mutex_lock(&async_lock);
+    int ret = async_done >= handle;
+    if (handle <= 0 || handle > async_issued) {
+        fprintf(stderr, "invalid commit handle\n");
+        ret = -1;
+    }
+    pthread_mutex_unlock(&async_lock);
+    return ret;
+}
+
+int rvm_abort_trans(trans_t tid)
+{   
+    /* without pre-images there is nothing to roll back to, the
+     * transaction stays open and has to be committed */
+    if (tid->flags & RVM_TRANS_NOUNDO) {
+        fprintf(stderr, "cannot abort a redo-only transaction\n");
+        return -1;
+    }
+
+    /* apply undo logs in a LIFO manner */ 
+    instance_t* inst = registry[tid->rid].inst;
+    int i;
+    pthread_mutex_lock(&snap_lock);
+    for (i = 0; i < tid->numsegs; i++) {
+        segment_t* seg = (segment_t*) tid->segs[i]; 
+
+        while (!list_empty(seg->undo_log)) {
+            log_t* log = (log_t*) list_pop_front(seg->undo_log);
+            /* copy undo log data back to segment base address + offset */
+            undo_read(seg, log, (char*) tid->segbases[i] + log->offset, 0, log->size);
+            undo_free(inst, log);
+        }
+        undo_reset(seg);
+        seg->modified = 0;
+        if (seg->shm)
+            pthread_mutex_unlock(&seg->shm->lock);
+    }
+    pthread_mutex_unlock(&snap_lock);
+
+    /* clear the entire transaction */
+    Free(tid->segs);
+    Free(tid); 
+    return 0;
+}
+
+snapshot_t rvm_begin_read_snapshot(rvm_t rvm, int numsegs, void **segbases)
+{
+    instance_t* inst = get_instance(rvm);
+    if (!inst)
+        return NULL;
+
+    snapshot_t snap = (snapshot_t) Malloc(sizeof(snapshot));
+    snap->numsegs = 0;
+    snap->segs = (snapseg_t**) Malloc(numsegs * sizeof(snapseg_t*));
+
+    pthread_mutex_lock(&snap_lock);
+    int i;
+    for (i = 0; i < numsegs; i++) {
+        segment_t* seg = (segment_t*) ST_get(&inst->segments, segbases[i]);
+        if (!seg) {
+            fprintf(stderr, "Cannot find segbase [%lu]\n", (unsigned long) segbases[i]);
+            goto fail;
+        }
+
+        if (seg->shm) {
+            fprintf(stderr, "cannot snapshot a segment shared with other processes\n");
+            goto fail;
+        }
+
+        /* the pages of an open transaction are taken with its pre-images
+         * laid over them, oldest last, so the snapshot sees the last
+         * committed state. Redo-only transactions have none to offer */
+        node_t* node;
+        for (node = ((list_t*) seg->undo_log)->front; node; node = node->next) {
+            log_t* log = (log_t*) node->value;
+            if (!log->data && log->spill < 0 && log->size) {
+                fprintf(stderr, "cannot snapshot a segment with an open redo-only transaction\n");
+                goto fail;
+            }
+        }
+
+        snapseg_t* ss = (snapseg_t*) Malloc(sizeof(snapseg_t));
+        ss->seg = seg;
+        ss->segbase = segbases[i];
+        ss->npages = (seg->length + PAGE_SIZE - 1) / PAGE_SIZE;
+        ss->pages = (char**) calloc(ss->npages ? ss->npages : 1, sizeof(char*));
+        ss->next = seg->snaps;
+        seg->snaps = ss;
+        snap->segs[snap->numsegs++] = ss;
+
+        for (node = ((list_t*) seg->undo_log)->front; node; node = node->next) {
+            log_t* log = (log_t*) node->value;
+            snap_preserve(seg, segbases[i], log->offset, log->size);
+        }
+        for (node = ((list_t*) seg->undo_log)->front; node; node = node->next) {
+            log_t* log = (log_t*) node->value;
+            int done = 0;
+            while (done < log->size) {
+                int at = log->offset + done;
+                int n = PAGE_SIZE - at % PAGE_SIZE;
+                if (n > log->size - done)
+                    n = log->size - done;
+                undo_read(seg, log, ss->pages[at / PAGE_SIZE] + at % PAGE_SIZE, done, n);
+                done += n;
+            }
+        }
+    }
+    pthread_mutex_unlock(&snap_lock);
+    return snap;
+
+fail:
+    pthread_mutex_unlock(&snap_lock);
+    rvm_end_read_snapshot(snap);
+    return NULL;
+}
+
+int rvm_snapshot_read(snapshot_t snap, void *segbase, int offset, void *buf, int size)
+{
+    snapseg_t* ss = NULL;
+    int i;
+    for (i = 0; i < snap->numsegs; i++)
+        if (snap->segs[i]->segbase == segbase)
+            ss = snap->segs[i];
+    if (!ss) {
+        fprintf(stderr, "segment is not part of the snapshot\n");
+        return -1;
+    }
+    if (offset < 0 || size < 0 || offset > ss->seg->length - size) {
+        fprintf(stderr, "range [%d, +%d) outside of segment\n", offset, size);
+        return -1;
+    }
+
+    /* page by page, so a writer waits for at most one page copy */
+    int done = 0;
+    while (done < size) {
+        int at = offset + done;
+        int n = PAGE_SIZE - at % PAGE_SIZE;
+        if (n > size - done)
+            n = size - done;
+        pthread_mutex_lock(&snap_lock);
+        char* page = ss->pages[at / PAGE_SIZE];
+        if (page)
+            memcpy((char*) buf + done, page + at % PAGE_SIZE, n);
+        else
+            memcpy((char*) buf + done, (char*) segbase + at, n);
+        pthread_mutex_unlock(&snap_lock);
+        done += n;
+    }
+    return 0;
+}
+
+void rvm_end_read_snapshot(snapshot_t snap)
+{
+    pthread_mutex_lock(&snap_lock);
+    int i;
+    for (i = 0; i < snap->numsegs; i++) {
+        snapseg_t* ss = snap->segs[i];
+        snapseg_t** p = &ss->seg->snaps;
+        while (*p != ss)
+            p = &(*p)->next;
+        *p = ss->next;
+        snap_free(ss);
+    }
+    pthread_mutex_unlock(&snap_lock);
+    Free(snap->segs);
+    Free(snap);
+}
+
+int rvm_set_standby(rvm_t rvm, const char *standby_dir)
+{
+    instance_t* inst = get_instance(rvm);
+    if (!inst)
+        return -1;
+    async_drain();
+
+    if (!standby_dir) {
+        inst->standby[0] = '\0';
+        return 0;
+    }
+    if (strcmp(standby_dir, rvm.directory) == 0) {
+        fprintf(stderr, "standby directory must differ from the rvm directory\n");
+        return -1;
+    }
+    struct stat st;
+    if (stat(standby_dir, &st) == -1)
+        mkdir(standby_dir, 0777);
+    strcpy(inst->standby, standby_dir);
+    clock_gettime(CLOCK_MONOTONIC, &inst->ship_start);
+
+    /* segments mapped from now on are seeded by rvm_map */
+    int ret = 0;
+    item_t* item;
+    for (item = inst->segments.head; item; item = item->next) {
+        segment_t* seg = (segment_t*) item->value;
+        if (!seg->shm && !seg->nstripes && seed_standby(inst, seg) < 0)
+            ret = -1;
+    }
+    if (inst->standby_apply)
+        standby_kick(inst->standby); /* the seeded logs */
+    return ret;
+}
+
+int rvm_standby_stats(rvm_t rvm, shipstat_t* stats)
+{
+    instance_t* inst = get_instance(rvm);
+    if (!inst)
+        return -1;
+    memset(stats, 0, sizeof(shipstat_t));
+    if (!inst->standby[0])
+        return 0;
+    async_drain();
+
+    /* the standby applies records in order, by the standby applier or
+     * an instance of its own, so its checkpoint tells how many shipped
+     * records it has not applied yet. The lock keeps a log that is
+     * being cleared out of the count */
+    int lock = dir_lock(inst->standby, LOCK_SH);
+    item_t* item;
+    for (item = inst->segments.head; item; item = item->next) {
+        segment_t* seg = (segment_t*) item->value;
+        if (seg->shm || seg->nstripes)
+            continue;
+        char path[MAXLINE], logpath[MAXLINE];
+        get_standby_path(path, inst, seg);
+        get_logpath(logpath, path);
+
+        ckpt_t ck;
+        read_ckpt(path, &ck);
+        struct stat st;
+        if (stat(logpath, &st) == 0 && st.st_size > ck.pos)
+            stats->lag_bytes += st.st_size - ck.pos;
+        if (seg->next_lsn - 1 > ck.lsn)
+            stats->lag_records += seg->next_lsn - 1 - ck.lsn;
+        stats->records_shipped += seg->ship_records;
+        stats->bytes_shipped += seg->ship_bytes;
+    }
+    dir_unlock(lock);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - inst->ship_start.tv_sec)
+        + (now.tv_nsec - inst->ship_start.tv_nsec) / 1e9;
+    if (elapsed > 0)
+        stats->bytes_per_sec = stats->bytes_shipped / elapsed;
+    return 0;
+}
+
+void rvm_truncate_log(rvm_t rvm)
+{
+    instance_t* inst = get_instance(rvm);
+    if (inst && inst->mem_checkpoint)
+        checkpoint_segments(inst); /* whatever is left is replayed */
+    truncate_logs(rvm, 0);
+
+    /* stripes may live in other directories */
+    item_t* item;
+    for (item = inst ? inst->segments.head : NULL; item; item = item->next) {
+        segment_t* seg = (segment_t*) item->value;
+        int k;
+        for (k = 0; k < seg->nstripes; k++)
+            truncate_stripe(seg->stripes[k]);
+    }
+}
+
+int rvm_truncate_log_step(rvm_t rvm, int max_bytes)
+{
+    if (max_bytes <= 0) {
+        fprintf(stderr, "invalid truncation budget\n");
+        return -1;
+    }
+    return truncate_logs(rvm, max_bytes);
+}
+
+/*
+ * private helper functions
+ */
+
+void get_logpath(char* logpath, char* path)
+{
+    /* <log dir>/<segment>.log when the data directory has one */
+    char* slash = strrchr(path, '/');
+    if (slash && nlogdirs) {
+        char dir[MAXLINE];
+        memcpy(dir, path, slash - path);
+        dir[slash - path] = '\0';
+        if (find_logdir(dir, logpath) == 0) {
+            strcat(logpath, slash);
+            strcat(logpath, ".log");
+            return;
+        }
+    }
+    strcpy(logpath, path);
+    strcat(logpath, ".log");
+}
+
+/* copy the log directory of a data directory into logdir, if any */
+int find_logdir(const char* dir, char* logdir)
+{
+    int i, found = -1;
+    pthread_mutex_lock(&logdir_lock);
+    for (i = 0; i < nlogdirs; i++) {
+        if (strcmp(logdirs[i].data, dir) == 0) {
+            if (logdir)
+                strcpy(logdir, logdirs[i].log);
+            found = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&logdir_lock);
+    return found;
+}
+
+void get_ckptpath(char* ckptpath, char* segpath)
+{
+    strcpy(ckptpath, segpath);
+    strcat(ckptpath, ".ckpt");
+}
+
+/* read the checkpoint of a segment, all zero if it has none yet */
+void read_ckpt(char* segpath, ckpt_t* ck)
+{
+    char ckptpath[MAXLINE];
+    get_ckptpath(ckptpath, segpath);
+    ck->lsn = 0;
+    ck->pos = 0;
+
+    int fd = open(ckptpath, O_RDONLY);
+    if (fd < 0)
+        return;
+    if (read(fd, ck, sizeof(ckpt_t)) != sizeof(ckpt_t)) {
+        ck->lsn = 0;
+        ck->pos = 0;
+    }
+    Close(fd);
+}
+
+/* durably record how far the log of a segment has been applied */
+void write_ckpt(char* segpath, ckpt_t* ck)
+{
+    char ckptpath[MAXLINE];
+    get_ckptpath(ckptpath, segpath);
+
+    int fd = open(ckptpath, O_WRONLY | O_CREAT, S_IRWXU);
+    if (fd < 0) {
+        fprintf(stderr, "checkpoint open error\n");
+        return;
+    }
+    if (Pwrite(fd, ck, sizeof(ckpt_t), 0) != sizeof(ckpt_t) || fdatasync(fd) < 0)
+        fprintf(stderr, "checkpoint write error\n");
+    Close(fd);
+}
+
+/* apply the logs in the rvm directory. With a budget only that many
+ * bytes of log are applied, resuming from the segment checkpoints on
+ * the next call. Returns 1 while logs remain, 0 when all are cleared.
+ * This does not depend on the in memory segment table, since it is
+ * required to work after a crash. Only the segments the manifest marks
+ * as having a log are visited */
+int truncate_logs(rvm_t rvm, int budget)
+{
+    /* the logs may be replaced by empty files */
+    async_drain();
+    reset_log_writers();
+    return truncate_dir(rvm.directory, budget);
+}
+
+/* apply the logs of the segments the manifest of a directory marks,
+ * up to budget log bytes, 0 for all. Logs written by this process must
+ * be closed, or opened per append under the directory lock as standby
+ * logs are. Returns 1 if records remain */
+int truncate_dir(const char* dir, int budget)
+{
+    int lock = dir_lock(dir, LOCK_EX);
+    manifest_t m;
+    if (manifest_load(dir, &m) < 0)
+        manifest_scan(dir, &m); /* directory from before manifests */
+
+    int used = 0, remaining = 0, changed = 0;
+    int i;
+    for (i = 0; i < m.n; i++) {
+        /* a stripe log may end in a commit without its commit record,
+         * which only its striped segment can cut, see cut_stripe_log */
+        if (!m.entries[i].dirty || m.entries[i].dirty == STRIPE_DIRTY)
+            continue;
+        if (budget && used >= budget) {
+            remaining = 1;
+            break;
+        }
+
+        char logpath[MAXLINE], segpath[MAXLINE];
+        strcpy(segpath, dir);
+        strcat(segpath, "/"); 
+        strcat(segpath, m.entries[i].name);
+        get_logpath(logpath, segpath);
+
+        if (apply_log(logpath, segpath, budget ? budget - used : 0, &used) == 0) {
+            remaining = 1;
+        } else {
+            m.entries[i].dirty = 0;
+            changed = 1;
+        }
+    }
+    if (changed || m.scanned)
+        manifest_save(dir, &m);
+    Free(m.entries);
+    dir_unlock(lock);
+    return remaining;
+}
+
+/* allocate the memory of a segment and fill it from its data file, or
+ * set it up for lazy recovery */
+void* load_segment(instance_t* inst, char* path, segment_t* seg)
+{
+    ckpt_t ck;
+    read_ckpt(path, &ck);
+    seg->next_lsn = ck.lsn + 1;
+    seg->lazy = NULL;
+    seg->shm = NULL;
+    seg->nstripes = 0;
+    seg->stripes = NULL;
+    seg->parent = NULL;
+    seg->reserve_len = 0;
+    seg->sparse = 0;
+    if (inst->shared)
+        return map_shared(path, seg);
+    if (inst->lazy)
+        return map_lazy(path, seg);
+    return recover_data(path, seg, inst->hugepages, inst->reserve);
+}
+
+/* fill in the bookkeeping of a loaded segment and insert the
+ * addr->segment pair in the segment table */
+void register_segment(instance_t* inst, void* addr, segment_t* seg,
+        char* path, const char* segname, int size)
+{
+    strcpy(seg->path, path);
+    strcpy(seg->name, segname);
+    strcpy(seg->dir, inst->directory);
+    seg->length = size;
+    seg->log_dirty = 0;
+    seg->modified = 0;
+    seg->snaps = NULL;
+    seg->dirty_pages = (unsigned char*) calloc((size + PAGE_SIZE - 1) / PAGE_SIZE / 8 + 1, 1);
+    seg->undo_log = Malloc(sizeof(list_t));
+    list_init(seg->undo_log);
+    seg->undo_fd = -1;
+    seg->undo_end = 0;
+    logbuf_init(&seg->writer);
+    logbuf_init(&seg->ship);
+    seg->log_lock = -1;
+    ST_put(&inst->segments, addr, seg);
+    if (inst->standby[0] && !seg->shm && !seg->nstripes)
+        seed_standby(inst, seg);
+}
+
+/* run fn on nworkers threads, the caller being one of them. fn takes
+ * work items from the job until none are left */
+void run_workers(void* (*fn)(void*), void* job, int nworkers)
+{
+    if (nworkers > MAP_WORKERS_MAX)
+        nworkers = MAP_WORKERS_MAX;
+    pthread_t workers[MAP_WORKERS_MAX];
+    int started = 0, i;
+    for (i = 1; i < nworkers; i++) {
+        if (pthread_create(&workers[started], NULL, fn, job) != 0)
+            break;
+        started++;
+    }
+    fn(job); /* the caller works too */
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+}
+
+/* load segments of a batch until none are left */
+void* map_worker(void* arg)
+{
+    map_job_t* job = (map_job_t*) arg;
+    int i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+        job->bases[i] = load_segment(job->inst, job->paths[i], job->segs[i]);
+    return NULL;
+}
+
+/* reserve bytes of the undo budget for pre-images kept in memory.
+ * Returns 0 when they would go over it */
+int undo_charge(instance_t* inst, int bytes)
+{
+    long long now = __atomic_add_fetch(&inst->undo_bytes, bytes, __ATOMIC_RELAXED);
+    if (inst->undo_budget && now > inst->undo_budget) {
+        __atomic_sub_fetch(&inst->undo_bytes, bytes, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+/* write the pre-image of a log to the undo file of its segment. The
+ * file is unlinked as soon as it is created: pre-images only matter to
+ * the process that may abort, recovery never reads them */
+void undo_spill(segment_t* seg, log_t* log, char* src)
+{
+    if (seg->undo_fd < 0) {
+        /* an unnamed file next to the segment, private to this process
+         * from the start, or a unique name unlinked at once where the
+         * file system has no O_TMPFILE */
+        char path[MAXLINE + 16];
+        strcpy(path, seg->path);
+        char* slash = strrchr(path, '/');
+        if (slash)
+            *slash = '\0';
+        else
+            strcpy(path, ".");
+#ifdef O_TMPFILE
+        seg->undo_fd = open(path, O_RDWR | O_TMPFILE, S_IRUSR | S_IWUSR);
+#endif
+        if (seg->undo_fd < 0) {
+            sprintf(path, "%s.undo.XXXXXX", seg->path);
+            seg->undo_fd = mkstemp(path);
+            if (seg->undo_fd >= 0)
+                unlink(path);
+        }
+    }
+    int done = 0;
+    while (seg->undo_fd >= 0 && done < log->size) {
+        ssize_t n = Pwrite(seg->undo_fd, src + done, log->size - done, seg->undo_end + done);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    if (done < log->size) { /* keep it in memory after all */
+        fprintf(stderr, "undo spill error\n");
+        log->data = log->block = (char*) Malloc(log->size);
+        memcpy(log->data, src, log->size);
+        return;
+    }
+    log->spill = seg->undo_end;
+    seg->undo_end += log->size;
+}
+
+/* copy n bytes of a pre-image, starting from byte from, to dst */
+void undo_read(segment_t* seg, log_t* log, char* dst, int from, int n)
+{
+    if (log->spill < 0) {
+        memcpy(dst, log->data + from, n);
+        return;
+    }
+    int done = 0;
+    while (done < n) {
+        ssize_t r = pread(seg->undo_fd, dst + done, n - done, log->spill + from + done);
+        if (r <= 0) {
+            fprintf(stderr, "undo read error\n");
+            return;
+        }
+        done += r;
+    }
+}
+
+void undo_free(instance_t* inst, log_t* log)
+{
+    if (log->charged)
+        __atomic_sub_fetch(&inst->undo_bytes, log->charged, __ATOMIC_RELAXED);
+    Free(log->block);
+    Free(log);
+}
+
+/* drop the spilled pre-images of a finished transaction */
+void undo_reset(segment_t* seg)
+{
+    if (seg->undo_end && ftruncate(seg->undo_fd, 0) < 0)
+        fprintf(stderr, "undo truncate error\n");
+    seg->undo_end = 0;
+}
+
+/* append the committed ranges of a striped segment to the logs of the
+ * stripes they fall in, and free the ranges. Ranges are read from the
+ * segment memory, or from their own copy when segbase is NULL. Large
+ * commits that touch several stripes write them in parallel */
+void log_striped(segment_t* seg, instance_t* inst, list_t* logs, char* segbase)
+{
+    stripe_write_t* w = (stripe_write_t*) calloc(seg->nstripes, sizeof(stripe_write_t));
+    int pass, k;
+    long long bytes = 0;
+    for (pass = 0; pass < 2; pass++) {
+        node_t* node;
+        for (node = logs->front; node; node = node->next) {
+            log_t* log = (log_t*) node->value;
+            char* data = segbase ? segbase + log->offset : log->data;
+            int done = 0;
+            while (done < log->size) {
+                int at = log->offset + done;
+                k = at / seg->stripe_size;
+                int n = (k + 1) * seg->stripe_size - at;
+                if (n > log->size - done)
+                    n = log->size - done;
+                if (pass == 1) {
+                    piece_t* p = &w[k].pieces[w[k].n];
+                    p->data = data + done;
+                    p->offset = at - k * seg->stripe_size;
+                    p->size = n;
+                    bytes += n;
+                }
+                w[k].n++;
+                done += n;
+            }
+        }
+        if (pass == 0) {
+            for (k = 0; k < seg->nstripes; k++) {
+                w[k].stripe = seg->stripes[k];
+                w[k].pieces = w[k].n ? (piece_t*) Malloc(w[k].n * sizeof(piece_t)) : NULL;
+                w[k].n = 0;
+            }
+        }
+    }
+
+    int touched = 0;
+    for (k = 0; k < seg->nstripes; k++)
+        touched += w[k].n > 0;
+
+    stripe_job_t job;
+    job.inst = inst;
+    job.writes = w;
+    job.count = seg->nstripes;
+    job.next = 0;
+    job.failed = 0;
+    run_workers(stripe_writer, &job, bytes >= STRIPE_PARALLEL_MIN ? touched : 1);
+    FAULT_POINT(); /* stripes logged, commit record not written */
+    if (touched)
+        write_stripe_commit(seg);
+
+    for (k = 0; k < seg->nstripes; k++)
+        Free(w[k].pieces);
+    Free(w);
+    while (!list_empty(logs))
+        undo_free(inst, (log_t*) list_pop_front(logs));
+}
+
+/* write the pieces of stripes until none are left */
+void* stripe_writer(void* arg)
+{
+    stripe_job_t* job = (stripe_job_t*) arg;
+    int k;
+    while ((k = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+        stripe_write_t* w = &job->writes[k];
+        if (!w->n)
+            continue;
+        open_seg_log(w->stripe, job->inst);
+        int i;
+        for (i = 0; i < w->n; i++)
+            write_record(&w->stripe->writer, w->pieces[i].data, w->pieces[i].offset,
+                    w->pieces[i].size, job->inst->compress_min, &w->stripe->next_lsn,
+                    i < w->n - 1);
+        close_seg_log(w->stripe);
+    }
+    return NULL;
+}
+
+/* replay the log of stripes and read them into the segment memory
+ * until none are left */
+void* stripe_loader(void* arg)
+{
+    stripe_job_t* job = (stripe_job_t*) arg;
+    int k;
+    while ((k = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+        segment_t* st = job->stripes[k];
+        truncate_stripe(st);
+
+        ckpt_t ck;
+        read_ckpt(st->path, &ck);
+        st->next_lsn = ck.lsn + 1;
+
+        int fd = Open(st->path, O_RDONLY);
+        int size;
+        int off = fd >= 0 ? data_header(fd, &size) : -1;
+        st->sparse = off == SPARSE_HEADER;
+        if (off < 0 || load_data(fd, off, job->base + st->stripe_offset, st->length, st->sparse) < 0)
+            job->failed = 1;
+        if (fd >= 0)
+            Close(fd);
+    }
+    return NULL;
+}
+
+/* write the commit record of a striped segment: the next lsn of every
+ * stripe once a commit is in all of their logs. Like the logs it is
+ * written, not synced. The record has two slots, written in turn, each
+ * the commit sequence number, the number of stripes, the lsns and a
+ * check sum, so a torn write leaves the other slot intact */
+int write_stripe_commit(segment_t* seg)
+{
+    int n = seg->nstripes, k;
+    size_t len = (n + 3) * sizeof(long long);
+    long long* slot = (long long*) Malloc(len);
+    slot[0] = ++seg->commit_seq;
+    slot[1] = n;
+    for (k = 0; k < n; k++)
+        slot[k + 2] = seg->stripes[k]->next_lsn;
+    slot[n + 2] = 0;
+    for (k = 0; k < n + 2; k++)
+        slot[n + 2] = slot[n + 2] * 31 + slot[k];
+    int ret = 0;
+    if (Pwrite(seg->commit_fd, slot, len, (slot[0] % 2) * len) != (ssize_t) len) {
+        fprintf(stderr, "stripe commit write error\n");
+        ret = -1;
+    }
+    Free(slot);
+    return ret;
+}
+
+/* read the newest intact slot of a commit record. Returns the lsns of
+ * its n stripes, to free by the caller, or NULL without a record */
+long long* read_stripe_commit(const char* path, int* n, long long* seq)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0)
+        return NULL;
+    /* both slots are written when the record is created, so its size
+     * gives the number of stripes, and each slot is checked alone */
+    if (fstat(fd, &st) < 0 || st.st_size % (2 * sizeof(long long)) != 0
+            || st.st_size / (2 * sizeof(long long)) <= 3
+            || st.st_size / (2 * sizeof(long long)) > INT_MAX / 8) {
+        Close(fd);
+        return NULL;
+    }
+    *n = (int) (st.st_size / (2 * sizeof(long long))) - 3;
+    size_t len = (*n + 3) * sizeof(long long);
+    long long* slot = (long long*) Malloc(len);
+    long long* lsns = NULL;
+    int i, k;
+    for (i = 0; i < 2; i++) {
+        if (pread(fd, slot, len, i * len) != (ssize_t) len || slot[1] != *n)
+            continue;
+        long long sum = 0;
+        for (k = 0; k < *n + 2; k++)
+            sum = sum * 31 + slot[k];
+        if (sum != slot[*n + 2] || (lsns && slot[0] < *seq))
+            continue;
+        if (!lsns)
+            lsns = (long long*) Malloc(*n * sizeof(long long));
+        memcpy(lsns, slot + 2, *n * sizeof(long long));
+        *seq = slot[0];
+    }
+    Free(slot);
+    Close(fd);
+    return lsns;
+}
+
+/* cut the log of a stripe before its first record numbered limit or
+ * later. A commit is one frame per stripe, so the cut falls between
+ * commits */
+void cut_stripe_log(segment_t* stripe, long long limit)
+{
+    char logpath[MAXLINE];
+    get_logpath(logpath, stripe->path);
+    int fd = open(logpath, O_RDWR);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        if (fd >= 0)
+            Close(fd);
+        return;
+    }
+    char* log = (char*) Mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    int pos = 0, start = 0;
+    logrec_t rec;
+    logrec_init(&rec);
+    while (log_next(log, st.st_size, &pos, &rec)) {
+        if (rec.lsn >= limit) {
+            if (ftruncate(fd, start) < 0 || fdatasync(fd) < 0)
+                fprintf(stderr, "cannot drop uncommitted stripe records\n");
+            break;
+        }
+        start = pos;
+    }
+    Munmap(log, st.st_size);
+    Close(fd);
+}
+
+/* apply the log of one stripe and clear it in its directory manifest */
+int truncate_stripe(segment_t* stripe)
+{
+    char logpath[MAXLINE];
+    get_logpath(logpath, stripe->path);
+    logbuf_close(&stripe->writer);
+    stripe->log_dirty = 0;
+
+    int used = 0;
+    int lock = dir_lock(stripe->dir, LOCK_EX);
+    int done = apply_log(logpath, stripe->path, 0, &used);
+    if (done)
+        manifest_set(stripe->dir, stripe->name, -1, 0);
+    dir_unlock(lock);
+    return done ? 0 : -1;
+}
+
+/* the layout of a striped segment, kept in <segment>.stripes:
+ *     rvm-stripes 1
+ *     <stripe size> <segment size> <number of directories>
+ *     <directory>        one line each, stripe k lives in k % n
+ */
+int read_layout(const char* path, layout_t* lay)
+{
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return -1;
+    char line[MAXLINE];
+    lay->dirs = NULL;
+    if (!fgets(line, sizeof(line), f) || strncmp(line, STRIPES_HEADER, strlen(STRIPES_HEADER))
+            || fscanf(f, "%d %d %d\n", &lay->stripe_size, &lay->size, &lay->ndirs) != 3
+            || lay->stripe_size <= 0 || lay->ndirs <= 0) {
+        fprintf(stderr, "corrupt stripe layout %s\n", path);
+        fclose(f);
+        return -1;
+    }
+    lay->dirs = (char (*)[MAXLINE]) Malloc(lay->ndirs * sizeof(*lay->dirs));
+    int d;
+    for (d = 0; d < lay->ndirs; d++) {
+        if (!fgets(lay->dirs[d], MAXLINE, f)) {
+            fprintf(stderr, "corrupt stripe layout %s\n", path);
+            Free(lay->dirs);
+            fclose(f);
+            return -1;
+        }
+        lay->dirs[d][strcspn(lay->dirs[d], "\n")] = '\0';
+    }
+    fclose(f);
+    lay->nstripes = (lay->size + lay->stripe_size - 1) / lay->stripe_size;
+    return 0;
+}
+
+/* rewrite a layout through a synced temporary file */
+int write_layout(const char* path, layout_t* lay)
+{
+    char tmppath[MAXLINE + 16];
+    sprintf(tmppath, "%s.tmp", path);
+    FILE* f = fopen(tmppath, "w");
+    if (!f) {
+        fprintf(stderr, "cannot write stripe layout\n");
+        return -1;
+    }
+    fprintf(f, "%s\n%d %d %d\n", STRIPES_HEADER, lay->stripe_size, lay->size, lay->ndirs);
+    int d;
+    for (d = 0; d < lay->ndirs; d++)
+        fprintf(f, "%s\n", lay->dirs[d]);
+    fflush(f);
+    fdatasync(fileno(f));
+    fclose(f);
+    return rename(tmppath, path);
+}
+
+void get_stripe_path(char* path, layout_t* lay, const char* segname, int k)
+{
+    sprintf(path, "%s/%s.%d", lay->dirs[k % lay->ndirs], segname, k);
+}
+
+/* look up the state of an rvm instance, rejecting stale handles */
+instance_t* get_instance(rvm_t rvm)
+{
+    if (rvm.rid < 0 || rvm.rid >= registry_size || !registry[rvm.rid].inst
+            || registry[rvm.rid].gen != rvm.gen) {
+        fprintf(stderr, "invalid rvm instance\n");
+        return NULL;
+    }
+    return registry[rvm.rid].inst;
+}
+
+/* free the memory and bookkeeping of a mapped segment */
+void release_segment(void* segbase, segment_t* seg)
+{
+    int k;
+    for (k = 0; k < seg->nstripes; k++) {
+        logbuf_close(&seg->stripes[k]->writer);
+        Free(seg->stripes[k]->writer.buf);
+        Free(seg->stripes[k]);
+    }
+    Free(seg->stripes);
+    if (seg->nstripes)
+        Close(seg->commit_fd);
+    logbuf_close(&seg->writer);
+    Free(seg->writer.buf);
+    Free(seg->ship.buf);
+    free_segment(segbase, seg); /* free the actual segment in memory */
+    Free(seg->undo_log); /* free undo log stack */
+    if (seg->undo_fd >= 0)
+        Close(seg->undo_fd);
+    Free(seg->dirty_pages);
+    Free(seg); /* free the segment struct */
+}
+
+/* check whether a segment exists. If it does not exist, it will 
+ * create the directory. If it exist but size is shorter than 
+ * size_to_create, it will elongate the segment size to size_to_create.
+ * New sparse files leave the data as a hole, and sparse files grow by
+ * their length alone. Returns the segment size, or -1 if an existing
+ * segment could not be extended, in which case it keeps its old size */
+int check_segment(char* filename, int size_to_create, int sparse)
+{
+    char logpath[MAXLINE];
+    get_logpath(logpath, filename);
+    struct stat st;
+
+    if (stat(filename, &st) == -1) { /* log segment does not exist */
+        int data_fd = creat(filename, S_IRWXU); /* create data segment */
+        creat(logpath, S_IRWXU); /* create log segment */
+        if (sparse) {
+            int header[2] = { SPARSE_MAGIC, size_to_create };
+            Write(data_fd, header, sizeof(header));
+            if (ftruncate(data_fd, SPARSE_HEADER + (off_t) size_to_create) < 0)
+                fprintf(stderr, "ftruncate error\n");
+            Close(data_fd);
+            return size_to_create;
+        }
+        Write(data_fd, &size_to_create, sizeof(size_to_create));
+        FAULT_POINT(); /* data file without its log */
+        fill_segment(data_fd, size_to_create); /* fill the data segment with 0 */
+        Close(data_fd);
+    } else {
+        int current_size = 0;
+        int fd = Open(filename, O_RDWR);
+        if (fd < 0)
+            return -1;
+        int off = data_header(fd, &current_size);
+
+        /* the data first, a failure or crash leaves a longer file of
+         * the old size */
+        if (off == SPARSE_HEADER && current_size < size_to_create) {
+            if (ftruncate(fd, SPARSE_HEADER + (off_t) size_to_create) < 0) {
+                fprintf(stderr, "ftruncate error\n");
+                size_to_create = -1;
+            } else {
+                FAULT_POINT(); /* sparse data grown before the header */
+                Pwrite(fd, &size_to_create, sizeof(int), sizeof(int));
+            }
+        } else if (current_size < size_to_create) {
+            /* elongate the data segment if necessary */
+            lseek(fd, current_size + sizeof(size_to_create), SEEK_SET);
+            if (fill_segment(fd, size_to_create - current_size) < 0) { /* fill the rest file with 0 */
+                size_to_create = -1;
+            } else {
+                FAULT_POINT(); /* data grown before the header */
+                Pwrite(fd, &size_to_create, sizeof(int), 0);
+            }
+        } else {
+            size_to_create = current_size;
+        }
+        Close(fd); 
+    }
+    return size_to_create;
+}
+
+
+/* check whether a segment address is associated with a transaction and
+ * return its segment */
+segment_t* check_addr(trans_t tid, void* segbase)
+{
+    int i;
+    for (i = 0; i < tid->numsegs; i++)
+        if (tid->segbases[i] == segbase)
+            return (segment_t*) tid->segs[i];
+    fprintf(stderr, "segment address not associated with transaction\n");
+    return NULL;
+}
+
+/* order ranges by segment, then by offset */
+int compare_range(const void* a, const void* b)
+{
+    const range_t* x = (const range_t*) a;
+    const range_t* y = (const range_t*) b;
+    if (x->segbase != y->segbase)
+        return (char*) x->segbase < (char*) y->segbase ? -1 : 1;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/* write count '0' characters at the current file position, a chunk
+ * at a time rather than one byte per write. Returns -1 on a failed write */
+int fill_segment(int fd, int count)
+{
+    char chunk[FILL_CHUNK];
+    memset(chunk, '0', sizeof(chunk));
+    while (count > 0) {
+        int n = count < FILL_CHUNK ? count : FILL_CHUNK;
+        if (Write(fd, chunk, n) != n) {
+            fprintf(stderr, "fill segment error\n");
+            return -1;
+        }
+        count -= n;
+    }
+    return 0;
+}
+
+/* read the size header of a data file. Returns the offset its data
+ * starts at: sizeof(int) in files of the size followed by the data,
+ * SPARSE_HEADER in sparse files, or -1 if there is no header */
+int data_header(int fd, int* size)
+{
+    int header[2];
+    ssize_t n = pread(fd, header, sizeof(header), 0);
+    if (n >= (ssize_t) sizeof(int) && header[0] >= 0) {
+        *size = header[0];
+        return sizeof(int);
+    }
+    if (n == sizeof(header) && header[0] == SPARSE_MAGIC) {
+        *size = header[1];
+        return SPARSE_HEADER;
+    }
+    return -1;
+}
+
+/* read size bytes of segment data, stored at offset off of fd, into
+ * dst. With sparse set only the allocated extents are read, dst must
+ * hold zeros already, so holes cost neither reads nor memory. Returns
+ * -1 if the file ends early */
+int load_data(int fd, int off, char* dst, size_t size, int sparse)
+{
+    off_t at = off, end = off + (off_t) size;
+    while (at < end) {
+        off_t data = sparse ? lseek(fd, at, SEEK_DATA) : at;
+        if (data < 0 || data >= end)
+            break; /* only holes left */
+        off_t hole = sparse ? lseek(fd, data, SEEK_HOLE) : end;
+        if (hole < 0 || hole > end)
+            hole = end;
+        while (data < hole) {
+            ssize_t n = pread(fd, dst + (data - off), hole - data, data);
+            if (n <= 0)
+                return -1;
+            data += n;
+        }
+        at = hole;
+    }
+    return 0;
+}
+
+/* whether n bytes at p are all zero */
+int is_zero(const char* p, size_t n)
+{
+    return n == 0 || (p[0] == 0 && memcmp(p, p + 1, n - 1) == 0);
+}
+
+/* free the blocks of n zero bytes at offset at of a sparse data file.
+ * Returns -1 where the file system cannot punch holes */
+int punch_hole(int fd, off_t at, size_t n)
+{
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, at, n);
+}
+
+/* allocate anonymous memory for a segment. Depending on the huge page
+ * policy this tries explicit hugetlb pages first, then transparent huge
+ * pages and finally falls back to regular pages. The mode actually used
+ * is recorded in the segment struct so it can be released and reported.
+ * Regular pages reserve address space for reserve bytes in all, for
+ * rvm_resize to grow into */
+/* the page size of the system, the unit of mprotect and mremap. PAGE_SIZE
+ * stays the unit of the file formats and the page bookkeeping */
+size_t sys_page_size(void)
+{
+    static size_t page = 0;
+    if (!page) {
+        long n = sysconf(_SC_PAGESIZE);
+        page = n > 0 ? (size_t) n : PAGE_SIZE;
+    }
+    return page;
+}
+
+void* alloc_segment(size_t size, int hugepages, size_t reserve, segment_t* seg)
+{
+    void* addr;
+    size_t len;
+
+    if (size == 0)
+        size = 1; /* mmap refuses zero length mappings */
+
+    if (hugepages == RVM_HUGEPAGES_EXPLICIT && size >= HUGE_PAGE_SIZE) {
+        len = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (addr != MAP_FAILED) {
+            seg->alloc_mode = RVM_ALLOC_HUGETLB;
+            seg->map_len = len;
+            seg->reserve_len = len;
+            return addr;
+        }
+        /* no hugetlb pages reserved, fall back to transparent ones */
+    }
+
+    size_t page = sys_page_size();
+    len = (size + page - 1) & ~(page - 1);
+    size_t span = (reserve + page - 1) & ~(page - 1);
+    if (span > len) { /* inaccessible and uncharged past the segment */
+        addr = Mmap(NULL, span, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (addr != MAP_FAILED && mprotect(addr, len, PROT_READ | PROT_WRITE) < 0) {
+            Munmap(addr, span);
+            addr = MAP_FAILED;
+        }
+    } else {
+        span = len;
+        addr = Mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (addr == MAP_FAILED)
+        return NULL;
+    seg->alloc_mode = RVM_ALLOC_PAGES;
+    seg->map_len = len;
+    seg->reserve_len = span;
+
+#ifdef MADV_HUGEPAGE
+    if (hugepages != RVM_HUGEPAGES_OFF && size >= HUGE_PAGE_SIZE
+            && madvise(addr, len, MADV_HUGEPAGE) == 0)
+        seg->alloc_mode = RVM_ALLOC_THP;
+#endif
+    return addr;
+}
+
+void free_segment(void* segbase, segment_t* seg)
+{
+    if (seg->shm) {
+        Munmap((char*) segbase - SHM_HEADER, seg->map_len);
+        Close(seg->shm_fd); /* drops this process from the users */
+        return;
+    }
+    if (seg->lazy)
+        unmap_lazy(seg->lazy);
+    Munmap(segbase, seg->reserve_len > seg->map_len ? seg->reserve_len : seg->map_len);
+}
+
+/* extend the memory of a segment in place to size bytes: into its
+ * reserved address range, else by mremap when the addresses after it
+ * are free. Only the bytes past the loaded ones are touched, set to the
+ * '0' fill of the data file */
+int grow_memory(void* segbase, segment_t* seg, int size, int loaded)
+{
+    size_t unit = seg->alloc_mode == RVM_ALLOC_HUGETLB ? HUGE_PAGE_SIZE : sys_page_size();
+    size_t len = ((size_t) size + unit - 1) & ~(unit - 1);
+    char* end = (char*) segbase + seg->map_len;
+    if (len > seg->map_len) {
+        size_t have = seg->reserve_len > seg->map_len ? seg->reserve_len : seg->map_len;
+        if (len > have) {
+            /* make the reservation one mapping again for mremap */
+            if (have > seg->map_len && mprotect(end, have - seg->map_len, PROT_READ | PROT_WRITE) < 0)
+                have = seg->map_len;
+            if (mremap(segbase, have, len, 0) == MAP_FAILED) {
+                if (have > seg->map_len) /* the reservation stays inaccessible */
+                    mprotect(end, have - seg->map_len, PROT_NONE);
+                fprintf(stderr, "cannot grow segment in place, reserve address space with RVM_OPT_RESERVE\n");
+                return -1;
+            }
+            seg->reserve_len = len;
+        } else if (mprotect(end, len - seg->map_len, PROT_READ | PROT_WRITE) < 0) {
+            fprintf(stderr, "mprotect error\n");
+            return -1;
+        }
+#ifdef MADV_HUGEPAGE
+        if (seg->alloc_mode == RVM_ALLOC_THP)
+            madvise(end, len - seg->map_len, MADV_HUGEPAGE);
+#endif
+        seg->map_len = len;
+    }
+    if (!seg->sparse && size > loaded) /* sparse segments read zero where never written */
+        memset((char*) segbase + loaded, '0', size - loaded);
+    return 0;
+}
+
+/* name of the shared memory object of a segment, unique per data file */
+void shm_name(char* name, struct stat* st)
+{
+    sprintf(name, "/rvm-%lx-%lx", (unsigned long) st->st_dev, (unsigned long) st->st_ino);
+}
+
+/* map a segment into shared memory, a metadata page followed by the
+ * segment data. Every process of the segment holds a shared flock on
+ * the object. A process that gets it exclusive is the only user, so it
+ * (re)loads the data from the files, since the object may be left over
+ * from processes that are gone */
+void* map_shared(char* path, segment_t* seg)
+{
+    struct stat st;
+    int size;
+    int data_fd = Open(path, O_RDONLY);
+    if (data_fd < 0)
+        return NULL;
+    fstat(data_fd, &st);
+    if (data_header(data_fd, &size) < 0) {
+        Close(data_fd);
+        return NULL;
+    }
+    Close(data_fd);
+
+    char name[MAXLINE];
+    shm_name(name, &st);
+    int fd = shm_open(name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        fprintf(stderr, "shm_open error\n");
+        return NULL;
+    }
+    int owner = flock(fd, LOCK_EX | LOCK_NB) == 0;
+    if (!owner)
+        flock(fd, LOCK_SH);
+
+    /* only ever grows, other processes may use a longer mapping */
+    size_t len = SHM_HEADER + (((size_t) size + PAGE_SIZE - 1) & ~(size_t) (PAGE_SIZE - 1));
+    if (posix_fallocate(fd, 0, len) != 0) {
+        fprintf(stderr, "shared segment allocation error\n");
+        Close(fd);
+        return NULL;
+    }
+    char* base = (char*) Mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        Close(fd);
+        return NULL;
+    }
+    shm_header_t* hdr = (shm_header_t*) base;
+    seg->shm = hdr;
+    seg->shm_fd = fd;
+    seg->shm_key = st.st_ino;
+    seg->alloc_mode = RVM_ALLOC_SHARED;
+    seg->map_len = len;
+    strcpy(seg->path, path);
+
+    if (owner) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&hdr->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        hdr->length = size;
+        hdr->next_lsn = seg->next_lsn;
+        shm_reload(seg);
+        hdr->magic = SHM_MAGIC;
+        flock(fd, LOCK_SH);
+    } else if (hdr->magic != SHM_MAGIC) {
+        fprintf(stderr, "corrupt shared segment\n");
+        Munmap(base, len);
+        Close(fd);
+        return NULL;
+    } else {
+        int cur = hdr->length;
+        while (cur < size && !__atomic_compare_exchange_n(&hdr->length, &cur, size, 0,
+                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            ;
+    }
+    return base + SHM_HEADER;
+}
+
+/* lock a shared segment for a transaction. If the previous holder died
+ * inside a transaction the memory may hold its uncommitted changes, so
+ * it is reloaded from the committed state on disk */
+void shm_lock(segment_t* seg)
+{
+    if (pthread_mutex_lock(&seg->shm->lock) == EOWNERDEAD) {
+        shm_reload(seg);
+        pthread_mutex_consistent(&seg->shm->lock);
+    }
+}
+
+/* fill the whole shared object of a segment from its data file, after
+ * applying its log. The caller is the only process changing it */
+void shm_reload(segment_t* seg)
+{
+    char logpath[MAXLINE], dir[MAXLINE];
+    get_logpath(logpath, seg->path);
+    strcpy(dir, seg->path);
+    char* slash = strrchr(dir, '/');
+    if (slash)
+        *slash = '\0';
+
+    int used = 0;
+    int lock = dir_lock(slash ? dir : ".", LOCK_EX);
+    apply_log(logpath, seg->path, 0, &used);
+    dir_unlock(lock);
+
+    ckpt_t ck;
+    read_ckpt(seg->path, &ck);
+    if (seg->shm->next_lsn <= ck.lsn)
+        seg->shm->next_lsn = ck.lsn + 1;
+
+    /* processes that mapped the segment larger share a longer object */
+    size_t len = SHM_HEADER + (((size_t) seg->shm->length + PAGE_SIZE - 1) & ~(size_t) (PAGE_SIZE - 1));
+    char* base = (char*) Mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, seg->shm_fd, 0);
+    if (base == MAP_FAILED)
+        return;
+    int fd = Open(seg->path, O_RDONLY);
+    int size;
+    int off = fd >= 0 ? data_header(fd, &size) : -1;
+    if (off >= 0) /* holes are read too, the object may hold older data */
+        load_data(fd, off, base + SHM_HEADER, seg->shm->length, 0);
+    if (fd >= 0)
+        Close(fd);
+    Munmap(base, len);
+}
+
+/* order shared segments by data file for locking */
+int compare_shm(const void* a, const void* b)
+{
+    unsigned long ka = (*(segment_t**) a)->shm_key;
+    unsigned long kb = (*(segment_t**) b)->shm_key;
+    return ka < kb ? -1 : ka > kb;
+}
+
+/* map a segment for lazy recovery. The memory starts out inaccessible
+ * and the log is indexed by page, so the first access to a page reads
+ * it from the data file and applies just the records that touch it */
+void* map_lazy(char* path, segment_t* seg)
+{
+    char logpath[MAXLINE];
+    get_logpath(logpath, path);
+    int data_fd = Open(path, O_RDONLY);
+    if (data_fd < 0)
+        return NULL;
+    int size;
+    int off = data_header(data_fd, &size);
+    if (off < 0) {
+        Close(data_fd);
+        return NULL;
+    }
+
+    size_t page = sys_page_size();
+    size_t len = ((size_t) size + page - 1) & ~(page - 1);
+    if (len == 0)
+        len = page;
+    char* base = (char*) Mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        Close(data_fd);
+        return NULL;
+    }
+
+    lazy_t* lz = (lazy_t*) Malloc(sizeof(lazy_t));
+    lz->base = base;
+    lz->length = size;
+    lz->page = (int) page;
+    lz->npages = len / page;
+    lz->data_fd = data_fd;
+    lz->data_off = off;
+    lz->loaded = 0;
+    lz->scratch = NULL;
+    lz->scratch_pos = -1;
+    lz->scratch_busy = 0;
+    lz->ck_lsn = 0;
+    lz->state = (char*) calloc(lz->npages, 1);
+    lz->first = (int*) calloc(lz->npages + 1, sizeof(int));
+    lz->recs = NULL;
+
+    /* the mapping keeps this version of the log readable even after
+     * truncation replaces the file */
+    lz->log = NULL;
+    lz->log_len = 0;
+    int fd = open(logpath, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        lz->log_len = st.st_size;
+        lz->log = (char*) Mmap(NULL, lz->log_len, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (fd >= 0)
+        Close(fd);
+
+    /* two passes over the record headers: count the records of each page,
+     * then file their positions. Records of a compact frame are filed at
+     * the frame. Records the checkpoint covers are already in the data
+     * file */
+    if (lz->log) {
+        ckpt_t ck;
+        read_ckpt(path, &ck);
+        lz->ck_lsn = ck.lsn;
+        int start = ck.pos <= lz->log_len ? ck.pos : 0;
+        int pass, scratch_len = 0;
+        for (pass = 0; pass < 2; pass++) {
+            int pos = start, at = pos;
+            logrec_t rec;
+            logrec_init(&rec);
+            while (log_next(lz->log, lz->log_len, &pos, &rec)) {
+                if ((rec.lsn && rec.lsn <= ck.lsn) || rec.size == 0
+                        || rec.offset < 0 || rec.offset + rec.size > size) {
+                    at = pos;
+                    continue;
+                }
+                int p;
+                for (p = rec.offset / lz->page; p <= (rec.offset + rec.size - 1) / lz->page; p++) {
+                    if (pass == 0)
+                        lz->first[p + 1]++;
+                    else
+                        lz->recs[lz->first[p]++] = at;
+                }
+                if (pass == 0 && rec.compressed && rec.size > scratch_len)
+                    scratch_len = rec.size;
+                if (rec.lsn >= seg->next_lsn)
+                    seg->next_lsn = rec.lsn + 1;
+                at = pos;
+            }
+            int p;
+            if (pass == 0) {
+                for (p = 0; p < lz->npages; p++)
+                    lz->first[p + 1] += lz->first[p];
+                lz->recs = (int*) Malloc((lz->first[lz->npages] + 1) * sizeof(int));
+                if (scratch_len)
+                    lz->scratch = (char*) Malloc(scratch_len);
+            } else {
+                for (p = lz->npages; p > 0; p--) /* filling advanced each start */
+                    lz->first[p] = lz->first[p - 1];
+                lz->first[0] = 0;
+            }
+        }
+    }
+
+    /* install the fault handler with the first lazy segment */
+    static int installed = 0;
+    if (!installed) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = lazy_fault;
+        sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGSEGV, &sa, &lazy_old_action);
+        installed = 1;
+    }
+    lz->next = lazy_segs;
+    __atomic_store_n(&lazy_segs, lz, __ATOMIC_RELEASE);
+
+    seg->lazy = lz;
+    seg->alloc_mode = RVM_ALLOC_PAGES;
+    seg->map_len = len;
+    return base;
+}
+
+void unmap_lazy(lazy_t* lz)
+{
+    lazy_t** p;
+    for (p = &lazy_segs; *p; p = &(*p)->next) {
+        if (*p == lz) {
+            *p = lz->next;
+            break;
+        }
+    }
+    if (lz->log)
+        Munmap(lz->log, lz->log_len);
+    Close(lz->data_fd);
+    free(lz->state);
+    free(lz->first);
+    Free(lz->recs);
+    Free(lz->scratch);
+    Free(lz);
+}
+
+/* build a page aside from the data file and its log records, then move
+ * it into place in one step so no thread sees it half loaded. Runs in
+ * the fault handler, so it sticks to system calls and memcpy */
+void lazy_load_page(lazy_t* lz, int page)
+{
+    char* target = lz->base + (size_t) page * lz->page;
+    char* tmp = (char*) mmap(NULL, lz->page, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (tmp == MAP_FAILED)
+        return;
+
+    int start = page * lz->page;
+    int n = lz->length - start < lz->page ? lz->length - start : lz->page;
+    if (n > 0 && pread(lz->data_fd, tmp, n, lz->data_off + start) < 0)
+        n = 0;
+
+    int i;
+    for (i = lz->first[page]; i < lz->first[page + 1]; i++) {
+        /* a frame filed once for each of its records on the page is
+         * replayed once, all of its records together */
+        if (i > lz->first[page] && lz->recs[i] == lz->recs[i - 1])
+            continue;
+        int pos = lz->recs[i];
+        logrec_t rec;
+        logrec_init(&rec);
+        do {
+            if (!log_next(lz->log, lz->log_len, &pos, &rec))
+                break;
+            if ((rec.lsn && rec.lsn <= lz->ck_lsn) || rec.offset < 0
+                    || rec.offset + rec.size > lz->length)
+                continue;
+            int lo = rec.offset > start ? rec.offset : start;
+            int hi = rec.offset + rec.size < start + lz->page ? rec.offset + rec.size : start + lz->page;
+            if (lo >= hi)
+                continue;
+
+            if (!rec.compressed) {
+                memcpy(tmp + lo - start, rec.data + lo - rec.offset, hi - lo);
+                continue;
+            }
+            /* compressed records decode whole, keep the last one around */
+            int at = rec.data - lz->log;
+            while (__atomic_test_and_set(&lz->scratch_busy, __ATOMIC_ACQUIRE))
+                ;
+            if (lz->scratch_pos != at) {
+                lz->scratch_pos = -1;
+                if (lz_decompress(rec.data, rec.clen, lz->scratch, rec.size) == rec.size)
+                    lz->scratch_pos = at;
+            }
+            if (lz->scratch_pos == at)
+                memcpy(tmp + lo - start, lz->scratch + lo - rec.offset, hi - lo);
+            __atomic_clear(&lz->scratch_busy, __ATOMIC_RELEASE);
+        } while (rec.frame_pos);
+    }
+
+    mremap(tmp, lz->page, lz->page, MREMAP_MAYMOVE | MREMAP_FIXED, target);
+    __atomic_add_fetch(&lz->loaded, 1, __ATOMIC_RELAXED);
+}
+
+/* load the pages of a range before the kernel reads it on our behalf */
+void lazy_prefault(lazy_t* lz, int offset, int size)
+{
+    int p;
+    for (p = offset / lz->page; size > 0 && p <= (offset + size - 1) / lz->page; p++)
+        (void) *(volatile char*) (lz->base + (size_t) p * lz->page);
+}
+
+/* SIGSEGV handler: load the page of a lazy segment, or hand the fault to
+ * whoever handled it before */
+void lazy_fault(int sig, siginfo_t* info, void* ctx)
+{
+    char* addr = (char*) info->si_addr;
+    lazy_t* lz;
+    for (lz = __atomic_load_n(&lazy_segs, __ATOMIC_ACQUIRE); lz; lz = lz->next) {
+        if (addr < lz->base || addr >= lz->base + (size_t) lz->npages * lz->page)
+            continue;
+
+        int page = (addr - lz->base) / lz->page;
+        char expect = PAGE_UNLOADED;
+        if (__atomic_compare_exchange_n(&lz->state[page], &expect, PAGE_LOADING, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            lazy_load_page(lz, page);
+            __atomic_store_n(&lz->state[page], PAGE_LOADED, __ATOMIC_RELEASE);
+        } else {
+            while (__atomic_load_n(&lz->state[page], __ATOMIC_ACQUIRE) != PAGE_LOADED)
+                ; /* another thread is loading it */
+        }
+        return;
+    }
+
+    /* not ours: a real segmentation fault */
+    if ((lazy_old_action.sa_flags & SA_SIGINFO) && lazy_old_action.sa_sigaction) {
+        lazy_old_action.sa_sigaction(sig, info, ctx);
+    } else if (lazy_old_action.sa_handler != SIG_DFL && lazy_old_action.sa_handler != SIG_IGN) {
+        lazy_old_action.sa_handler(sig);
+    } else {
+        signal(SIGSEGV, SIG_DFL); /* the access faults again and kills us */
+    }
+}
+
+/* recover the data from data segment to memory address */
+void* recover_data(char* path, segment_t* seg, int hugepages, size_t reserve)
+{
+    int size;
+    int fd = Open(path, O_RDONLY);
+    int off = data_header(fd, &size);
+    char* segbase = off < 0 ? NULL : (char*) alloc_segment(size, hugepages, reserve, seg);
+    if (!segbase) {
+        Close(fd);
+        return NULL;
+    }
+    seg->sparse = off == SPARSE_HEADER;
+    load_data(fd, off, segbase, size, seg->sparse);
+    Close(fd);
+    return segbase;
+}
+
+/* append v to buf as a varint, seven bits a byte, low bits first */
+int varint_put(char* buf, unsigned long long v)
+{
+    int n = 0;
+    while (v >= 0x80) {
+        buf[n++] = (char) (v | 0x80);
+        v >>= 7;
+    }
+    buf[n++] = (char) v;
+    return n;
+}
+
+/* read the varint at *p and advance past it. Returns 0 if the log ends
+ * inside it */
+int varint_get(char* log, int log_len, int* p, unsigned long long* v)
+{
+    int i = *p, shift;
+    *v = 0;
+    for (shift = 0; i < log_len && shift < 7 * LOG_VARINT_MAX; shift += 7) {
+        unsigned char b = log[i++];
+        *v |= (unsigned long long) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *p = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* append one modified range to a log. Ranges are split into records
+ * of at most LOG_MAX_RECORD bytes, each tagged with the next sequence
+ * number of the segment, and records of at least compress_min bytes
+ * are stored compressed when that makes them smaller. The records of a
+ * transaction form one compact frame: the first opens it, and all but
+ * the last carry LOG_TAG_MORE; more says whether further ranges of the
+ * transaction follow this one. Offsets are stored relative to the end
+ * of the previous record of the frame, so neighbouring fields take a
+ * byte or two.
+ * frame layout: LOG_FRAME | version | lsn | records
+ * record layout: tag | offset delta | [size] | [compressed length] | payload */
+void write_record(logbuf_t* lb, char* data, int offset, int len,
+        int compress_min, long long* lsn, int more)
+{
+    int done = 0;
+    while (done < len) {
+        int size = len - done;
+        if (size > LOG_MAX_RECORD)
+            size = LOG_MAX_RECORD;
+        char* payload = data + done;
+
+        char* packed = NULL;
+        int clen = 0;
+        if (compress_min && size >= compress_min) {
+            packed = (char*) Malloc(LZ_BOUND(size));
+            clen = lz_compress(payload, size, packed, size - sizeof(int));
+        }
+
+        char head[sizeof(int) + 4 * LOG_VARINT_MAX + 1];
+        int n = 0;
+        if (!lb->frame) {
+            unsigned int frame = LOG_FRAME | LOG_FRAME_VERSION;
+            memcpy(head, &frame, sizeof(int));
+            n = sizeof(int);
+            n += varint_put(head + n, *lsn);
+            lb->frame_end = 0;
+        }
+        int at = offset + done;
+        int back = at < lb->frame_end;
+        int last = !more && done + size >= len;
+        head[n++] = (char) ((last ? 0 : LOG_TAG_MORE) | (clen > 0 ? LOG_TAG_COMPRESSED : 0)
+                | (back ? LOG_TAG_BACK : 0) | (size < LOG_TAG_SIZE ? size : 0));
+        n += varint_put(head + n, back ? lb->frame_end - at : at - lb->frame_end);
+        if (size >= LOG_TAG_SIZE)
+            n += varint_put(head + n, size);
+        if (clen > 0)
+            n += varint_put(head + n, clen);
+        logbuf_append(lb, head, n);
+        /* write memory segment into log segment */
+        logbuf_append(lb, clen > 0 ? packed : payload, clen > 0 ? clen : size);
+        (*lsn)++;
+        lb->frame = !last;
+        lb->frame_end = at + size;
+        Free(packed);
+        done += size;
+    }
+}
+
+/* start decoding a log at a record or frame boundary */
+void logrec_init(logrec_t* rec)
+{
+    rec->group_end = 0;
+    rec->frame_pos = 0;
+}
+
+/* decode the record at *pos and advance past it. Returns 0 at the end
+ * of the log, including a torn transaction at its tail: the records of
+ * a transaction are only returned once its last record is complete.
+ * rec must start from logrec_init, it remembers how far that is known
+ * and where in a compact frame the next record is */
+int log_next(char* log, int log_len, int* pos, logrec_t* rec)
+{
+    int group_end = rec->group_end;
+    if (!log_decode(log, log_len, pos, rec))
+        return 0;
+    rec->group_end = group_end;
+    if (!rec->more || *pos < group_end)
+        return 1;
+
+    logrec_t next = *rec;
+    int p = *pos;
+    do {
+        if (!log_decode(log, log_len, &p, &next))
+            return 0;
+    } while (next.more);
+    rec->group_end = p;
+    return 1;
+}
+
+/* decode the record at *pos and advance past it. Returns 0 at the end
+ * of the log, including a torn record at its tail. Older logs hold
+ * records with an int size and offset; within a compact frame *pos
+ * stays at the frame and rec->frame_pos walks its records, so that
+ * positions handed out are always ones decoding can restart from */
+int log_decode(char* log, int log_len, int* pos, logrec_t* rec)
+{
+    if (rec->frame_pos)
+        return frame_decode(log, log_len, pos, rec->frame_pos, rec);
+
+    int p = *pos;
+    if (p + 2 * (int) sizeof(int) > log_len)
+        return 0;
+
+    int header = *(int*) (log + p);
+    if (header & LOG_FRAME) {
+        unsigned long long lsn;
+        p += sizeof(int);
+        if ((header & ~LOG_FRAME) != LOG_FRAME_VERSION) {
+            /* write, not stdio: the lazy fault handler decodes as well */
+            static const char msg[] = "unknown log format version\n";
+            ssize_t n = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+            (void) n;
+            return 0;
+        }
+        if (!varint_get(log, log_len, &p, &lsn))
+            return 0;
+        rec->lsn = (long long) lsn - 1;
+        rec->prev_end = 0;
+        return frame_decode(log, log_len, pos, p, rec);
+    }
+
+    rec->size = header & LOG_SIZE_MASK;
+    rec->compressed = (header & LOG_COMPRESSED) != 0;
+    rec->more = (header & LOG_MORE) != 0;
+    rec->offset = *(int*) (log + p + sizeof(int));
+    p += 2 * sizeof(int);
+    if (header == 0 && rec->offset == 0)
+        return 0; /* zero padding after the last record of a direct log */
+
+    rec->lsn = 0;
+    if (header & LOG_LSN) {
+        if (p + (int) sizeof(long long) > log_len)
+            return 0;
+        memcpy(&rec->lsn, log + p, sizeof(long long));
+        p += sizeof(long long);
+    }
+
+    rec->clen = rec->size;
+    if (rec->compressed) {
+        if (p + (int) sizeof(int) > log_len)
+            return 0;
+        rec->clen = *(int*) (log + p);
+        p += sizeof(int);
+    }
+    if (rec->clen < 0 || rec->clen > log_len - p)
+        return 0;
+    rec->data = log + p;
+    *pos = p + rec->clen;
+    return 1;
+}
+
+/* decode the compact record at p, the next one of the frame at *pos.
+ * *pos moves past the frame with its last record */
+int frame_decode(char* log, int log_len, int* pos, int p, logrec_t* rec)
+{
+    unsigned long long delta, size, clen;
+    if (p >= log_len)
+        return 0;
+    int tag = (unsigned char) log[p++];
+    size = tag & (LOG_TAG_SIZE - 1);
+    if (!varint_get(log, log_len, &p, &delta) || (!size && !varint_get(log, log_len, &p, &size)))
+        return 0;
+    rec->compressed = (tag & LOG_TAG_COMPRESSED) != 0;
+    clen = size;
+    if (rec->compressed && !varint_get(log, log_len, &p, &clen))
+        return 0;
+    /* no record is empty, zero padding after a torn frame ends here */
+    long long offset = tag & LOG_TAG_BACK ? rec->prev_end - (long long) delta : rec->prev_end + (long long) delta;
+    if (size == 0 || size > LOG_MAX_RECORD || clen > (unsigned long long) (log_len - p)
+            || delta > 0x7fffffff || offset < 0 || offset + size > 0x7fffffff)
+        return 0;
+
+    rec->size = (int) size;
+    rec->clen = (int) clen;
+    rec->offset = (int) offset;
+    rec->data = log + p;
+    rec->lsn++;
+    rec->more = (tag & LOG_TAG_MORE) != 0;
+    rec->prev_end = rec->offset + rec->size;
+    p += rec->clen;
+    rec->frame_pos = rec->more ? p : 0;
+    if (!rec->more)
+        *pos = p;
+    return 1;
+}
+
+/* find the end of the last complete record in a log */
+int log_end(char* logpath)
+{
+    int fd = Open(logpath, O_RDONLY);
+    struct stat st;
+    fstat(fd, &st);
+    int log_len = st.st_size;
+    if (!log_len) {
+        Close(fd);
+        return 0;
+    }
+
+    char* logfile = (char*) Mmap(NULL, log_len, PROT_READ, MAP_SHARED, fd, 0);
+    Close(fd);
+    int pos = 0;
+    logrec_t rec;
+    logrec_init(&rec);
+    while (log_next(logfile, log_len, &pos, &rec))
+        ;
+    Munmap(logfile, log_len);
+    return pos;
+}
+
+void logbuf_init(logbuf_t* lb)
+{
+    lb->fd = -1;
+    lb->direct = 0;
+    lb->buf = NULL;
+    lb->cap = 0;
+    lb->len = 0;
+    lb->base = 0;
+    lb->prealloc = 0;
+    lb->mirror = NULL;
+    lb->total = 0;
+    lb->frame = 0;
+}
+
+/* open the log for appending. In direct mode the log stays open across
+ * commits, with the partial block at its tail kept in the buffer so the
+ * next flush can rewrite it whole */
+int logbuf_open(logbuf_t* lb, char* logpath, int direct)
+{
+    if (lb->fd >= 0)
+        return 0;
+
+    lb->direct = direct;
+    lb->len = 0;
+    lb->frame = 0;
+    if (!direct) {
+        lb->fd = Open(logpath, O_RDWR | O_APPEND);
+        return lb->fd < 0 ? -1 : 0;
+    }
+
+    off_t tail = log_end(logpath);
+    lb->fd = open(logpath, O_RDWR | O_DIRECT);
+    if (lb->fd < 0) /* file system without O_DIRECT, keep the aligned writes */
+        lb->fd = Open(logpath, O_RDWR);
+    if (lb->fd < 0)
+        return -1;
+
+    struct stat st;
+    fstat(lb->fd, &st);
+    lb->prealloc = st.st_size;
+    lb->base = tail & ~(off_t) (LOG_ALIGN - 1);
+    if (tail > lb->base) {
+        if (logbuf_reserve(lb, LOG_ALIGN) < 0 || pread(lb->fd, lb->buf, LOG_ALIGN, lb->base) < tail - lb->base) {
+            fprintf(stderr, "log read error\n");
+            logbuf_close(lb);
+            return -1;
+        }
+        lb->len = tail - lb->base;
+    }
+    return 0;
+}
+
+/* make room for n more staged bytes */
+int logbuf_reserve(logbuf_t* lb, int n)
+{
+    if (lb->buf && lb->len + n <= lb->cap)
+        return 0;
+
+    int cap = lb->cap ? lb->cap : LOG_STAGE_MAX;
+    while (cap < lb->len + n)
+        cap *= 2;
+    void* buf;
+    if (posix_memalign(&buf, LOG_ALIGN, cap + LOG_ALIGN) != 0) {
+        fprintf(stderr, "log buffer allocation error\n");
+        return -1;
+    }
+    if (lb->len)
+        memcpy(buf, lb->buf, lb->len);
+    Free(lb->buf);
+    lb->buf = (char*) buf;
+    lb->cap = cap; /* one spare block for padding on flush */
+    return 0;
+}
+
+/* stage n bytes of log data. Buffered logs write large payloads
+ * straight through instead of copying them */
+void logbuf_append(logbuf_t* lb, const void* data, int n)
+{
+    if (lb->mirror)
+        logbuf_append(lb->mirror, data, n);
+    lb->total += n;
+
+    if (!lb->direct && n >= LOG_STAGE_MAX) {
+        logbuf_flush(lb);
+        int done = 0;
+        while (done < n) {
+            ssize_t w = Write(lb->fd, (const char*) data + done, n - done);
+            if (w <= 0) {
+                fprintf(stderr, "log write error\n");
+                return;
+            }
+            done += w;
+        }
+        return;
+    }
+
+    if (logbuf_reserve(lb, n) < 0)
+        return;
+    memcpy(lb->buf + lb->len, data, n);
+    lb->len += n;
+}
+
+/* write out the staged log data. Direct logs are written in whole
+ * aligned blocks, zero padded, into a preallocated file */
+void logbuf_flush(logbuf_t* lb)
+{
+    if (!lb->len || lb->fd < 0)
+        return;
+
+    char* p = lb->buf;
+    int n = lb->len;
+    off_t at = lb->base;
+    if (lb->direct) {
+        n = (lb->len + LOG_ALIGN - 1) & ~(LOG_ALIGN - 1);
+        memset(lb->buf + lb->len, 0, n - lb->len);
+        if (at + n > lb->prealloc) {
+            off_t want = at + n + LOG_PREALLOC;
+            if (posix_fallocate(lb->fd, 0, want) == 0)
+                lb->prealloc = want;
+        }
+    }
+
+    while (n > 0) {
+        ssize_t w = lb->direct ? Pwrite(lb->fd, p, n, at) : Write(lb->fd, p, n);
+        if (w <= 0) {
+            fprintf(stderr, "log write error\n");
+            break;
+        }
+        p += w;
+        at += w;
+        n -= w;
+    }
+
+    if (!lb->direct) {
+        lb->len = 0;
+        return;
+    }
+    /* keep the partial tail block, it is rewritten by the next flush */
+    int keep = lb->len % LOG_ALIGN;
+    int full = lb->len - keep;
+    if (keep && full)
+        memmove(lb->buf, lb->buf + full, keep);
+    lb->base += full;
+    lb->len = keep;
+}
+
+void logbuf_close(logbuf_t* lb)
+{
+    if (lb->fd >= 0)
+        Close(lb->fd);
+    lb->fd = -1;
+    lb->len = 0;
+}
+
+/* close the direct log writers of every instance. They reopen and find
+ * the tail again on their next commit, and mark their log in the
+ * manifest again since truncation may have cleared it */
+void reset_log_writers()
+{
+    int i;
+    for (i = 0; i < registry_size; i++) {
+        if (!registry[i].inst)
+            continue;
+        item_t* item;
+        for (item = registry[i].inst->segments.head; item; item = item->next) {
+            segment_t* seg = (segment_t*) item->value;
+            logbuf_close(&seg->writer);
+            seg->log_dirty = 0;
+            int k;
+            for (k = 0; k < seg->nstripes; k++) {
+                logbuf_close(&seg->stripes[k]->writer);
+                seg->stripes[k]->log_dirty = 0;
+            }
+        }
+    }
+}
+
+/* make sure the log of a segment is open for appending, and the
+ * standby log when shipping. The manifest has to point recovery at a
+ * log before the first record lands in it */
+void open_seg_log(segment_t* seg, instance_t* inst)
+{
+    char logpath[MAXLINE];
+    get_logpath(logpath, seg->path);
+
+    if (seg->shm) {
+        seg->log_lock = open_marked_log(&seg->writer, seg->dir, seg->name, logpath);
+        return;
+    }
 
-rvm_t rvm_init(const char *directory)
-{   /* if the dir does not exist, create one */
-    rvm_t rvm;
-    rvm.rid = rvm_id++;
+    if (!seg->log_dirty && manifest_update(seg->dir, seg->name, -1, seg->parent ? STRIPE_DIRTY : 1) == 0)
+        seg->log_dirty = 1;
+    logbuf_open(&seg->writer, logpath, inst->direct_log);
 
-    struct stat st;
-    if (stat(directory, &st) == -1)
-        mkdir(directory, 0777); /* create directory if it does not exist */
+    if (inst->standby[0] && !seg->parent && seg->ship.fd < 0) {
+        char path[MAXLINE], shippath[MAXLINE];
+        get_standby_path(path, inst, seg);
+        get_logpath(shippath, path);
+        seg->log_lock = open_marked_log(&seg->ship, inst->standby, seg->name, shippath);
+        seg->ship_from = seg->next_lsn;
+        seg->ship.total = 0;
+        seg->writer.mirror = &seg->ship; /* every appended byte goes to both */
+        /* the applier needs the directory lock exclusive, so it only
+         * starts once this commit's records are written */
+        if (inst->standby_apply)
+            standby_kick(inst->standby);
+    }
+}
 
-    strcpy(rvm.directory, directory); /* copy the directory name */
-    ST_init(&segment_table[rvm.rid]); /* init the segment lookup table */
-    return rvm;
+/* write out what a commit appended and close the logs reopened per
+ * commit */
+void close_seg_log(segment_t* seg)
+{
+    logbuf_flush(&seg->writer);
+    if (!seg->writer.direct)
+        logbuf_close(&seg->writer); /* buffered logs are reopened per commit */
+    close_ship_log(seg);
+    dir_unlock(seg->log_lock);
+    seg->log_lock = -1;
 }
 
-void *rvm_map(rvm_t rvm, const char *segname, int size_to_create)
-{   /* use a symbol table to store segname and addr mapping */
-    char path[MAXLINE];
-    strcpy(path, rvm.directory);
-    strcat(path, "/");
-    strcat(path, segname);
+/* write out and close the standby log of a segment and drop the
+ * standby directory lock that came with it. A lock held on for another
+ * segment's log would block that log's open, which may need the lock
+ * exclusive */
+void close_ship_log(segment_t* seg)
+{
+    if (!seg->writer.mirror)
+        return;
+    logbuf_flush(&seg->ship);
+    logbuf_close(&seg->ship);
+    seg->writer.mirror = NULL;
+    seg->ship_bytes += seg->ship.total;
+    seg->ship_records += seg->next_lsn - seg->ship_from;
+    dir_unlock(seg->log_lock);
+    seg->log_lock = -1;
+}
 
-    check_segment(path, size_to_create);
-    rvm_truncate_log(rvm);
+/* open a log that other processes may truncate between two appends,
+ * a shared segment log or a standby log. A non-empty log is marked in
+ * the manifest already, an empty one is marked under the exclusive
+ * lock before the first record. The lock is returned, held until the
+ * records are written, which keeps truncation out */
+int open_marked_log(logbuf_t* lb, const char* dir, const char* name, char* logpath)
+{
+    int lock = dir_lock(dir, LOCK_SH);
+    logbuf_open(lb, logpath, 0);
+    struct stat st;
+    if (lb->fd >= 0 && fstat(lb->fd, &st) == 0 && st.st_size > 0)
+        return lock;
 
-    /* allocate memory for segment and recover data from backing store */
-    void* addr = recover_data(path);
+    logbuf_close(lb);
+    dir_unlock(lock);
+    lock = dir_lock(dir, LOCK_EX);
+    manifest_set(dir, name, -1, 1);
+    logbuf_open(lb, logpath, 0);
+    return lock;
+}
 
-    /* create the in memory segment data structure and insert the 
-     * addr->segment pair in segment table */ 
-    segment_t* seg = (segment_t*) Malloc(sizeof(segment_t));
-    strcpy(seg->path, path);
-    seg->length = size_to_create;
-    seg->modified = 0;
-    seg->undo_log = Malloc(sizeof(list_t));
-    list_init(seg->undo_log);
-    ST_put(&segment_table[rvm.rid], addr, seg);
-    return addr; 
+void get_standby_path(char* path, instance_t* inst, segment_t* seg)
+{
+    strcpy(path, inst->standby);
+    strcat(path, "/");
+    strcat(path, seg->name);
 }
 
-void rvm_unmap(rvm_t rvm, void *segbase)
+/* have the standby applier replay the logs of a standby directory. A
+ * directory is listed once however many commits wait for it. Without
+ * the thread the records stay in the log, to be applied at failover */
+void standby_kick(const char* dir)
 {
-    segment_t* seg = (segment_t*) ST_get(&segment_table[rvm.rid], segbase);
-    if (!seg) {
-        fprintf(stderr, "segment address does not exist\n");
-        return;
+    pthread_mutex_lock(&standby_lock);
+    if (!standby_started) {
+        pthread_t applier;
+        if (pthread_create(&applier, NULL, standby_applier, NULL) == 0) {
+            pthread_detach(applier);
+            standby_started = 1;
+        }
     }
-
-    Free(segbase); /* free the actual log segment in memory */
-    Free(seg->undo_log); /* free undo log stack */
-    Free(seg); /* free the segment struct */
-    ST_erase(&segment_table[rvm.rid], segbase);
+    int i;
+    for (i = 0; i < standby_npending; i++)
+        if (strcmp(standby_pending[i], dir) == 0)
+            break;
+    if (standby_started && i == standby_npending) {
+        if (standby_npending == standby_cap) {
+            standby_cap = standby_cap ? 2 * standby_cap : 4;
+            standby_pending = realloc(standby_pending, standby_cap * sizeof(*standby_pending));
+        }
+        strcpy(standby_pending[standby_npending++], dir);
+        pthread_cond_signal(&standby_work);
+    }
+    pthread_mutex_unlock(&standby_lock);
 }
 
-void rvm_destroy(rvm_t rvm, const char *segname)
+/* the standby applier thread. It takes the oldest pending directory
+ * and applies its logs whole, as a standby instance truncating would */
+void* standby_applier(void* arg)
 {
-    char path[MAXLINE], logpath[MAXLINE];
-    strcpy(path, rvm.directory);
-    strcat(path, segname); 
-    get_logpath(logpath, path);
+    char dir[MAXLINE];
+    pthread_mutex_lock(&standby_lock);
+    for (;;) {
+        while (!standby_npending)
+            pthread_cond_wait(&standby_work, &standby_lock);
+        strcpy(dir, standby_pending[0]);
+        memmove(standby_pending, standby_pending + 1, --standby_npending * sizeof(*standby_pending));
+        pthread_mutex_unlock(&standby_lock);
 
-    /* check if the file exists */
-    struct stat sb;
-    if (stat(path, &sb) == -1) {
-        return;
+        truncate_dir(dir, 0);
+
+        pthread_mutex_lock(&standby_lock);
     }
+    return NULL;
+}
 
-    if (remove(path) != 0)
-        fprintf(stderr, "remove error\n");
-    if (remove(logpath) != 0)
-        fprintf(stderr, "remove error\n"); 
+/* give the standby a base copy of a segment: its data file, checkpoint
+ * and the complete records of its log. Shipped records follow */
+int seed_standby(instance_t* inst, segment_t* seg)
+{
+    char path[MAXLINE], logpath[MAXLINE], shippath[MAXLINE];
+    get_standby_path(path, inst, seg);
+    get_logpath(logpath, seg->path);
+    get_logpath(shippath, path);
+
+    ckpt_t ck;
+    read_ckpt(seg->path, &ck);
+    int end = log_end(logpath);
+
+    int lock = dir_lock(inst->standby, LOCK_EX);
+    int ret = 0;
+    if (copy_file(seg->path, path, -1) < 0 || copy_file(logpath, shippath, end) < 0)
+        ret = -1;
+    else {
+        write_ckpt(path, &ck);
+        manifest_set(inst->standby, seg->name, seg->length, end > 0);
+    }
+    dir_unlock(lock);
+    seg->ship_bytes = 0;
+    seg->ship_records = 0;
+    return ret;
 }
 
-trans_t rvm_begin_trans(rvm_t rvm, int numsegs, void **segbases)
+/* copy at most limit bytes of a file, all of it for -1, replacing dst
+ * through a synced temporary file. Zero chunks are left as holes, so
+ * copies of sparse files stay sparse */
+int copy_file(char* src, char* dst, off_t limit)
 {
-    trans_t curr = (trans_t) Malloc(sizeof(trans));
+    char tmppath[MAXLINE + 4];
+    sprintf(tmppath, "%s.tmp", dst);
+    int in = Open(src, O_RDONLY);
+    if (in < 0)
+        return -1;
+    int out = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
+    if (out < 0) {
+        fprintf(stderr, "cannot create %s\n", tmppath);
+        Close(in);
+        return -1;
+    }
 
-    /* check if segments have already been modified */
-    int i;
-    for(i = 0; i < numsegs; i++) {
-        segment_t* seg = (segment_t*) ST_get(&segment_table[rvm.rid], segbases[i]);
-        if (!seg) {
-            fprintf(stderr, "Cannot find segbase [%lu]\n", (unsigned long) segbases[i]);
-            return (trans_t) -1; 
+    char* buf = (char*) Malloc(FILL_CHUNK);
+    off_t done = 0;
+    int ret = 0;
+    while (limit < 0 || done < limit) {
+        size_t want = FILL_CHUNK;
+        if (limit >= 0 && limit - done < (off_t) want)
+            want = limit - done;
+        ssize_t n = read(in, buf, want);
+        if (n <= 0)
+            break;
+        if (is_zero(buf, n) ? lseek(out, n, SEEK_CUR) < 0 : Write(out, buf, n) != n) {
+            fprintf(stderr, "copy write error\n");
+            ret = -1;
+            break;
         }
-        
-        if (seg->modified != 0) {
-            fprintf(stderr, "Segment already modified\n");
-            return (trans_t) -1;
+        done += n;
+    }
+    Free(buf);
+    Close(in);
+    if (ret == 0 && ftruncate(out, done) < 0) /* a trailing hole */
+        ret = -1;
+    if (fdatasync(out) < 0)
+        ret = -1;
+    Close(out);
+    if (ret == 0 && rename(tmppath, dst) < 0)
+        ret = -1;
+    if (ret < 0)
+        remove(tmppath);
+    return ret;
+}
+
+/* copy the pages of a range into every read snapshot of the segment
+ * that does not hold them yet. Called with snap_lock held, before the
+ * range changes */
+void snap_preserve(segment_t* seg, void* segbase, int offset, int size)
+{
+    if (size <= 0)
+        return;
+    int first = offset / PAGE_SIZE;
+    int last = (offset + size - 1) / PAGE_SIZE;
+    snapseg_t* ss;
+    for (ss = seg->snaps; ss; ss = ss->next) {
+        int p;
+        for (p = first; p <= last; p++) {
+            if (ss->pages[p])
+                continue;
+            int n = seg->length - p * PAGE_SIZE < PAGE_SIZE ? seg->length - p * PAGE_SIZE : PAGE_SIZE;
+            ss->pages[p] = (char*) Malloc(PAGE_SIZE);
+            memcpy(ss->pages[p], (char*) segbase + (size_t) p * PAGE_SIZE, n);
         }
-        seg->modified = 1;
     }
-    curr->rid = rvm.rid;
-    curr->segbases = segbases;
-    curr->numsegs = numsegs;
-    return curr;
 }
 
-void rvm_about_to_modify(trans_t tid, void *segbase, int offset, int size)
+void snap_free(snapseg_t* ss)
 {
-    /* check if segbase is initialized by rvm_begin_trans */
-    if (!check_addr(tid, segbase))
+    int p;
+    for (p = 0; p < ss->npages; p++)
+        Free(ss->pages[p]);
+    Free(ss->pages);
+    Free(ss);
+}
+
+/* record the pages of a committed range for the next checkpoint */
+void mark_dirty(segment_t* seg, int offset, int size)
+{
+    if (size <= 0 || offset < 0 || offset + size > seg->length)
         return;
-    
-    /* create and push the in memory undo log into undo logs list*/
-    segment_t* seg = (segment_t*) ST_get(&segment_table[tid->rid], segbase);
-    log_t* log = (log_t*) Malloc(sizeof(log_t));
-    log->size = size;
-    log->offset = offset;
-    log->data = (char*) Malloc(size);
-    memcpy(log->data, (char*) segbase + offset, size);
-    list_push(seg->undo_log, log);
+    int p;
+    for (p = offset / PAGE_SIZE; p <= (offset + size - 1) / PAGE_SIZE; p++)
+        seg->dirty_pages[p / 8] |= 1 << (p % 8);
 }
 
-void rvm_commit_trans(trans_t tid)
-{   /* apply changes in current transactions one by one */ 
-    ST_t* st = &segment_table[tid->rid];
+/* checkpoint the mapped segments of an instance from memory, with a
+ * single manifest rewrite for all of them. Lazily recovered segments,
+ * segments in a transaction and shared ones are left to log replay,
+ * their memory does not hold exactly the committed state */
+void checkpoint_segments(instance_t* inst)
+{
+    async_drain();
 
-    int i;
-    for (i = 0; i < tid->numsegs; i++) {   /* for each data segment */
-        segment_t* seg = (segment_t*) ST_get(st, tid->segbases[i]); 
-        char logpath[MAXLINE];
-        get_logpath(logpath, seg->path);
+    int lock = dir_lock(inst->directory, LOCK_EX);
+    manifest_t m;
+    if (manifest_load(inst->directory, &m) < 0)
+        manifest_scan(inst->directory, &m);
+    int changed = m.scanned;
 
-        /* open the log segment and write changes */
-        int fd = Open(logpath, O_RDWR | O_APPEND); ;
-        /* write modified segments according to the offset and size
-         * in undo logs. Then clear undo logs */
-        while (!list_empty(seg->undo_log)) {
-            log_t* log = (log_t*) list_pop_front(seg->undo_log);
-            write(fd, &log->size, sizeof(int)); /* write size into log file */
-            write(fd, &log->offset, sizeof(int)); /* write offset into log file */
-            /* write memory segment into log segment */
-            write(fd, (char*) tid->segbases[i] + log->offset, log->size); 
-            Free(log->data);
-            Free(log);
+    item_t* item;
+    for (item = inst->segments.head; item; item = item->next) {
+        segment_t* seg = (segment_t*) item->value;
+        mentry_t* e = manifest_find(&m, seg->name);
+        if (seg->lazy || seg->modified || seg->shm || seg->nstripes || !e || !e->dirty)
+            continue;
+        if (checkpoint_segment(seg, item->key) == 0) {
+            e->dirty = 0;
+            changed = 1;
         }
-        seg->modified = 0; /* reset modified bit for next transaction */
-        Close(fd); 
     }
-
-    /* clear the entire transaction */
-    Free(tid);
+    if (changed)
+        manifest_save(inst->directory, &m);
+    Free(m.entries);
+    dir_unlock(lock);
 }
 
-void rvm_abort_trans(trans_t tid)
-{   
-    ST_t* st = &segment_table[tid->rid];
+/* write the dirty pages of a segment to its data file, in file order
+ * and coalesced into runs, then drop its log. Zero pages of sparse
+ * segments are punched out instead of written. The checkpoint takes the
+ * last sequence number given out, so replaying the old log after a
+ * crash skips every record of it */
+int checkpoint_segment(segment_t* seg, void* segbase)
+{
+    int fd = Open(seg->path, O_RDWR);
+    if (fd < 0)
+        return -1;
+    int off = seg->sparse ? SPARSE_HEADER : sizeof(int);
 
-    /* apply undo logs in a LIFO manner */ 
-    int i;
-    for (i = 0; i < tid->numsegs; i++) {
-        segment_t* seg = (segment_t*) ST_get(st, tid->segbases[i]); 
+    int npages = (seg->length + PAGE_SIZE - 1) / PAGE_SIZE;
+    int p = 0;
+    while (p < npages) {
+        if (!(seg->dirty_pages[p / 8] & (1 << (p % 8)))) {
+            p++;
+            continue;
+        }
+        int run = p;
+        while (run < npages && (seg->dirty_pages[run / 8] & (1 << (run % 8))))
+            run++;
 
-        while (!list_empty(seg->undo_log)) {
-            log_t* log = (log_t*) list_pop_front(seg->undo_log);
-            /* copy undo log data back to segment base address + offset */
-            memcpy((char*) tid->segbases[i] + log->offset, log->data, log->size);
-            Free(log->data);
+        size_t start = (size_t) p * PAGE_SIZE;
+        size_t end = (size_t) run * PAGE_SIZE;
+        if (end > (size_t) seg->length)
+            end = seg->length;
+        while (start < end) {
+            /* a sparse run splits where pages turn from zero to data */
+            size_t stop = end;
+            int zero = 0;
+            if (seg->sparse) {
+                zero = is_zero((char*) segbase + start, PAGE_SIZE);
+                for (stop = start + PAGE_SIZE; stop < end; stop += PAGE_SIZE)
+                    if (is_zero((char*) segbase + stop, PAGE_SIZE) != zero)
+                        break;
+                if (stop > end)
+                    stop = end;
+            }
+            if (zero && punch_hole(fd, off + start, stop - start) == 0) {
+                start = stop;
+                continue;
+            }
+            ssize_t w = Pwrite(fd, (char*) segbase + start, stop - start, off + start);
+            if (w <= 0) {
+                fprintf(stderr, "checkpoint write error\n");
+                Close(fd);
+                return -1;
+            }
+            start += w;
         }
-        seg->modified = 0;
+        p = run;
     }
+    if (fdatasync(fd) < 0) {
+        fprintf(stderr, "checkpoint sync error\n");
+        Close(fd);
+        return -1;
+    }
+    Close(fd);
 
-    /* clear the entire transaction */
-    Free(tid); 
+    ckpt_t ck;
+    ck.lsn = seg->next_lsn - 1;
+    ck.pos = 0;
+    write_ckpt(seg->path, &ck);
+
+    char logpath[MAXLINE];
+    get_logpath(logpath, seg->path);
+    logbuf_close(&seg->writer);
+    remove(logpath);
+    creat(logpath, S_IRWXU);
+    seg->log_dirty = 0;
+    memset(seg->dirty_pages, 0, npages / 8 + 1);
+    return 0;
 }
 
-void rvm_truncate_log(rvm_t rvm)
-{   /* currently only iterate the log file and write changes to data file.
-       this should not depend on the global address->segment mapping table 
-       since that data structure is in memory. But this function is required 
-       to work after crash */
-       struct dirent* pDirent;
-       DIR* pDir;
-       pDir = Opendir(rvm.directory);
-
-       while ((pDirent = readdir(pDir)) != NULL) {
-           char* filename = pDirent->d_name;
-           if (strstr(filename, ".log")) { /* check filename ends with .log */
-               char logpath[MAXLINE], segpath[MAXLINE];
-               strcpy(logpath, rvm.directory);
-               strcat(logpath, "/");
-               strcat(logpath, filename);
-
-               strcpy(segpath, rvm.directory);
-               strcat(segpath, "/"); 
-               strncat(segpath, filename, strlen(filename) - 4);
-
-               fflush(stdout);
-               apply_log(logpath, segpath);
-           }
-       }
-       Closedir (pDir);
+/* the async commit writer. It takes every queued job at once and
+ * flushes each log they touch a single time */
+void* async_writer(void* arg)
+{
+    pthread_mutex_lock(&async_lock);
+    for (;;) {
+        while (!async_head)
+            pthread_cond_wait(&async_work, &async_lock);
+        commit_job_t* jobs = async_head;
+        async_head = async_tail = NULL;
+        pthread_mutex_unlock(&async_lock);
+
+        rvm_commit_t ticket = write_jobs(jobs);
+
+        pthread_mutex_lock(&async_lock);
+        if (async_done < ticket) /* a later shared commit may be done already */
+            async_done = ticket;
+        pthread_cond_broadcast(&async_done_cond);
+    }
+    return NULL;
+}
+
+/* write a chain of async commit jobs to their logs in order and free
+ * them. Returns the ticket of the last job */
+rvm_commit_t write_jobs(commit_job_t* job)
+{
+    list_t touched;
+    list_init(&touched);
+    rvm_commit_t ticket = 0;
+
+    while (job) {
+        int i;
+        for (i = 0; i < job->numsegs; i++) {
+            segment_t* seg = (segment_t*) job->segs[i];
+            if (seg->nstripes) {
+                log_striped(seg, job->inst, &job->logs[i], NULL);
+                continue;
+            }
+            node_t* node;
+            for (node = touched.front; node && node->value != seg; node = node->next)
+                ;
+            if (!node)
+                list_enqueue(&touched, seg);
+            open_seg_log(seg, job->inst);
+            while (!list_empty(&job->logs[i])) {
+                log_t* log = (log_t*) list_pop_front(&job->logs[i]);
+                write_record(&seg->writer, log->data, log->offset, log->size,
+                        job->inst->compress_min, &seg->next_lsn, !list_empty(&job->logs[i]));
+                Free(log->block);
+                Free(log);
+            }
+            /* the primary logs stay open for the batch, the standby
+             * ones are closed per segment, see close_ship_log */
+            close_ship_log(seg);
+        }
+
+        commit_job_t* next = job->next;
+        ticket = job->ticket;
+        Free(job->logs);
+        Free(job->segs);
+        Free(job);
+        job = next;
+    }
+
+    while (!list_empty(&touched))
+        close_seg_log((segment_t*) list_pop_front(&touched));
+    return ticket;
 }
 
+/* wait until every async commit is in the log. Everything that touches
+ * logs, the manifest or the segment table from the caller's side does
+ * this first, so the writer thread never races with it */
+void async_drain()
+{
+    pthread_mutex_lock(&async_lock);
+    while (async_done < async_issued)
+        pthread_cond_wait(&async_done_cond, &async_lock);
+    pthread_mutex_unlock(&async_lock);
+}
 
 /*
- * private helper functions
+ * The manifest lists the segments of a directory with their size and
+ * whether their log may hold records, one per line after a header:
+ *     <size> <dirty> <name>
+ * Stripe logs are marked STRIPE_DIRTY and left out of truncate_dir.
+ * It is rewritten through a temporary file and rename.
  */
+void manifest_init(manifest_t* m)
+{
+    m->entries = NULL;
+    m->n = 0;
+    m->cap = 0;
+    m->scanned = 0;
+}
 
-void get_logpath(char* logpath, char* path)
+static mentry_t* manifest_add(manifest_t* m, const char* name)
 {
-    strcpy(logpath, path);
-    strcat(logpath, ".log");
+    if (m->n == m->cap) {
+        m->cap = m->cap ? m->cap * 2 : 16;
+        m->entries = (mentry_t*) realloc(m->entries, m->cap * sizeof(mentry_t));
+    }
+    mentry_t* e = &m->entries[m->n++];
+    strcpy(e->name, name);
+    e->size = 0;
+    e->dirty = 0;
+    return e;
 }
 
-/* check whether a segment exists. If it does not exist, it will 
- * create the directory. If it exist but size is shorter than 
- * size_to_create, it will elongate the segment size to size_to_create */
-void check_segment(char* filename, int size_to_create)
+/* read the manifest of a directory. Returns -1 if there is none */
+int manifest_load(const char* dir, manifest_t* m)
 {
-    char logpath[MAXLINE];
-    strcpy(logpath, filename);
-    strcat(logpath, ".log"); 
-    struct stat st;
+    char path[MAXLINE], line[2 * MAXLINE];
+    sprintf(path, "%s/%s", dir, MANIFEST_NAME);
+    manifest_init(m);
 
-    if (stat(filename, &st) == -1) { /* log segment does not exist */
-        int data_fd = creat(filename, S_IRWXU); /* create data segment */
-        creat(logpath, S_IRWXU); /* create log segment */
-        write(data_fd, &size_to_create, sizeof(size_to_create));
+    FILE* fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+    if (!fgets(line, sizeof(line), fp) || strcmp(line, MANIFEST_HEADER "\n") != 0) {
+        fprintf(stderr, "bad manifest %s\n", path);
+        fclose(fp);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        int size, dirty, n;
+        if (sscanf(line, "%d %d %n", &size, &dirty, &n) != 2)
+            continue;
+        line[strcspn(line, "\n")] = '\0';
+        mentry_t* e = manifest_add(m, line + n);
+        e->size = size;
+        e->dirty = dirty;
+    }
+    fclose(fp);
+    return 0;
+}
 
-        char a = '0';
-        int i;
-        for (i = 0; i < size_to_create; i++)
-            write(data_fd, &a, 1); /* fill the data segment with 0 */ 
-    } else {
-        int current_size;
-        int fd = Open(filename, O_RDWR);
-        read(fd, &current_size, sizeof(int));
+/* build the manifest of a directory from its files. Every segment has a
+ * <name>.log next to its data file, or in the log directory */
+void manifest_scan(const char* dir, manifest_t* m)
+{
+    manifest_init(m);
+    m->scanned = 1;
+    char logdir[MAXLINE];
+    if (find_logdir(dir, logdir) < 0)
+        strcpy(logdir, dir);
+    DIR* pDir = Opendir(logdir);
+    if (!pDir)
+        return;
 
-        if (current_size < size_to_create) {
-            /* elongate the data segment if necessary */
-            lseek(fd, 0, SEEK_SET);
-            write(fd, &size_to_create, sizeof(size_to_create));
-            lseek(fd, current_size + sizeof(size_to_create), SEEK_SET);
-            char a = '0';
-            int i;
-            for (i = 0; i < size_to_create - current_size; i++)
-                write(fd, &a, 1); /* fill the rest file with 0 */
-        }
-        Close(fd); 
+    struct dirent* pDirent;
+    while ((pDirent = readdir(pDir)) != NULL) {
+        char* filename = pDirent->d_name;
+        int len = strlen(filename);
+        if (len <= 4 || strcmp(filename + len - 4, ".log") != 0)
+            continue;
+
+        char logpath[MAXLINE], segpath[MAXLINE];
+        strcpy(logpath, logdir);
+        strcat(logpath, "/");
+        strcat(logpath, filename);
+        sprintf(segpath, "%s/%.*s", dir, len - 4, filename);
+        int fd = open(segpath, O_RDONLY);
+        if (fd < 0)
+            continue; /* a log without its segment */
+
+        filename[len - 4] = '\0';
+        mentry_t* e = manifest_add(m, filename);
+        if (data_header(fd, &e->size) < 0)
+            e->size = 0;
+        Close(fd);
+        struct stat st;
+        e->dirty = stat(logpath, &st) == 0 && st.st_size > 0;
     }
+    Closedir(pDir);
 }
 
+void manifest_save(const char* dir, manifest_t* m)
+{
+    char path[MAXLINE], tmppath[MAXLINE];
+    sprintf(path, "%s/%s", dir, MANIFEST_NAME);
+    sprintf(tmppath, "%s/%s.tmp", dir, MANIFEST_NAME);
+
+    FILE* fp = fopen(tmppath, "w");
+    if (!fp) {
+        fprintf(stderr, "manifest open error\n");
+        return;
+    }
+    fprintf(fp, MANIFEST_HEADER "\n");
+    int i;
+    for (i = 0; i < m->n; i++)
+        fprintf(fp, "%d %d %s\n", m->entries[i].size, m->entries[i].dirty, m->entries[i].name);
+    if (fflush(fp) != 0 || fdatasync(fileno(fp)) < 0)
+        fprintf(stderr, "manifest write error\n");
+    fclose(fp);
+    if (rename(tmppath, path) < 0)
+        fprintf(stderr, "manifest rename error\n");
+}
 
-/* check whether a segment address is associated with a transaction */
-int check_addr(trans_t tid, void* segbase)
+mentry_t* manifest_find(manifest_t* m, const char* name)
 {
     int i;
-    for (i = 0; i < tid->numsegs; i++)
-        if (tid->segbases[i] == segbase)
-            return 1;
-    fprintf(stderr, "segment address not associated with transaction\n");
+    for (i = 0; i < m->n; i++)
+        if (strcmp(m->entries[i].name, name) == 0)
+            return &m->entries[i];
+    return NULL;
+}
+
+/* set the size and/or dirty flag of a segment, -1 leaves a field as it
+ * is. The manifest is only rewritten when something changed */
+int manifest_update(const char* dir, const char* name, int size, int dirty)
+{
+    int lock = dir_lock(dir, LOCK_EX);
+    manifest_set(dir, name, size, dirty);
+    dir_unlock(lock);
     return 0;
 }
 
-/* recover the data from data segment to memory address */
+/* manifest_update for callers holding the directory lock */
+void manifest_set(const char* dir, const char* name, int size, int dirty)
+{
+    manifest_t m;
+    if (manifest_load(dir, &m) < 0)
+        manifest_scan(dir, &m);
+
+    int changed = m.scanned;
+    mentry_t* e = manifest_find(&m, name);
+    if (!e) {
+        e = manifest_add(&m, name);
+        changed = 1;
+    }
+    if (size >= 0 && e->size != size) {
+        e->size = size;
+        changed = 1;
+    }
+    if (dirty >= 0 && e->dirty != dirty) {
+        e->dirty = dirty;
+        changed = 1;
+    }
+    if (changed)
+        manifest_save(dir, &m);
+    Free(m.entries);
+}
 
-void* recover_data(char* path)
+void manifest_remove(const char* dir, const char* name)
 {
-    int size;
-    int fd = Open(path, O_RDONLY);
-    read(fd, &size, sizeof(int));
-    void* segbase = Malloc(size);
-    read(fd, segbase, size);
-    Close(fd);
-    return segbase;
+    int lock = dir_lock(dir, LOCK_EX);
+    manifest_t m;
+    if (manifest_load(dir, &m) < 0) {
+        Free(m.entries);
+        dir_unlock(lock);
+        return;
+    }
+
+    mentry_t* e = manifest_find(&m, name);
+    if (e) {
+        *e = m.entries[--m.n];
+        manifest_save(dir, &m);
+    }
+    Free(m.entries);
+    dir_unlock(lock);
+}
+
+/* lock the manifest and logs of a directory against other processes.
+ * Commits to shared segments hold it shared, whatever rewrites the
+ * manifest or clears logs holds it exclusive. Returns the lock fd */
+int dir_lock(const char* dir, int op)
+{
+    char path[MAXLINE];
+    sprintf(path, "%s/%s", dir, MANIFEST_LOCK);
+    int fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        fprintf(stderr, "cannot open directory lock\n");
+        return -1;
+    }
+    while (flock(fd, op) < 0 && errno == EINTR)
+        ;
+    return fd;
+}
+
+void dir_unlock(int fd)
+{
+    if (fd >= 0)
+        Close(fd); /* drops the lock */
 }
 
-/* apply the log segments to the data segments given their names */ 
-void apply_log(char* logpath, char* segpath)
+/* apply the log segments to the data segments given their names,
+ * starting after the segment checkpoint. At most budget bytes of log
+ * are applied, 0 means the whole log. The checkpoint is advanced once
+ * the data is synced, and a fully applied log is cleared. Returns 1 if
+ * the log was cleared, 0 if records remain */
+int apply_log(char* logpath, char* segpath, int budget, int* used)
 {
     /* read the log segments and apply them */
     int fd = Open(logpath, O_RDONLY);
-    int data_fd = Open(segpath, O_RDWR); 
+    if (fd < 0)
+        return 1;
 
     struct stat st1, st2;
     fstat(fd, &st1);
     int log_len = st1.st_size;
-    if (!log_len)
-        return; /* if length of log is zero, skip it */
+    if (!log_len) { /* if length of log is zero, skip it */
+        Close(fd);
+        return 1;
+    }
 
+    int data_fd = Open(segpath, O_RDWR); 
+    if (data_fd < 0) {
+        Close(fd);
+        return 1;
+    }
     char* logfile = (char*) Mmap(NULL, log_len, PROT_READ, MAP_SHARED, fd, 0);
 
     fstat(data_fd, &st2);
     int data_len = st2.st_size; 
+    int size, off = data_header(data_fd, &size);
     char* datafile = (char*) Mmap(NULL, data_len, PROT_READ | PROT_WRITE, MAP_SHARED, data_fd, 0); 
 
+    /* sparse files stay open to punch the pages the log zeroes */
+    unsigned char* touched = NULL;
+    int npages = (data_len - off + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (off == SPARSE_HEADER)
+        touched = (unsigned char*) calloc(npages / 8 + 1, 1);
     Close(fd);
-    Close(data_fd); 
+    if (!touched)
+        Close(data_fd); 
 
-    int pos = 0;
-    while (pos < log_len) {
-        int size = *(int*) (logfile + pos);
-        pos += 4;
-        int offset = *(int*) (logfile + pos); 
-        pos += 4;
+    ckpt_t ck;
+    read_ckpt(segpath, &ck);
+    int pos = ck.pos <= log_len ? ck.pos : 0;
+    int start = pos, applied = 0, done = 1;
+    logrec_t rec;
+    logrec_init(&rec);
+    while (log_next(logfile, log_len, &pos, &rec)) {
+        if (rec.lsn && rec.lsn <= ck.lsn)
+            continue; /* applied before an interruption */
+
+        if (off < 0 || rec.offset < 0 || rec.offset + rec.size > data_len - off) {
+            fprintf(stderr, "log record outside of segment\n");
+            continue;
+        }
 
         /* skip header and transfer data */
-        memcpy(datafile + offset + sizeof(int), logfile + pos, size);
-        pos += size;
+        char* dst = datafile + rec.offset + off;
+        if (touched) {
+            int p;
+            for (p = rec.offset / PAGE_SIZE; p <= (rec.offset + rec.size - 1) / PAGE_SIZE; p++)
+                touched[p / 8] |= 1 << (p % 8);
+        }
+        if (!rec.compressed)
+            memcpy(dst, rec.data, rec.size);
+        else if (lz_decompress(rec.data, rec.clen, dst, rec.size) != rec.size)
+            fprintf(stderr, "corrupt compressed log record\n");
+        if (rec.lsn)
+            ck.lsn = rec.lsn;
+        applied = 1;
+        FAULT_POINT(); /* part of the log applied */
+
+        if (budget && !rec.frame_pos && pos - start >= budget) {
+            int next = pos;
+            done = !log_next(logfile, log_len, &next, &rec);
+            break;
+        }
     }
+    *used += pos - start;
 
+    /* the checkpoint may only move once the data it covers is durable */
+    if (applied && msync(datafile, data_len, MS_SYNC) < 0)
+        fprintf(stderr, "msync error\n");
+    if (touched) {
+        /* once synced, pages left all zero give their blocks back */
+        int p, run = -1;
+        for (p = 0; p <= npages; p++) {
+            int n = data_len - off - p * PAGE_SIZE < PAGE_SIZE ? data_len - off - p * PAGE_SIZE : PAGE_SIZE;
+            if (p < npages && (touched[p / 8] & (1 << (p % 8)))
+                    && is_zero(datafile + off + (size_t) p * PAGE_SIZE, n)) {
+                if (run < 0)
+                    run = p;
+                continue;
+            }
+            if (run >= 0) /* punch zero pages a run at a time */
+                punch_hole(data_fd, off + (off_t) run * PAGE_SIZE,
+                        (p < npages ? p * PAGE_SIZE : data_len - off) - run * PAGE_SIZE);
+            run = -1;
+        }
+        Free(touched);
+        Close(data_fd);
+    }
     Munmap(logfile, log_len);
     Munmap(datafile, data_len);
 
+    /* a checkpoint at position 0 makes a rerun skip every record by lsn,
+     * so it is safe to write it before the log goes away */
+    ck.pos = done ? 0 : pos;
+    FAULT_POINT(); /* data synced, checkpoint not advanced */
+    write_ckpt(segpath, &ck);
+    if (!done)
+        return 0;
+
     /* clear the content of log segment */
+    FAULT_POINT(); /* checkpoint written, log still there */
     remove(logpath);
     creat(logpath, S_IRWXU);
+    return 1;
 }
 
 /*
@@ -432,6 +3996,81 @@ void Close(int fd)
     fprintf(stderr, "Close error\n");
 }
 
+/* the writes of the library, which fault builds route through
+ * fault_write. Callers report errors themselves */
+ssize_t Write(int fd, const void* buf, size_t n)
+{
+#ifdef RVM_FAULT_INJECT
+    return fault_write(fd, buf, n, -1);
+#else
+    return write(fd, buf, n);
+#endif
+}
+
+ssize_t Pwrite(int fd, const void* buf, size_t n, off_t offset)
+{
+#ifdef RVM_FAULT_INJECT
+    return fault_write(fd, buf, n, offset);
+#else
+    return pwrite(fd, buf, n, offset);
+#endif
+}
+
+#ifdef RVM_FAULT_INJECT
+/*
+ * Fault injection for crash testing. Every write and every FAULT_POINT
+ * of the library is an event. The armed event ends the process with
+ * _exit(RVM_FAULT_EXIT) as a crash would, losing whatever is staged in
+ * memory. A torn fault lets a random prefix of its write through first.
+ * Data in the page cache survives, so this models process crashes and
+ * torn appends rather than power loss
+ */
+static long long fault_count = 0;
+static long long fault_at = 0; /* 0 = disarmed */
+static int fault_torn = 0;
+
+void rvm_fault_arm(long long event, int torn)
+{
+    __atomic_store_n(&fault_count, 0, __ATOMIC_SEQ_CST);
+    fault_at = event;
+    fault_torn = torn;
+}
+
+long long rvm_fault_events()
+{
+    return __atomic_load_n(&fault_count, __ATOMIC_SEQ_CST);
+}
+
+/* count an event, return 1 if it is the armed one */
+static int fault_hit()
+{
+    long long n = __atomic_add_fetch(&fault_count, 1, __ATOMIC_SEQ_CST);
+    return fault_at && n == fault_at;
+}
+
+void fault_point()
+{
+    if (fault_hit())
+        _exit(RVM_FAULT_EXIT);
+}
+
+ssize_t fault_write(int fd, const void* buf, size_t n, off_t offset)
+{
+    if (fault_hit()) {
+        if (fault_torn && n > 1) {
+            unsigned int seed = (unsigned int) fault_at;
+            size_t part = rand_r(&seed) % n;
+            if (offset < 0)
+                write(fd, buf, part);
+            else
+                pwrite(fd, buf, part, offset);
+        }
+        _exit(RVM_FAULT_EXIT);
+    }
+    return offset < 0 ? write(fd, buf, n) : pwrite(fd, buf, n, offset);
+}
+#endif
+
 DIR *Opendir(const char *name) 
 {
     DIR *dirp = opendir(name); 
@@ -559,7 +4198,7 @@ int ST_put(ST_t* st, void* key, void* value)
 
 void* ST_get(ST_t* st, void* key)
 {
-    if (!st) return NULL;
+    if (!st || !st->head) return NULL;
 
     item_t* current = st->head;
 
@@ -575,7 +4214,7 @@ void* ST_get(ST_t* st, void* key)
 
 int ST_erase(ST_t* st, void* key)
 {
-    if (!st) return -1;
+    if (!st || !st->head) return -1;
     item_t* current = st->head;
 
     if (current->key == key) { /* item to remove is head */
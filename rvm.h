@@ -3,14 +3,97 @@
 
 #include "rvm_internal.h"
 
+/* options accepted by rvm_set_option */
+#define RVM_OPT_HUGEPAGES 1
+#define RVM_OPT_COMPRESS 2 /* compress log records of at least value bytes, 0 = off */
+#define RVM_OPT_DIRECT_LOG 3 /* non-zero: aligned O_DIRECT appends to a preallocated log */
+#define RVM_OPT_LAZY_RECOVERY 4 /* non-zero: rvm_map replays each page on first access */
+#define RVM_OPT_MEM_CHECKPOINT 5 /* non-zero: rvm_truncate_log writes dirty pages of mapped segments from memory */
+#define RVM_OPT_SHARED 6 /* non-zero: rvm_map shares segment memory with other processes */
+#define RVM_OPT_UNDO_BUDGET 7 /* bytes of pre-images kept in memory, the rest spill to disk, 0 = no limit */
+#define RVM_OPT_RESERVE 8 /* bytes of address space reserved per segment, for rvm_resize to grow into */
+#define RVM_OPT_SPARSE 9 /* non-zero: new segments are sparse files, unwritten bytes read as zero */
+#define RVM_OPT_STANDBY_APPLY 10 /* non-zero: a background thread applies shipped records on the standby */
+
+/* huge page policies for RVM_OPT_HUGEPAGES. Huge pages are only used
+ * for segments of at least HUGE_PAGE_SIZE bytes */
+#define RVM_HUGEPAGES_OFF 0
+#define RVM_HUGEPAGES_TRANSPARENT 1 /* madvise(MADV_HUGEPAGE) */
+#define RVM_HUGEPAGES_EXPLICIT 2 /* MAP_HUGETLB, falls back to transparent */
+
+/* flags for rvm_begin_trans_flags */
+#define RVM_TRANS_NOUNDO 1 /* redo-only: no pre-images, cannot be aborted */
+
+/* backing of a mapped segment as reported by rvm_seg_stats */
+#define RVM_ALLOC_PAGES 0
+#define RVM_ALLOC_THP 1
+#define RVM_ALLOC_HUGETLB 2
+#define RVM_ALLOC_SHARED 3
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 rvm_t rvm_init(const char *directory);
+rvm_t rvm_init_dirs(const char *directory, const char *log_dir);
+int rvm_close(rvm_t rvm);
 void *rvm_map(rvm_t rvm, const char *segname, int size_to_create);
+int rvm_map_many(rvm_t rvm, int count, const char **segnames, int *sizes, void **segbases);
+void *rvm_map_striped(rvm_t rvm, const char *segname, int size_to_create,
+        int stripe_size, int ndirs, const char **dirs);
 void rvm_unmap(rvm_t rvm, void *segbase);
 void rvm_destroy(rvm_t rvm, const char *segname);
 trans_t rvm_begin_trans(rvm_t rvm, int numsegs, void **segbases);
+trans_t rvm_begin_trans_flags(rvm_t rvm, int numsegs, void **segbases, int flags);
 void rvm_about_to_modify(trans_t tid, void *segbase, int offset, int size);
+int rvm_about_to_modify_v(trans_t tid, range_t *ranges, int count);
 void rvm_commit_trans(trans_t tid);
-void rvm_abort_trans(trans_t tid);
+rvm_commit_t rvm_commit_trans_async(trans_t tid);
+int rvm_wait(rvm_commit_t handle);
+int rvm_poll(rvm_commit_t handle);
+int rvm_abort_trans(trans_t tid);
+snapshot_t rvm_begin_read_snapshot(rvm_t rvm, int numsegs, void **segbases);
+int rvm_snapshot_read(snapshot_t snap, void *segbase, int offset, void *buf, int size);
+void rvm_end_read_snapshot(snapshot_t snap);
+int rvm_set_standby(rvm_t rvm, const char *standby_dir);
+int rvm_standby_stats(rvm_t rvm, shipstat_t* stats);
 void rvm_truncate_log(rvm_t rvm);
+int rvm_truncate_log_step(rvm_t rvm, int max_bytes);
+int rvm_set_option(rvm_t rvm, int option, long value);
+int rvm_seg_stats(rvm_t rvm, void* segbase, segstat_t* stats);
+int rvm_resize(rvm_t rvm, void* segbase, int new_size);
+
+/* allocator inside a segment, returning offsets from segbase. The
+ * changes are declared in the transaction, which must include segbase */
+int rvm_seg_alloc(trans_t tid, void* segbase, int size);
+int rvm_seg_free(trans_t tid, void* segbase, int offset);
+int rvm_seg_root(void* segbase);
+int rvm_seg_set_root(trans_t tid, void* segbase, int offset);
+
+/* recoverable indexes from long long keys to long long values, kept in
+ * the segment heap and named by their offset. Updates are declared in
+ * the transaction; get returns 1 if the key is found, 0 if not, and del
+ * 1 if it removed the key */
+int rvm_hash_create(trans_t tid, void* segbase, int capacity);
+int rvm_hash_put(trans_t tid, void* segbase, int map, long long key, long long value);
+int rvm_hash_get(void* segbase, int map, long long key, long long* value);
+int rvm_hash_del(trans_t tid, void* segbase, int map, long long key);
+int rvm_hash_count(void* segbase, int map);
+int rvm_btree_create(trans_t tid, void* segbase);
+int rvm_btree_put(trans_t tid, void* segbase, int tree, long long key, long long value);
+int rvm_btree_get(void* segbase, int tree, long long key, long long* value);
+int rvm_btree_del(trans_t tid, void* segbase, int tree, long long key);
+int rvm_btree_count(void* segbase, int tree);
+
+#ifdef RVM_FAULT_INJECT
+/* fault builds only: crash at the event-th write or crash point from
+ * now on, tearing the write if torn. 0 disarms */
+void rvm_fault_arm(long long event, int torn);
+long long rvm_fault_events();
+#endif
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
@@ -0,0 +1,198 @@
+/*
+ *  Typed C++ interface over rvm.h. A Segment<T> maps a segment holding
+ *  one T, and a Transaction declares the members of T it is about to
+ *  change instead of byte offsets. A transaction that is neither
+ *  committed nor aborted when it goes out of scope, for example while
+ *  an exception unwinds, is aborted.
+ *
+ *      rvm::Segment<Account> acct(rvm, "account");
+ *      {
+ *          rvm::Transaction tx(rvm, acct);
+ *          tx.modify(acct, &Account::balance, rvm::slice(&Account::history, n, 1));
+ *          acct->balance += amount;
+ *          acct->history[n] = amount;
+ *          tx.commit();
+ *      }
+ *
+ *  Every modify call is one rvm_about_to_modify_v call. Its ranges are
+ *  built in a fixed array on the stack, so the wrapper allocates
+ *  nothing on the heap.
+ */
+
+#ifndef __LIBRVM_HPP__
+#define __LIBRVM_HPP__
+
+#include "rvm.h"
+#include <cstddef>
+#include <stdexcept>
+#include <type_traits>
+
+namespace rvm {
+
+/* library calls that fail throw this, the library has printed why. A
+ * slice outside its array member throws it too */
+class Error : public std::runtime_error {
+public:
+    explicit Error(const char* what) : std::runtime_error(what) {}
+};
+
+/* a mapped segment holding one T */
+template <class T>
+class Segment {
+    static_assert(std::is_trivially_copyable<T>::value,
+            "segment contents are copied byte for byte by the log");
+
+public:
+    Segment(rvm_t rvm, const char* segname)
+        : rvm_(rvm), base_(static_cast<T*>(rvm_map(rvm, segname, sizeof(T))))
+    {
+        if (!base_)
+            throw Error("rvm_map failed");
+    }
+
+    ~Segment()
+    {
+        if (base_)
+            rvm_unmap(rvm_, base_);
+    }
+
+    Segment(const Segment&) = delete;
+    Segment& operator=(const Segment&) = delete;
+
+    T* get() const { return base_; }
+    T* operator->() const { return base_; }
+    T& operator*() const { return *base_; }
+    void* base() const { return base_; }
+
+private:
+    rvm_t rvm_;
+    T* base_;
+};
+
+/* count elements of an array member starting at first, all within the
+ * N elements of the member */
+template <class T, class E, std::size_t N>
+struct Slice {
+    E (T::*member)[N];
+    int first;
+    int count;
+};
+
+template <class T, class E, std::size_t N>
+inline Slice<T, E, N> slice(E (T::*member)[N], int first, int count)
+{
+    if (first < 0 || count < 0 || (std::size_t) first + (std::size_t) count > N)
+        throw Error("slice outside its array member");
+    return Slice<T, E, N>{ member, first, count };
+}
+
+namespace detail {
+
+/* byte range of a member of the object at obj. The size is known at
+ * compile time, the offset folds to a constant once inlined */
+template <class T, class F>
+inline range_t to_range(T* obj, F T::*member)
+{
+    range_t r;
+    r.segbase = obj;
+    r.offset = (int) (reinterpret_cast<char*>(&(obj->*member)) - reinterpret_cast<char*>(obj));
+    r.size = (int) sizeof(F);
+    return r;
+}
+
+template <class T, class E, std::size_t N>
+inline range_t to_range(T* obj, Slice<T, E, N> s)
+{
+    range_t r = to_range(obj, s.member);
+    r.offset += s.first * (int) sizeof(E);
+    r.size = s.count * (int) sizeof(E);
+    return r;
+}
+
+} /* namespace detail */
+
+/* a transaction over up to MAX_SEGS segments */
+class Transaction {
+public:
+    enum { MAX_SEGS = 16 };
+
+    template <class... T>
+    explicit Transaction(rvm_t rvm, Segment<T>&... segs)
+        : segbases_{ segs.base()... }, open_(false)
+    {
+        static_assert(sizeof...(T) > 0 && sizeof...(T) <= MAX_SEGS,
+                "a transaction covers 1 to MAX_SEGS segments");
+        /* the library keeps a pointer to segbases_, so a Transaction
+         * cannot be copied or moved */
+        tid_ = rvm_begin_trans(rvm, (int) sizeof...(T), segbases_);
+        if (tid_ == (trans_t) -1)
+            throw Error("rvm_begin_trans failed");
+        open_ = true;
+    }
+
+    ~Transaction()
+    {
+        if (open_)
+            rvm_abort_trans(tid_);
+    }
+
+    Transaction(const Transaction&) = delete;
+    Transaction& operator=(const Transaction&) = delete;
+
+    /* declare the whole object */
+    template <class T>
+    void modify(Segment<T>& seg)
+    {
+        range_t r;
+        r.segbase = seg.base();
+        r.offset = 0;
+        r.size = (int) sizeof(T);
+        declare(&r, 1);
+    }
+
+    /* declare members, given as member pointers or slices, in one call */
+    template <class T, class... M>
+    void modify(Segment<T>& seg, M... members)
+    {
+        range_t ranges[] = { detail::to_range(seg.get(), members)... };
+        declare(ranges, (int) sizeof...(M));
+    }
+
+    void commit()
+    {
+        check_open();
+        open_ = false;
+        rvm_commit_trans(tid_);
+    }
+
+    void abort()
+    {
+        check_open();
+        open_ = false;
+        rvm_abort_trans(tid_);
+    }
+
+    trans_t handle() const { return tid_; }
+
+private:
+    void check_open() const
+    {
+        if (!open_)
+            throw Error("transaction already ended");
+    }
+
+    void declare(range_t* ranges, int count)
+    {
+        check_open();
+        if (rvm_about_to_modify_v(tid_, ranges, count) != 0)
+            throw Error("rvm_about_to_modify_v failed");
+    }
+
+    void* segbases_[MAX_SEGS];
+    trans_t tid_;
+    bool open_;
+};
+
+} /* namespace rvm */
+
+#endif
@@ -0,0 +1,195 @@
+/*
+ * Allocator for memory inside a mapped segment
+ *
+ * The heap takes the whole segment. Its header sits at offset 0 and
+ * blocks are handed out as offsets, which stay valid wherever the
+ * segment is mapped. Small blocks come from size class slabs, large
+ * ones from the top of the heap, and freed blocks go on free lists kept
+ * in the segment. Every change is declared in the caller's transaction,
+ * a few words at a time, so the heap commits and aborts with the data.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "rvm.h"
+#include "rvm_internal.h"
+
+/* segment of a transaction given its base, NULL if not part of it */
+static segment_t* heap_segment(trans_t tid, void* segbase)
+{
+    int i;
+    for (i = 0; i < tid->numsegs; i++)
+        if (tid->segbases[i] == segbase)
+            return (segment_t*) tid->segs[i];
+    fprintf(stderr, "segment address not associated with transaction\n");
+    return NULL;
+}
+
+/* smallest size class holding size bytes, -1 for large blocks */
+static int heap_class(int size)
+{
+    int c, class_size = HEAP_MIN_CLASS;
+    for (c = 0; c < HEAP_CLASSES; c++, class_size *= 2)
+        if (size <= class_size)
+            return c;
+    return -1;
+}
+
+/* declare up to three ranges of the heap in one call */
+static int heap_declare(trans_t tid, void* segbase, int n, int* offsets, int* sizes)
+{
+    range_t ranges[3];
+    int i;
+    for (i = 0; i < n; i++) {
+        ranges[i].segbase = segbase;
+        ranges[i].offset = offsets[i];
+        ranges[i].size = sizes[i];
+    }
+    return rvm_about_to_modify_v(tid, ranges, n);
+}
+
+#define FIELD(h, f) ((int) ((char*) &(f) - (char*) (h)))
+
+/* the heap of a segment, formatted within the transaction on first use */
+static heap_t* heap_get(trans_t tid, void* segbase)
+{
+    segment_t* seg = heap_segment(tid, segbase);
+    if (!seg)
+        return NULL;
+    heap_t* h = (heap_t*) segbase;
+    if (seg->length < (int) sizeof(heap_t)) {
+        fprintf(stderr, "segment too small for a heap\n");
+        return NULL;
+    }
+    if (h->magic == HEAP_MAGIC)
+        return h;
+
+    rvm_about_to_modify(tid, segbase, 0, sizeof(heap_t));
+    memset(h, 0, sizeof(heap_t));
+    h->magic = HEAP_MAGIC;
+    h->top = sizeof(heap_t);
+    return h;
+}
+
+int rvm_seg_alloc(trans_t tid, void* segbase, int size)
+{
+    heap_t* h = heap_get(tid, segbase);
+    if (!h)
+        return -1;
+    if (size <= 0) {
+        fprintf(stderr, "invalid allocation size %d\n", size);
+        return -1;
+    }
+    int length = heap_segment(tid, segbase)->length;
+    int c = heap_class(size);
+    int bsize = c >= 0 ? HEAP_MIN_CLASS << c : (size + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+    int* head = c >= 0 ? &h->free[c] : &h->large;
+    hblock_t* b;
+    int offsets[3], sizes[3];
+
+    /* reuse a freed block: the list head and the block header change.
+     * Large blocks are taken first fit, without splitting */
+    int* link = head;
+    while (*link && -((hblock_t*) ((char*) segbase + *link))->size < bsize)
+        link = &((hblock_t*) ((char*) segbase + *link))->next;
+    if (*link) {
+        int at = *link;
+        b = (hblock_t*) ((char*) segbase + at);
+        offsets[0] = (int) ((char*) link - (char*) segbase);
+        sizes[0] = sizeof(int);
+        offsets[1] = at;
+        sizes[1] = sizeof(hblock_t);
+        if (heap_declare(tid, segbase, 2, offsets, sizes) < 0)
+            return -1;
+        *link = b->next;
+        b->size = -b->size;
+        b->next = 0;
+        return at + sizeof(hblock_t);
+    }
+
+    /* carve the next block of the class slab. A used up slab is
+     * replaced by a new one at the top of the heap, and large blocks
+     * come from the top directly */
+    int step = sizeof(hblock_t) + bsize;
+    int new_slab = c < 0 || h->slabs[c].next + step > h->slabs[c].end;
+    int grow = 0;
+    if (new_slab) {
+        grow = c >= 0 && HEAP_SLAB > step ? HEAP_SLAB / step * step : step;
+        if (grow > length - h->top)
+            grow = (length - h->top) / step * step; /* a short last slab */
+        if (grow < step) {
+            fprintf(stderr, "segment heap full\n");
+            return -1;
+        }
+    }
+    int at = new_slab ? h->top : h->slabs[c].next;
+    int n = 0;
+    offsets[n] = at;
+    sizes[n++] = sizeof(hblock_t);
+    if (new_slab) {
+        offsets[n] = FIELD(h, h->top);
+        sizes[n++] = sizeof(int);
+    }
+    if (c >= 0) {
+        offsets[n] = FIELD(h, h->slabs[c]);
+        sizes[n++] = new_slab ? sizeof(h->slabs[c]) : sizeof(int);
+    }
+    if (heap_declare(tid, segbase, n, offsets, sizes) < 0)
+        return -1;
+
+    if (new_slab) {
+        h->top += grow;
+        if (c >= 0)
+            h->slabs[c].end = at + grow;
+    }
+    if (c >= 0)
+        h->slabs[c].next = at + step;
+    b = (hblock_t*) ((char*) segbase + at);
+    b->size = bsize;
+    b->next = 0;
+    return at + sizeof(hblock_t);
+}
+
+int rvm_seg_free(trans_t tid, void* segbase, int offset)
+{
+    heap_t* h = heap_get(tid, segbase);
+    if (!h)
+        return -1;
+    int at = offset - sizeof(hblock_t);
+    hblock_t* b = (hblock_t*) ((char*) segbase + at);
+    if (at < (int) sizeof(heap_t) || at > h->top - (int) sizeof(hblock_t)
+            || at % HEAP_ALIGN || b->size <= 0 || b->size % HEAP_ALIGN
+            || b->size > h->top - at - (int) sizeof(hblock_t)) {
+        fprintf(stderr, "invalid free of offset %d\n", offset);
+        return -1;
+    }
+
+    /* push on the free list: the header marks the block free and links
+     * it, the list head points at it */
+    int c = heap_class(b->size);
+    int* head = c >= 0 ? &h->free[c] : &h->large;
+    int offsets[2] = { (int) ((char*) head - (char*) segbase), at };
+    int sizes[2] = { sizeof(int), sizeof(hblock_t) };
+    if (heap_declare(tid, segbase, 2, offsets, sizes) < 0)
+        return -1;
+    b->size = -b->size;
+    b->next = *head;
+    *head = at;
+    return 0;
+}
+
+int rvm_seg_root(void* segbase)
+{
+    heap_t* h = (heap_t*) segbase;
+    return h->magic == HEAP_MAGIC ? h->root : 0;
+}
+
+int rvm_seg_set_root(trans_t tid, void* segbase, int offset)
+{
+    heap_t* h = heap_get(tid, segbase);
+    if (!h)
+        return -1;
+    rvm_about_to_modify(tid, segbase, FIELD(h, h->root), sizeof(int));
+    h->root = offset;
+    return 0;
+}
@@ -0,0 +1,523 @@
+/*
+ * Recoverable indexes inside a segment
+ *
+ * An open addressing hash map and a B+-tree from long long keys to long
+ * long values, allocated with rvm_seg_alloc. Nodes and slot arrays
+ * start on cache lines. Each update declares only the bytes it changes
+ * in the caller's transaction: a slot and the count for the hash map,
+ * the shifted part of a node for the tree. Whole nodes and tables are
+ * only declared when a tree node splits or the hash map grows.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "rvm.h"
+#include "rvm_internal.h"
+
+#define AT(segbase, offset) ((char*) (segbase) + (offset))
+#define OFF(segbase, p) ((int) ((char*) (p) - (char*) (segbase)))
+
+/* ranges declared together in one rvm_about_to_modify_v call */
+typedef struct {
+    trans_t tid;
+    void* segbase;
+    range_t ranges[INDEX_DECL_MAX];
+    int n;
+} decl_t;
+
+static void decl_init(decl_t* d, trans_t tid, void* segbase)
+{
+    d->tid = tid;
+    d->segbase = segbase;
+    d->n = 0;
+}
+
+static void decl_add(decl_t* d, void* p, int size)
+{
+    if (size <= 0)
+        return;
+    d->ranges[d->n].segbase = d->segbase;
+    d->ranges[d->n].offset = OFF(d->segbase, p);
+    d->ranges[d->n].size = size;
+    d->n++;
+}
+
+static int decl_done(decl_t* d)
+{
+    return d->n ? rvm_about_to_modify_v(d->tid, d->ranges, d->n) : 0;
+}
+
+/* allocate size bytes starting on a cache line. The offset the
+ * allocator returned is stored in *block, for rvm_seg_free */
+static int alloc_aligned(trans_t tid, void* segbase, int size, int* block)
+{
+    int off = rvm_seg_alloc(tid, segbase, size + CACHE_LINE - HEAP_ALIGN);
+    if (off < 0)
+        return -1;
+    if (block)
+        *block = off;
+    return (off + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+}
+
+/*
+ * hash map
+ */
+
+static unsigned long long hash_key(long long key)
+{
+    unsigned long long x = (unsigned long long) key;
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static rhash_t* hash_get_map(void* segbase, int map)
+{
+    rhash_t* h = (rhash_t*) AT(segbase, map);
+    if (map <= 0 || h->magic != HASH_MAGIC) {
+        fprintf(stderr, "no hash map at offset %d\n", map);
+        return NULL;
+    }
+    return h;
+}
+
+/* a new empty slot array of capacity slots, declared whole */
+static int hash_table(trans_t tid, void* segbase, int capacity, int* block)
+{
+    int slots = alloc_aligned(tid, segbase, capacity * sizeof(rslot_t), block);
+    if (slots < 0)
+        return -1;
+    rslot_t* s = (rslot_t*) AT(segbase, slots);
+    rvm_about_to_modify(tid, segbase, slots, capacity * sizeof(rslot_t));
+    int i;
+    for (i = 0; i < capacity; i++)
+        s[i].key = HASH_EMPTY;
+    return slots;
+}
+
+int rvm_hash_create(trans_t tid, void* segbase, int capacity)
+{
+    int cap = HASH_MIN_CAPACITY;
+    while (cap < capacity)
+        cap *= 2;
+    int map = rvm_seg_alloc(tid, segbase, sizeof(rhash_t));
+    if (map < 0)
+        return -1;
+    rhash_t* h = (rhash_t*) AT(segbase, map);
+    int block;
+    int slots = hash_table(tid, segbase, cap, &block);
+    if (slots < 0)
+        return -1;
+    rvm_about_to_modify(tid, segbase, map, sizeof(rhash_t));
+    h->magic = HASH_MAGIC;
+    h->capacity = cap;
+    h->count = 0;
+    h->used = 0;
+    h->slots = slots;
+    h->block = block;
+    return map;
+}
+
+/* move the live entries to a new table, dropping deleted slots */
+static int hash_resize(trans_t tid, void* segbase, rhash_t* h, int capacity)
+{
+    int block;
+    int slots = hash_table(tid, segbase, capacity, &block);
+    if (slots < 0)
+        return -1;
+    rslot_t* old = (rslot_t*) AT(segbase, h->slots);
+    rslot_t* s = (rslot_t*) AT(segbase, slots);
+    int i;
+    for (i = 0; i < h->capacity; i++) {
+        if (old[i].key == HASH_EMPTY || old[i].key == HASH_DELETED)
+            continue;
+        unsigned long long j = hash_key(old[i].key) & (capacity - 1);
+        while (s[j].key != HASH_EMPTY)
+            j = (j + 1) & (capacity - 1);
+        s[j] = old[i];
+    }
+    if (rvm_seg_free(tid, segbase, h->block) < 0)
+        return -1;
+    rvm_about_to_modify(tid, segbase, OFF(segbase, h), sizeof(rhash_t));
+    h->capacity = capacity;
+    h->used = h->count;
+    h->slots = slots;
+    h->block = block;
+    return 0;
+}
+
+/* slot holding key, or -1. *insert is set to the slot a new key goes
+ * to: the first deleted slot on the probe path, else the empty one */
+static int hash_find(void* segbase, rhash_t* h, long long key, int* insert)
+{
+    rslot_t* s = (rslot_t*) AT(segbase, h->slots);
+    int mask = h->capacity - 1;
+    int i = (int) (hash_key(key) & mask);
+    int first_deleted = -1;
+    while (s[i].key != HASH_EMPTY) {
+        if (s[i].key == key)
+            return i;
+        if (s[i].key == HASH_DELETED && first_deleted < 0)
+            first_deleted = i;
+        i = (i + 1) & mask;
+    }
+    if (insert)
+        *insert = first_deleted >= 0 ? first_deleted : i;
+    return -1;
+}
+
+int rvm_hash_put(trans_t tid, void* segbase, int map, long long key, long long value)
+{
+    rhash_t* h = hash_get_map(segbase, map);
+    if (!h)
+        return -1;
+    if (key == HASH_EMPTY || key == HASH_DELETED) {
+        fprintf(stderr, "reserved hash map key\n");
+        return -1;
+    }
+
+    int at;
+    int i = hash_find(segbase, h, key, &at);
+    rslot_t* s = (rslot_t*) AT(segbase, h->slots);
+    decl_t d;
+    decl_init(&d, tid, segbase);
+    if (i >= 0) { /* only the value changes */
+        decl_add(&d, &s[i].value, sizeof(long long));
+        if (decl_done(&d) < 0)
+            return -1;
+        s[i].value = value;
+        return 0;
+    }
+
+    /* keep the table at most HASH_LOAD_PCT percent used, deleted slots
+     * included, doubling it when live entries fill half of that */
+    if ((h->used + 1) * 100 > h->capacity * HASH_LOAD_PCT) {
+        int cap = (h->count + 1) * 200 > h->capacity * HASH_LOAD_PCT ? h->capacity * 2 : h->capacity;
+        if (hash_resize(tid, segbase, h, cap) < 0)
+            return -1;
+        hash_find(segbase, h, key, &at);
+        s = (rslot_t*) AT(segbase, h->slots);
+    }
+
+    int fresh = s[at].key == HASH_EMPTY;
+    decl_add(&d, &s[at], sizeof(rslot_t));
+    decl_add(&d, &h->count, 2 * sizeof(int)); /* count and used */
+    if (decl_done(&d) < 0)
+        return -1;
+    s[at].key = key;
+    s[at].value = value;
+    h->count++;
+    h->used += fresh;
+    return 0;
+}
+
+int rvm_hash_get(void* segbase, int map, long long key, long long* value)
+{
+    rhash_t* h = hash_get_map(segbase, map);
+    if (!h)
+        return -1;
+    int i = hash_find(segbase, h, key, NULL);
+    if (i < 0)
+        return 0;
+    if (value)
+        *value = ((rslot_t*) AT(segbase, h->slots))[i].value;
+    return 1;
+}
+
+int rvm_hash_del(trans_t tid, void* segbase, int map, long long key)
+{
+    rhash_t* h = hash_get_map(segbase, map);
+    if (!h)
+        return -1;
+    int i = hash_find(segbase, h, key, NULL);
+    if (i < 0)
+        return 0;
+    rslot_t* s = (rslot_t*) AT(segbase, h->slots);
+    decl_t d;
+    decl_init(&d, tid, segbase);
+    decl_add(&d, &s[i].key, sizeof(long long));
+    decl_add(&d, &h->count, sizeof(int));
+    if (decl_done(&d) < 0)
+        return -1;
+    s[i].key = HASH_DELETED;
+    h->count--;
+    return 1;
+}
+
+/*
+ * B+-tree
+ */
+
+static btree_t* btree_get_tree(void* segbase, int tree)
+{
+    btree_t* t = (btree_t*) AT(segbase, tree);
+    if (tree <= 0 || t->magic != BTREE_MAGIC) {
+        fprintf(stderr, "no b+-tree at offset %d\n", tree);
+        return NULL;
+    }
+    return t;
+}
+
+/* a new node, declared whole */
+static int btree_node(trans_t tid, void* segbase, int leaf)
+{
+    int node = alloc_aligned(tid, segbase, BTREE_NODE, NULL);
+    if (node < 0)
+        return -1;
+    rvm_about_to_modify(tid, segbase, node, BTREE_NODE);
+    btnode_t* b = (btnode_t*) AT(segbase, node);
+    memset(b, 0, BTREE_NODE);
+    b->leaf = leaf;
+    return node;
+}
+
+/* index of the first key greater than key */
+static int upper_bound(long long* keys, int n, long long key)
+{
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (keys[mid] <= key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int rvm_btree_create(trans_t tid, void* segbase)
+{
+    int tree = rvm_seg_alloc(tid, segbase, sizeof(btree_t));
+    if (tree < 0)
+        return -1;
+    int root = btree_node(tid, segbase, 1);
+    if (root < 0)
+        return -1;
+    btree_t* t = (btree_t*) AT(segbase, tree);
+    rvm_about_to_modify(tid, segbase, tree, sizeof(btree_t));
+    t->magic = BTREE_MAGIC;
+    t->root = root;
+    t->height = 1;
+    t->count = 0;
+    return tree;
+}
+
+/* descend to the leaf that holds key, recording the inner nodes and
+ * the child taken in each */
+static btnode_t* btree_descend(void* segbase, btree_t* t, long long key,
+        btnode_t** path, int* index)
+{
+    btnode_t* b = (btnode_t*) AT(segbase, t->root);
+    int depth = 0;
+    while (!b->leaf) {
+        int i = upper_bound(b->u.inner.keys, b->n, key);
+        if (path) {
+            path[depth] = b;
+            index[depth] = i;
+        }
+        depth++;
+        b = (btnode_t*) AT(segbase, b->u.inner.children[i]);
+    }
+    return b;
+}
+
+/* insert separator key and right child into the inner node at depth,
+ * splitting up to the root as needed */
+static int btree_insert_inner(trans_t tid, void* segbase, btree_t* t, btnode_t** path,
+        int* index, int depth, long long key, int child)
+{
+    decl_t d;
+    decl_init(&d, tid, segbase);
+
+    if (depth < 0) { /* the root split, the tree grows a level */
+        int root = btree_node(tid, segbase, 0);
+        if (root < 0)
+            return -1;
+        btnode_t* r = (btnode_t*) AT(segbase, root);
+        r->n = 1;
+        r->u.inner.keys[0] = key;
+        r->u.inner.children[0] = t->root;
+        r->u.inner.children[1] = child;
+        decl_add(&d, &t->root, 2 * sizeof(int)); /* root and height */
+        if (decl_done(&d) < 0)
+            return -1;
+        t->root = root;
+        t->height++;
+        return 0;
+    }
+
+    btnode_t* b = path[depth];
+    int i = index[depth], n = b->n;
+    long long* keys = b->u.inner.keys;
+    int* children = b->u.inner.children;
+    if (n < BTREE_INNER_KEYS) {
+        decl_add(&d, &b->n, sizeof(int));
+        decl_add(&d, &keys[i], (n - i + 1) * sizeof(long long));
+        decl_add(&d, &children[i + 1], (n - i + 1) * sizeof(int));
+        if (decl_done(&d) < 0)
+            return -1;
+        memmove(&keys[i + 1], &keys[i], (n - i) * sizeof(long long));
+        memmove(&children[i + 2], &children[i + 1], (n - i) * sizeof(int));
+        keys[i] = key;
+        children[i + 1] = child;
+        b->n++;
+        return 0;
+    }
+
+    /* split: the middle key moves up, the upper half to a new node */
+    long long all_keys[BTREE_INNER_KEYS + 1];
+    int all_children[BTREE_INNER_KEYS + 2];
+    memcpy(all_keys, keys, i * sizeof(long long));
+    all_keys[i] = key;
+    memcpy(&all_keys[i + 1], &keys[i], (n - i) * sizeof(long long));
+    memcpy(all_children, children, (i + 1) * sizeof(int));
+    all_children[i + 1] = child;
+    memcpy(&all_children[i + 2], &children[i + 1], (n - i) * sizeof(int));
+
+    int right = btree_node(tid, segbase, 0);
+    if (right < 0)
+        return -1;
+    btnode_t* r = (btnode_t*) AT(segbase, right);
+    int half = (n + 1) / 2;
+    decl_add(&d, b, BTREE_NODE);
+    if (decl_done(&d) < 0)
+        return -1;
+    b->n = half;
+    memcpy(keys, all_keys, half * sizeof(long long));
+    memcpy(children, all_children, (half + 1) * sizeof(int));
+    r->n = n - half;
+    memcpy(r->u.inner.keys, &all_keys[half + 1], r->n * sizeof(long long));
+    memcpy(r->u.inner.children, &all_children[half + 1], (r->n + 1) * sizeof(int));
+    return btree_insert_inner(tid, segbase, t, path, index, depth - 1, all_keys[half], right);
+}
+
+int rvm_btree_put(trans_t tid, void* segbase, int tree, long long key, long long value)
+{
+    btree_t* t = btree_get_tree(segbase, tree);
+    if (!t)
+        return -1;
+    btnode_t* path[BTREE_MAX_HEIGHT];
+    int index[BTREE_MAX_HEIGHT];
+    if (t->height >= BTREE_MAX_HEIGHT) {
+        fprintf(stderr, "b+-tree too high\n");
+        return -1;
+    }
+    btnode_t* b = btree_descend(segbase, t, key, path, index);
+    long long* keys = b->u.leaf.keys;
+    long long* values = b->u.leaf.values;
+    int n = b->n;
+    int i = upper_bound(keys, n, key);
+
+    decl_t d;
+    decl_init(&d, tid, segbase);
+    if (i > 0 && keys[i - 1] == key) { /* only the value changes */
+        decl_add(&d, &values[i - 1], sizeof(long long));
+        if (decl_done(&d) < 0)
+            return -1;
+        values[i - 1] = value;
+        return 0;
+    }
+
+    decl_add(&d, &t->count, sizeof(int));
+    if (n < BTREE_LEAF_KEYS) {
+        decl_add(&d, &b->n, sizeof(int));
+        decl_add(&d, &keys[i], (n - i + 1) * sizeof(long long));
+        decl_add(&d, &values[i], (n - i + 1) * sizeof(long long));
+        if (decl_done(&d) < 0)
+            return -1;
+        memmove(&keys[i + 1], &keys[i], (n - i) * sizeof(long long));
+        memmove(&values[i + 1], &values[i], (n - i) * sizeof(long long));
+        keys[i] = key;
+        values[i] = value;
+        b->n++;
+        t->count++;
+        return 0;
+    }
+
+    /* split the leaf, the first key of the new right leaf goes up */
+    long long all_keys[BTREE_LEAF_KEYS + 1], all_values[BTREE_LEAF_KEYS + 1];
+    memcpy(all_keys, keys, i * sizeof(long long));
+    memcpy(all_values, values, i * sizeof(long long));
+    all_keys[i] = key;
+    all_values[i] = value;
+    memcpy(&all_keys[i + 1], &keys[i], (n - i) * sizeof(long long));
+    memcpy(&all_values[i + 1], &values[i], (n - i) * sizeof(long long));
+
+    int right = btree_node(tid, segbase, 1);
+    if (right < 0)
+        return -1;
+    btnode_t* r = (btnode_t*) AT(segbase, right);
+    int half = (n + 1) / 2;
+    decl_add(&d, b, BTREE_NODE);
+    if (decl_done(&d) < 0)
+        return -1;
+    b->n = half;
+    memcpy(keys, all_keys, half * sizeof(long long));
+    memcpy(values, all_values, half * sizeof(long long));
+    r->n = n + 1 - half;
+    memcpy(r->u.leaf.keys, &all_keys[half], r->n * sizeof(long long));
+    memcpy(r->u.leaf.values, &all_values[half], r->n * sizeof(long long));
+    r->next = b->next;
+    b->next = right;
+    t->count++;
+    return btree_insert_inner(tid, segbase, t, path, index, t->height - 2,
+            r->u.leaf.keys[0], right);
+}
+
+int rvm_btree_get(void* segbase, int tree, long long key, long long* value)
+{
+    btree_t* t = btree_get_tree(segbase, tree);
+    if (!t)
+        return -1;
+    btnode_t* b = btree_descend(segbase, t, key, NULL, NULL);
+    int i = upper_bound(b->u.leaf.keys, b->n, key);
+    if (i == 0 || b->u.leaf.keys[i - 1] != key)
+        return 0;
+    if (value)
+        *value = b->u.leaf.values[i - 1];
+    return 1;
+}
+
+/* leaves are not merged when they run low, a leaf left empty stays in
+ * the tree and takes new keys of its range */
+int rvm_btree_del(trans_t tid, void* segbase, int tree, long long key)
+{
+    btree_t* t = btree_get_tree(segbase, tree);
+    if (!t)
+        return -1;
+    btnode_t* b = btree_descend(segbase, t, key, NULL, NULL);
+    long long* keys = b->u.leaf.keys;
+    long long* values = b->u.leaf.values;
+    int n = b->n;
+    int i = upper_bound(keys, n, key) - 1;
+    if (i < 0 || keys[i] != key)
+        return 0;
+
+    decl_t d;
+    decl_init(&d, tid, segbase);
+    decl_add(&d, &t->count, sizeof(int));
+    decl_add(&d, &b->n, sizeof(int));
+    decl_add(&d, &keys[i], (n - i - 1) * sizeof(long long));
+    decl_add(&d, &values[i], (n - i - 1) * sizeof(long long));
+    if (decl_done(&d) < 0)
+        return -1;
+    memmove(&keys[i], &keys[i + 1], (n - i - 1) * sizeof(long long));
+    memmove(&values[i], &values[i + 1], (n - i - 1) * sizeof(long long));
+    b->n--;
+    t->count--;
+    return 1;
+}
+
+int rvm_btree_count(void* segbase, int tree)
+{
+    btree_t* t = btree_get_tree(segbase, tree);
+    return t ? t->count : -1;
+}
+
+int rvm_hash_count(void* segbase, int map)
+{
+    rhash_t* h = hash_get_map(segbase, map);
+    return h ? h->count : -1;
+}
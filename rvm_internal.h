@@ -5,33 +5,352 @@
 #ifndef __LIBRVM_INTERNAL__
 #define __LIBRVM_INTERNAL__ 
 
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
 #define MAXLINE 512 
-#define MAXDIR 100 
+#define REGISTRY_INIT 16 /* initial number of rvm instance slots */
+#define PAGE_SIZE 4096 /* unit of the file formats and page bookkeeping, not of mprotect */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define FILL_CHUNK 65536
+#define SPARSE_MAGIC (-0x52564d5a) /* first int of a sparse data file, sizes are never negative */
+#define SPARSE_HEADER PAGE_SIZE /* magic and size, padded so the data is page aligned */
+#define MAP_WORKERS_MAX 64 /* threads loading segments in rvm_map_many */
+#define MANIFEST_NAME "rvm.manifest"
+#define MANIFEST_HEADER "rvm-manifest 1"
+#define MANIFEST_LOCK "rvm.lock" /* flock'd by processes sharing the directory */
+#define LOGDIR_NAME "rvm.logdir" /* names the log directory of a data directory */
+#define STRIPES_HEADER "rvm-stripes 1"
+#define STRIPE_DIRTY 2 /* manifest dirty value of a stripe log, replayed only by its striped segment */
+#define STRIPE_PARALLEL_MIN (1024 * 1024) /* commits this large write stripes in parallel */
+#define SHM_HEADER 4096 /* metadata page in front of shared segment data */
+#define SHM_MAGIC 0x52564d53
+
+/* log record header flags, stored in the high bits of the size field */
+#define LOG_COMPRESSED 0x40000000 /* payload is lz compressed */
+#define LOG_LSN 0x20000000 /* a sequence number follows the offset */
+#define LOG_MORE 0x10000000 /* the transaction goes on in the next record */
+#define LOG_SIZE_MASK 0x0fffffff
+#define LOG_MAX_RECORD LOG_SIZE_MASK /* larger ranges span several records */
+
+/* compact log records. A frame holds the records of one transaction in
+ * a segment log: an int header with LOG_FRAME and the format version,
+ * never set in the size field of the older records, the varint lsn of
+ * its first record, then the records, each a tag byte and varints. The
+ * tag holds the size when it is below LOG_TAG_SIZE, else a varint size
+ * follows */
+#define LOG_FRAME 0x80000000
+#define LOG_FRAME_VERSION 1
+#define LOG_TAG_MORE 0x80 /* another record of the frame follows */
+#define LOG_TAG_COMPRESSED 0x40
+#define LOG_TAG_BACK 0x20 /* offset lies before the end of the previous record */
+#define LOG_TAG_SIZE 0x20
+#define LOG_VARINT_MAX 10 /* bytes of a 64 bit varint */
+
+#define LOG_ALIGN 4096 /* block size of direct log writes */
+#define LOG_STAGE_MAX 65536 /* initial staging buffer size */
+#define LOG_PREALLOC (4 * 1024 * 1024) /* direct logs grow by this much */
 
 typedef struct {
     char directory[MAXLINE];
-    int rid;
+    int rid; /* slot in the instance registry */
+    int gen; /* generation of the slot, detects closed handles */
 } rvm_t;
 
 typedef struct {
     int rid; /* rvm id associated with the transaction */
     int numsegs;
     void** segbases;
+    void** segs; /* segment_t of each segbase, resolved at begin */
+    int flags; /* RVM_TRANS_* flags given to rvm_begin_trans_flags */
 } trans;
 
 typedef trans* trans_t;
 
+/* completion handle of rvm_commit_trans_async, increasing in commit order */
+typedef long long rvm_commit_t;
+
 typedef struct {
     int size;
     int offset;
-    char* data;
+    char* data; /* pre-image, NULL in redo-only transactions */
+    char* block; /* allocation to free with this log, may hold several pre-images */
+    long long spill; /* offset of the pre-image in the undo file, -1 if in memory */
+    int charged; /* bytes of the undo budget this log holds */
 } log_t;
 
+/* a range declared through rvm_about_to_modify_v */
+typedef struct {
+    void* segbase;
+    int offset;
+    int size;
+} range_t;
+
+/* a decoded log record */
+typedef struct {
+    int size; /* bytes of segment data covered */
+    int offset;
+    int compressed;
+    int clen; /* stored payload length */
+    char* data; /* stored payload */
+    long long lsn; /* sequence number, 0 in records without one */
+    int more; /* LOG_MORE was set */
+    int group_end; /* log_next has seen the transaction complete up to here */
+    int frame_pos; /* next record of the current compact frame, 0 outside one */
+    int prev_end; /* end offset of the previous record of the frame */
+} logrec_t;
+
+/* durable truncation progress of a segment, kept in <segment>.ckpt */
+typedef struct {
+    long long lsn; /* highest sequence number applied to the data file */
+    long long pos; /* log offset to resume from */
+} ckpt_t;
+
+/* staging buffer and append state of a segment log */
+typedef struct logbuf_t {
+    int fd; /* -1 while the log is closed */
+    int direct; /* O_DIRECT aligned appends */
+    char* buf; /* LOG_ALIGN aligned staging buffer */
+    int cap;
+    int len; /* staged bytes */
+    off_t base; /* file offset of buf[0] in direct mode */
+    off_t prealloc; /* preallocated length of a direct log */
+    struct logbuf_t* mirror; /* receives a copy of every append, e.g. a standby log */
+    long long total; /* bytes appended since the log was opened */
+    int frame; /* a compact frame is open, its next record continues it */
+    int frame_end; /* end offset of the last record of the open frame */
+} logbuf_t;
+
+/* a segment listed in the directory manifest */
+typedef struct {
+    char name[MAXLINE];
+    int size;
+    int dirty; /* the log may hold records, STRIPE_DIRTY for a stripe */
+} mentry_t;
+
+typedef struct {
+    mentry_t* entries;
+    int n;
+    int cap;
+    int scanned; /* rebuilt from a directory scan, not yet saved */
+} manifest_t;
+
+/* page states of a lazily recovered segment */
+#define PAGE_UNLOADED 0
+#define PAGE_LOADING 1
+#define PAGE_LOADED 2
+
+/* a segment recovered page by page on first access */
+typedef struct lazy_t {
+    struct lazy_t* next;
+    char* base;
+    int length; /* segment bytes */
+    int page; /* bytes of a page, the system page size */
+    int npages;
+    int data_fd; /* segment data file */
+    int data_off; /* offset of the data in it */
+    char* log; /* the log as it was when the segment was mapped */
+    int log_len;
+    int* first; /* records of page p are recs[first[p]] .. recs[first[p + 1] - 1] */
+    int* recs; /* log positions of the records, grouped by page */
+    char* state; /* PAGE_* of each page */
+    int loaded; /* pages loaded so far */
+    char* scratch; /* decompressed copy of the record whose payload is at scratch_pos */
+    int scratch_pos;
+    long long ck_lsn; /* records up to this lsn are in the data file */
+    char scratch_busy;
+} lazy_t;
+
+/* metadata page of a segment shared between processes */
+typedef struct {
+    int magic; /* SHM_MAGIC once the data is loaded */
+    int length; /* largest size any process mapped */
+    long long next_lsn; /* sequence number of the next log record */
+    pthread_mutex_t lock; /* process shared and robust, held by a transaction */
+} shm_header_t;
+
+/* the pages of one segment in a read snapshot. A page is copied in
+ * before the first transaction after the snapshot declares a range on
+ * it, pages not copied are read from the segment itself */
+typedef struct snapseg_t {
+    struct snapseg_t* next; /* next snapshot of the same segment */
+    struct segment_t* seg;
+    void* segbase;
+    int npages;
+    char** pages; /* NULL while the page is unchanged */
+} snapseg_t;
+
+typedef struct {
+    int numsegs;
+    snapseg_t** segs;
+} snapshot;
+
+typedef snapshot* snapshot_t;
+
+/* a data directory whose logs are kept in another directory */
 typedef struct {
+    char data[MAXLINE];
+    char log[MAXLINE];
+} logdir_t;
+
+/* crash points of fault builds, see fault_write in rvm.c */
+#ifdef RVM_FAULT_INJECT
+#define RVM_FAULT_EXIT 86 /* exit status of an injected crash */
+void fault_point();
+ssize_t fault_write(int fd, const void* buf, size_t n, off_t offset);
+#define FAULT_POINT() fault_point()
+#else
+#define FAULT_POINT() ((void) 0)
+#endif
+
+/* stripe layout of a striped segment */
+typedef struct {
+    int stripe_size;
+    int size; /* segment bytes */
+    int nstripes;
+    int ndirs;
+    char (*dirs)[MAXLINE];
+} layout_t;
+
+typedef struct segment_t {
     char path[MAXLINE];
+    char name[MAXLINE];
+    char dir[MAXLINE]; /* directory holding the files and manifest entry */
     int length;
     int modified;
     void* undo_log;
+    int undo_fd; /* unlinked file of pre-images over the undo budget, -1 until needed */
+    long long undo_end; /* bytes in use in the undo file */
+    int alloc_mode; /* RVM_ALLOC_* backing of the in memory segment */
+    size_t map_len; /* length of the anonymous mapping */
+    size_t reserve_len; /* address space held for growth, map_len included */
+    int sparse; /* data file is sparse: zero pages are holes */
+    logbuf_t writer; /* log append state */
+    long long next_lsn; /* sequence number of the next log record */
+    int log_dirty; /* the manifest already marks the log as non-empty */
+    lazy_t* lazy; /* lazy recovery state, NULL for eagerly loaded segments */
+    snapseg_t* snaps; /* open read snapshots of the segment */
+    unsigned char* dirty_pages; /* bitmap of pages committed since the last checkpoint */
+    logbuf_t ship; /* append state of the standby log */
+    long long ship_from; /* first sequence number of the open standby append */
+    long long ship_records; /* shipped since the standby was seeded */
+    long long ship_bytes;
+    int log_lock; /* directory lock held while the log is open, -1 if none */
+    int nstripes; /* 0 unless the segment is striped */
+    struct segment_t** stripes; /* each stripe is logged like a segment of its own */
+    int stripe_size;
+    int commit_fd; /* commit record of a striped segment */
+    long long commit_seq; /* sequence number of its last commit */
+    struct segment_t* parent; /* striped segment of a stripe, NULL otherwise */
+    int stripe_offset; /* of a stripe within its parent */
+    shm_header_t* shm; /* metadata of a shared segment, NULL for private ones */
+    int shm_fd;
+    unsigned long shm_key; /* lock order among shared segments */
 } segment_t;   
 
+/* heap of rvm_seg_alloc at offset 0 of a segment. Offsets of 0 end
+ * the free lists, no block lives there */
+#define HEAP_MAGIC 0x52564d48
+#define HEAP_CLASSES 8 /* size classes of 16 to 2048 bytes */
+#define HEAP_MIN_CLASS 16
+#define HEAP_ALIGN 8
+#define HEAP_SLAB 16384 /* bytes taken from the top for a new slab */
+
+typedef struct {
+    int magic;
+    int top; /* first byte never handed out */
+    int root; /* offset set by rvm_seg_set_root */
+    int large; /* free list of blocks above the size classes */
+    int free[HEAP_CLASSES]; /* free list of each size class */
+    struct {
+        int next; /* next unused block of the current slab */
+        int end;
+    } slabs[HEAP_CLASSES];
+} heap_t;
+
+/* header in front of each block */
+typedef struct {
+    int size; /* usable bytes, negated while the block is free */
+    int next; /* next free block of the same list */
+} hblock_t;
+
+/* recoverable indexes of rvm_index.c, allocated in the segment heap.
+ * Nodes and slot arrays start on a cache line */
+#define CACHE_LINE 64
+#define INDEX_DECL_MAX 4 /* ranges an index update declares at once */
+
+#define HASH_MAGIC 0x52564d49
+#define HASH_MIN_CAPACITY 16
+#define HASH_LOAD_PCT 70 /* live and deleted slots, before a resize */
+#define HASH_EMPTY (-0x7fffffffffffffffLL - 1) /* keys marking free slots */
+#define HASH_DELETED (-0x7fffffffffffffffLL)
+
+typedef struct {
+    int magic;
+    int capacity; /* slots, a power of two */
+    int count; /* live entries */
+    int used; /* live and deleted slots, next to count */
+    int slots; /* offset of the slot array */
+    int block; /* offset rvm_seg_alloc returned for the slot array */
+} rhash_t;
+
+/* four slots to a cache line */
+typedef struct {
+    long long key;
+    long long value;
+} rslot_t;
+
+#define BTREE_MAGIC 0x52564d42
+#define BTREE_LEAF_KEYS 11
+#define BTREE_INNER_KEYS 14
+#define BTREE_MAX_HEIGHT 16
+
+typedef struct {
+    int magic;
+    int root;
+    int height; /* levels, 1 while the root is a leaf; next to root */
+    int count;
+} btree_t;
+
+/* a node takes three cache lines, the keys of an inner node the first
+ * two of them */
+typedef struct {
+    int leaf;
+    int n; /* keys in the node, an inner node has n + 1 children */
+    int next; /* next leaf in key order, 0 for the last */
+    int pad;
+    union {
+        struct {
+            long long keys[BTREE_LEAF_KEYS];
+            long long values[BTREE_LEAF_KEYS];
+        } leaf;
+        struct {
+            long long keys[BTREE_INNER_KEYS];
+            int children[BTREE_INNER_KEYS + 1];
+        } inner;
+    } u;
+} btnode_t;
+
+#define BTREE_NODE ((int) sizeof(btnode_t))
+
+/* log shipping statistics reported by rvm_standby_stats, summed over
+ * the mapped segments */
+typedef struct {
+    long long records_shipped;
+    long long bytes_shipped;
+    long long lag_records; /* shipped records the standby has not applied */
+    long long lag_bytes; /* unapplied bytes in the standby logs */
+    double bytes_per_sec; /* shipping throughput since rvm_set_standby */
+} shipstat_t;
+
+/* per segment statistics reported by rvm_seg_stats */
+typedef struct {
+    int length;
+    int alloc_mode;
+    size_t mapped_bytes;
+    int pages_total;
+    int pages_loaded; /* fewer than pages_total while lazily recovering */
+} segstat_t;
+
 #endif
@@ -0,0 +1,173 @@
+/*
+ * LZ77 block codec for RVM log records
+ */
+
+#include <string.h>
+#include "rvm_lz.h"
+
+#define HASH_LOG 12
+#define HASH_SIZE (1 << HASH_LOG)
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define LAST_LITERALS 5 /* the block always ends with literals */
+#define MIN_INPUT 13 /* shorter inputs are stored as literals only */
+
+typedef unsigned char uchar;
+
+static unsigned int read32(const uchar* p)
+{
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int hash32(unsigned int v)
+{
+    return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/* write a length continuation: runs of 255 terminated by a smaller byte */
+static uchar* put_length(uchar* op, uchar* oend, int len)
+{
+    while (len >= 255) {
+        if (op >= oend)
+            return NULL;
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend)
+        return NULL;
+    *op++ = (uchar) len;
+    return op;
+}
+
+/* emit one sequence of literals followed by an optional match. A zero
+ * match length marks the final, literal only sequence */
+static uchar* put_sequence(uchar* op, uchar* oend, const uchar* lit, int nlit,
+        int offset, int mlen)
+{
+    uchar* token = op++;
+    if (op > oend)
+        return NULL;
+
+    *token = (uchar) ((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15 && !(op = put_length(op, oend, nlit - 15)))
+        return NULL;
+    if (op + nlit > oend)
+        return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if (mlen == 0)
+        return op;
+
+    if (op + 2 > oend)
+        return NULL;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    mlen -= MIN_MATCH;
+    *token |= mlen < 15 ? mlen : 15;
+    if (mlen >= 15 && !(op = put_length(op, oend, mlen - 15)))
+        return NULL;
+    return op;
+}
+
+/* compress srclen bytes into dst. Returns the compressed length, or 0
+ * if the result does not fit in dstcap bytes */
+int lz_compress(const char* src, int srclen, char* dst, int dstcap)
+{
+    const uchar* s = (const uchar*) src;
+    uchar* op = (uchar*) dst;
+    uchar* oend = op + dstcap;
+    int table[HASH_SIZE];
+    int ip = 0, anchor = 0;
+
+    memset(table, -1, sizeof(table));
+    if (srclen >= MIN_INPUT) {
+        int limit = srclen - MIN_INPUT;
+        while (ip < limit) {
+            unsigned int seq = read32(s + ip);
+            int h = hash32(seq);
+            int ref = table[h];
+            table[h] = ip;
+
+            if (ref < 0 || ip - ref > MAX_OFFSET || read32(s + ref) != seq) {
+                ip += 1 + ((ip - anchor) >> 6); /* skip faster over noise */
+                continue;
+            }
+
+            int mlen = MIN_MATCH;
+            while (ip + mlen < srclen - LAST_LITERALS && s[ref + mlen] == s[ip + mlen])
+                mlen++;
+
+            op = put_sequence(op, oend, s + anchor, ip - anchor, ip - ref, mlen);
+            if (!op)
+                return 0;
+            ip += mlen;
+            anchor = ip;
+        }
+    }
+
+    op = put_sequence(op, oend, s + anchor, srclen - anchor, 0, 0);
+    if (!op)
+        return 0;
+    return (int) (op - (uchar*) dst);
+}
+
+/* decompress a block into exactly dstlen bytes. Returns dstlen, or -1
+ * if the block is malformed */
+int lz_decompress(const char* src, int srclen, char* dst, int dstlen)
+{
+    const uchar* ip = (const uchar*) src;
+    const uchar* iend = ip + srclen;
+    uchar* op = (uchar*) dst;
+    uchar* oend = op + dstlen;
+
+    while (ip < iend) {
+        int token = *ip++;
+
+        int nlit = token >> 4;
+        if (nlit == 15) {
+            int b;
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                nlit += b;
+            } while (b == 255);
+        }
+        if (ip + nlit > iend || op + nlit > oend)
+            return -1;
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+
+        if (ip == iend)
+            break; /* final literal only sequence */
+
+        if (ip + 2 > iend)
+            return -1;
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        int mlen = token & 15;
+        if (mlen == 15) {
+            int b;
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += MIN_MATCH;
+
+        if (offset == 0 || offset > op - (uchar*) dst || op + mlen > oend)
+            return -1;
+        /* byte copy, the match may overlap its own output */
+        const uchar* match = op - offset;
+        while (mlen--)
+            *op++ = *match++;
+    }
+
+    return op == oend ? dstlen : -1;
+}
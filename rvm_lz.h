@@ -0,0 +1,16 @@
+/*
+ *  Small LZ77 block codec used to compress large log records. The
+ *  block format follows LZ4: a token byte with literal and match
+ *  lengths, the literals, and a 16 bit little endian match offset.
+ */
+
+#ifndef __LIBRVM_LZ__
+#define __LIBRVM_LZ__
+
+/* worst case size of the compressed form of n bytes */
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+int lz_compress(const char* src, int srclen, char* dst, int dstcap);
+int lz_decompress(const char* src, int srclen, char* dst, int dstlen);
+
+#endif
@@ -0,0 +1,188 @@
+/* async_commit.c - test asynchronous commits. A counter at the start
+ * of the segment is rewritten by every transaction, so recovery only
+ * sees the last value if the commits reached the log in order. Commits
+ * to shared segments, written right away, keep the order of handles */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#define SEGSIZE 10000
+#define NTRANS 200
+#define NQUEUED 200
+#define BIGSIZE (1024 * 1024)
+
+
+/* proc1 commits a run of async transactions, each one modifying the
+ * counter again right after the previous commit returned, then one
+ * synchronous transaction, and crashes */
+void proc1() 
+{
+     rvm_t rvm;
+     trans_t trans;
+     char* segs[1];
+     rvm_commit_t handles[NTRANS];
+     int i;
+     
+     rvm = rvm_init("rvm_segments");
+     rvm_destroy(rvm, "aseg");
+     segs[0] = (char *) rvm_map(rvm, "aseg", SEGSIZE);
+
+     for (i = 0; i < NTRANS; i++) {
+	  trans = rvm_begin_trans(rvm, 1, (void **) segs);
+	  rvm_about_to_modify(trans, segs[0], 0, sizeof(int));
+	  rvm_about_to_modify(trans, segs[0], 100 + i * 8, 8);
+	  *(int*) segs[0] = i;
+	  sprintf(segs[0] + 100 + i * 8, "t%06d", i);
+	  handles[i] = rvm_commit_trans_async(trans);
+	  if (i > 0 && handles[i] <= handles[i - 1]) {
+	       printf("ERROR: handles out of order\n");
+	       exit(2);
+	  }
+     }
+
+     if (rvm_wait(handles[NTRANS / 2]) != 0 || rvm_poll(handles[NTRANS / 2]) != 1) {
+	  printf("ERROR: waited commit not complete\n");
+	  exit(2);
+     }
+     if (rvm_poll(handles[NTRANS - 1] + 1) != -1) {
+	  printf("ERROR: unknown handle accepted\n");
+	  exit(2);
+     }
+
+     /* a synchronous commit lands after all async ones */
+     trans = rvm_begin_trans(rvm, 1, (void **) segs);
+     rvm_about_to_modify(trans, segs[0], sizeof(int), sizeof(int));
+     *(int*) (segs[0] + sizeof(int)) = NTRANS;
+     rvm_commit_trans(trans);
+     if (rvm_poll(handles[NTRANS - 1]) != 1) {
+	  printf("ERROR: sync commit overtook async commits\n");
+	  exit(2);
+     }
+
+     abort();
+}
+
+
+typedef struct committer {
+     rvm_t rvm;
+     char* segs[1];
+     int size; /* bytes each commit rewrites */
+     int batch; /* commits issued before waiting for the last one */
+     int count; /* commits to make, 0 = until stop is set */
+     rvm_commit_t last; /* last waited handle */
+     struct committer* peer; /* the committer in the other thread */
+} committer_t;
+
+static int stop = 0;
+
+/* commit async transactions in batches and wait for each batch. A
+ * waited handle, of either thread, has to stay done while other commits
+ * complete */
+static void* committer(void* arg)
+{
+     committer_t* c = (committer_t*) arg;
+     committer_t* peer = c->peer;
+     rvm_commit_t handle, seen;
+     int i;
+     for (i = 0; c->count ? i < c->count : !__atomic_load_n(&stop, __ATOMIC_ACQUIRE); i++) {
+	  seen = __atomic_load_n(&peer->last, __ATOMIC_ACQUIRE);
+	  if ((c->last && rvm_poll(c->last) != 1) || (seen && rvm_poll(seen) != 1)) {
+	       printf("ERROR: waited commit no longer done\n");
+	       exit(2);
+	  }
+	  trans_t trans = rvm_begin_trans(c->rvm, 1, (void **) c->segs);
+	  rvm_about_to_modify(trans, c->segs[0], 0, c->size);
+	  memset(c->segs[0], i, c->size);
+	  handle = rvm_commit_trans_async(trans);
+	  if (i % c->batch == c->batch - 1) {
+	       rvm_wait(handle);
+	       __atomic_store_n(&c->last, handle, __ATOMIC_RELEASE);
+	  }
+     }
+     return NULL;
+}
+
+
+/* proc2 checks that every commit was recovered, in order */
+void proc2() 
+{
+     char* segs[1];
+     rvm_t rvm;
+     char expect[16];
+     int i;
+     
+     rvm = rvm_init("rvm_segments");
+     segs[0] = (char *) rvm_map(rvm, "aseg", SEGSIZE);
+
+     if (*(int*) segs[0] != NTRANS - 1 || *(int*) (segs[0] + sizeof(int)) != NTRANS) {
+	  printf("ERROR: counter is %d\n", *(int*) segs[0]);
+	  exit(2);
+     }
+     for (i = 0; i < NTRANS; i++) {
+	  sprintf(expect, "t%06d", i);
+	  if (memcmp(segs[0] + 100 + i * 8, expect, 8)) {
+	       printf("ERROR: transaction %d missing\n", i);
+	       exit(2);
+	  }
+     }
+
+     /* one thread queues large commits while another commits to a
+      * shared segment, which is written right away */
+     committer_t big, shared;
+     big.rvm = rvm;
+     rvm_destroy(rvm, "abig");
+     big.segs[0] = (char *) rvm_map(rvm, "abig", BIGSIZE);
+     big.size = BIGSIZE;
+     big.batch = 4;
+     big.count = NQUEUED;
+     shared.rvm = rvm_init("rvm_segments");
+     rvm_set_option(shared.rvm, RVM_OPT_SHARED, 1);
+     rvm_destroy(shared.rvm, "ashared");
+     shared.segs[0] = (char *) rvm_map(shared.rvm, "ashared", SEGSIZE);
+     shared.size = sizeof(int);
+     shared.batch = 1;
+     shared.count = 0;
+     big.last = shared.last = 0;
+     big.peer = &shared;
+     shared.peer = &big;
+     pthread_t thread;
+     pthread_create(&thread, NULL, committer, &shared);
+     committer(&big);
+     __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+     pthread_join(thread, NULL);
+     if (rvm_poll(big.last) != 1 || rvm_poll(shared.last) != 1) {
+	  printf("ERROR: waited commits not done\n");
+	  exit(2);
+     }
+     rvm_close(shared.rvm); /* drains the queue */
+
+     printf("OK\n");
+     exit(0);
+}
+
+
+int main(int argc, char **argv)
+{
+     int pid;
+
+     pid = fork();
+     if(pid < 0) {
+	  perror("fork");
+	  exit(2);
+     }
+     if(pid == 0) {
+	  proc1();
+	  exit(0);
+     }
+
+     waitpid(pid, NULL, 0);
+
+     proc2();
+
+     return 0;
+}
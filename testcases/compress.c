@@ -0,0 +1,111 @@
+/* compress.c - test that compressed log records are smaller on disk and
+ * replay correctly after a crash */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define SEGSIZE 200000
+#define RANGE 65536
+#define OFFSET2 100000
+#define TEST_STRING "hello, small record"
+#define LOGPATH "rvm_segments/compseg.log"
+
+/* repeated text, compresses well */
+static void fill_text(char* p, int n)
+{
+     const char* text = "the quick brown fox jumps over the lazy dog. ";
+     int i;
+     for (i = 0; i < n; i++)
+	  p[i] = text[i % strlen(text)];
+}
+
+
+/* proc1 commits a zeroed range, a text range and a small record */
+void proc1() 
+{
+     rvm_t rvm;
+     trans_t trans;
+     char* segs[1];
+     struct stat st;
+     
+     rvm = rvm_init("rvm_segments");
+     rvm_destroy(rvm, "compseg");
+     rvm_set_option(rvm, RVM_OPT_COMPRESS, 1024);
+     segs[0] = (char *) rvm_map(rvm, "compseg", SEGSIZE);
+
+     trans = rvm_begin_trans(rvm, 1, (void **) segs);
+     rvm_about_to_modify(trans, segs[0], 0, RANGE);
+     memset(segs[0], 0, RANGE);
+     rvm_about_to_modify(trans, segs[0], OFFSET2, RANGE);
+     fill_text(segs[0] + OFFSET2, RANGE);
+     rvm_about_to_modify(trans, segs[0], SEGSIZE - 100, 100);
+     strcpy(segs[0] + SEGSIZE - 100, TEST_STRING);
+     rvm_commit_trans(trans);
+
+     stat(LOGPATH, &st);
+     if (st.st_size >= RANGE) {
+	  printf("ERROR: log not compressed (%ld bytes)\n", (long) st.st_size);
+	  exit(2);
+     }
+
+     abort();
+}
+
+
+/* proc2 recovers the segment and checks every byte */
+void proc2() 
+{
+     char* segs[1];
+     char expect[RANGE];
+     rvm_t rvm;
+     int i;
+     
+     rvm = rvm_init("rvm_segments");
+     segs[0] = (char *) rvm_map(rvm, "compseg", SEGSIZE);
+
+     for (i = 0; i < RANGE; i++) {
+	  if (segs[0][i] != 0) {
+	       printf("ERROR: zeroed range mismatch at %d\n", i);
+	       exit(2);
+	  }
+     }
+     fill_text(expect, RANGE);
+     if (memcmp(segs[0] + OFFSET2, expect, RANGE)) {
+	  printf("ERROR: text range mismatch\n");
+	  exit(2);
+     }
+     if (strcmp(segs[0] + SEGSIZE - 100, TEST_STRING)) {
+	  printf("ERROR: small record not present\n");
+	  exit(2);
+     }
+
+     printf("OK\n");
+     exit(0);
+}
+
+
+int main(int argc, char **argv)
+{
+     int pid;
+
+     pid = fork();
+     if(pid < 0) {
+	  perror("fork");
+	  exit(2);
+     }
+     if(pid == 0) {
+	  proc1();
+	  exit(0);
+     }
+
+     waitpid(pid, NULL, 0);
+
+     proc2();
+
+     return 0;
+}
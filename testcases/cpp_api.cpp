@@ -0,0 +1,133 @@
+/* cpp_api.cpp - test the typed C++ interface. Members and array slices
+ * are declared by member pointer, slices outside their member are
+ * refused, a transaction left by an exception is rolled back, and
+ * committed members are recovered after a crash */
+
+#include "rvm.hpp"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+struct Account {
+     int id;
+     long balance;
+     char owner[16];
+     int history[64];
+     int count;
+};
+
+
+/* proc1 commits through the typed interface and crashes */
+void proc1() 
+{
+     rvm_t rvm = rvm_init("rvm_segments");
+     rvm_destroy(rvm, "account");
+     rvm::Segment<Account> acct(rvm, "account");
+     rvm::Segment<int> counter(rvm, "counter");
+
+     {
+	  rvm::Transaction tx(rvm, acct, counter);
+	  tx.modify(acct);
+	  tx.modify(counter);
+	  memset(acct.get(), 0, sizeof(Account));
+	  acct->id = 7;
+	  strcpy(acct->owner, "ada");
+	  *counter = 0;
+	  tx.commit();
+     }
+
+     for (int i = 0; i < 10; i++) {
+	  rvm::Transaction tx(rvm, acct, counter);
+	  tx.modify(acct, &Account::balance, &Account::count,
+		    rvm::slice(&Account::history, acct->count, 1));
+	  tx.modify(counter);
+	  acct->balance += 100;
+	  acct->history[acct->count++] = 100;
+	  (*counter)++;
+	  tx.commit();
+     }
+
+     /* unwinding aborts the transaction */
+     try {
+	  rvm::Transaction tx(rvm, acct);
+	  tx.modify(acct, &Account::balance, &Account::owner);
+	  acct->balance = -1;
+	  strcpy(acct->owner, "mallory");
+	  throw 1;
+     } catch (int) {
+     }
+     if (acct->balance != 1000 || strcmp(acct->owner, "ada") != 0) {
+	  printf("ERROR: unwound transaction not aborted\n");
+	  exit(2);
+     }
+
+     /* a slice past the end of its member is refused */
+     try {
+	  rvm::Transaction tx(rvm, acct);
+	  tx.modify(acct, rvm::slice(&Account::history, 60, 5));
+	  printf("ERROR: slice past the member accepted\n");
+	  exit(2);
+     } catch (rvm::Error&) {
+     }
+
+     /* an ended transaction refuses more declarations */
+     rvm::Transaction tx(rvm, acct);
+     tx.abort();
+     try {
+	  tx.modify(acct, &Account::id);
+	  printf("ERROR: declaration after abort accepted\n");
+	  exit(2);
+     } catch (rvm::Error&) {
+     }
+
+     abort();
+}
+
+
+/* proc2 checks the recovered account */
+void proc2() 
+{
+     rvm_t rvm = rvm_init("rvm_segments");
+     rvm::Segment<Account> acct(rvm, "account");
+     rvm::Segment<int> counter(rvm, "counter");
+     int i;
+
+     if (acct->id != 7 || acct->balance != 1000 || acct->count != 10
+	 || *counter != 10 || strcmp(acct->owner, "ada") != 0) {
+	  printf("ERROR: account not recovered\n");
+	  exit(2);
+     }
+     for (i = 0; i < 10; i++) {
+	  if (acct->history[i] != 100) {
+	       printf("ERROR: history not recovered\n");
+	       exit(2);
+	  }
+     }
+
+     printf("OK\n");
+     exit(0);
+}
+
+
+int main(int argc, char **argv)
+{
+     int pid;
+
+     pid = fork();
+     if(pid < 0) {
+	  perror("fork");
+	  exit(2);
+     }
+     if(pid == 0) {
+	  proc1();
+	  exit(0);
+     }
+
+     waitpid(pid, NULL, 0);
+
+     proc2();
+
+     return 0;
+}
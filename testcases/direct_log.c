@@ -0,0 +1,93 @@
+/* direct_log.c - test that records staged and appended with O_DIRECT
+ * survive a crash, across block boundaries and log truncations */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#define SEGSIZE 100000
+#define NTRANS 40
+
+
+/* the byte pattern written by transaction t */
+static int range_off(int t) { return (t * 2311) % (SEGSIZE - 5000); }
+static int range_len(int t) { return 1 + (t * 997) % 5000; }
+
+
+/* proc1 commits transactions of varying sizes, truncating halfway */
+void proc1() 
+{
+     rvm_t rvm;
+     trans_t trans;
+     char* segs[1];
+     int t;
+     
+     rvm = rvm_init("rvm_segments");
+     rvm_destroy(rvm, "directseg");
+     rvm_set_option(rvm, RVM_OPT_DIRECT_LOG, 1);
+     segs[0] = (char *) rvm_map(rvm, "directseg", SEGSIZE);
+
+     for (t = 0; t < NTRANS; t++) {
+	  trans = rvm_begin_trans(rvm, 1, (void **) segs);
+	  rvm_about_to_modify(trans, segs[0], range_off(t), range_len(t));
+	  memset(segs[0] + range_off(t), 'a' + t % 26, range_len(t));
+	  rvm_commit_trans(trans);
+
+	  /* the log is replaced under the open writer */
+	  if (t == NTRANS / 2)
+	       rvm_truncate_log(rvm);
+     }
+
+     abort();
+}
+
+
+/* proc2 replays the log and compares against the expected image */
+void proc2() 
+{
+     char* segs[1];
+     char* expect;
+     rvm_t rvm;
+     int t;
+     
+     rvm = rvm_init("rvm_segments");
+     segs[0] = (char *) rvm_map(rvm, "directseg", SEGSIZE);
+
+     expect = malloc(SEGSIZE);
+     memset(expect, '0', SEGSIZE);
+     for (t = 0; t < NTRANS; t++)
+	  memset(expect + range_off(t), 'a' + t % 26, range_len(t));
+
+     if (memcmp(segs[0], expect, SEGSIZE)) {
+	  printf("ERROR: segment does not match committed data\n");
+	  exit(2);
+     }
+
+     printf("OK\n");
+     exit(0);
+}
+
+
+int main(int argc, char **argv)
+{
+     int pid;
+
+     pid = fork();
+     if(pid < 0) {
+	  perror("fork");
+	  exit(2);
+     }
+     if(pid == 0) {
+	  proc1();
+	  exit(0);
+     }
+
+     waitpid(pid, NULL, 0);
+
+     proc2();
+
+     return 0;
+}
@@ -0,0 +1,99 @@
+/* hugepage.c - test that huge page backed segments fall back gracefully
+ * and still persist data */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#define SEGSIZE (4 * 1024 * 1024)
+#define TEST_STRING "hello, huge world"
+#define OFFSET2 (3 * 1024 * 1024)
+
+
+/* proc1 maps with explicit huge pages, writes some data, commits it */
+void proc1() 
+{
+     rvm_t rvm;
+     trans_t trans;
+     char* segs[1];
+     segstat_t stats;
+     
+     rvm = rvm_init("rvm_segments");
+     rvm_destroy(rvm, "hugeseg");
+     rvm_set_option(rvm, RVM_OPT_HUGEPAGES, RVM_HUGEPAGES_EXPLICIT);
+     segs[0] = (char *) rvm_map(rvm, "hugeseg", SEGSIZE);
+
+     if (rvm_seg_stats(rvm, segs[0], &stats) != 0 || stats.length != SEGSIZE) {
+	  printf("ERROR: bad segment stats\n");
+	  exit(2);
+     }
+     if (stats.mapped_bytes < SEGSIZE) {
+	  printf("ERROR: mapping shorter than segment\n");
+	  exit(2);
+     }
+     
+     trans = rvm_begin_trans(rvm, 1, (void **) segs);
+     rvm_about_to_modify(trans, segs[0], 0, 100);
+     sprintf(segs[0], TEST_STRING);
+     rvm_about_to_modify(trans, segs[0], OFFSET2, 100);
+     sprintf(segs[0]+OFFSET2, TEST_STRING);
+     rvm_commit_trans(trans);
+
+     abort();
+}
+
+
+/* proc2 maps with transparent huge pages and reads the data back */
+void proc2() 
+{
+     char* segs[1];
+     rvm_t rvm;
+     segstat_t stats;
+     
+     rvm = rvm_init("rvm_segments");
+     if (rvm_set_option(rvm, RVM_OPT_HUGEPAGES, 42) == 0) {
+	  printf("ERROR: invalid policy accepted\n");
+	  exit(2);
+     }
+     rvm_set_option(rvm, RVM_OPT_HUGEPAGES, RVM_HUGEPAGES_TRANSPARENT);
+     segs[0] = (char *) rvm_map(rvm, "hugeseg", SEGSIZE);
+
+     rvm_seg_stats(rvm, segs[0], &stats);
+     if (stats.alloc_mode == RVM_ALLOC_HUGETLB) {
+	  printf("ERROR: transparent policy used hugetlb pages\n");
+	  exit(2);
+     }
+     if(strcmp(segs[0], TEST_STRING) || strcmp(segs[0]+OFFSET2, TEST_STRING)) {
+	  printf("ERROR: data not present\n");
+	  exit(2);
+     }
+
+     rvm_unmap(rvm, segs[0]);
+     printf("OK\n");
+     exit(0);
+}
+
+
+int main(int argc, char **argv)
+{
+     int pid;
+
+     pid = fork();
+     if(pid < 0) {
+	  perror("fork");
+	  exit(2);
+     }
+     if(pid == 0) {
+	  proc1();
+	  exit(0);
+     }
+
+     waitpid(pid, NULL, 0);
+
+     proc2();
+
+     return 0;
+}
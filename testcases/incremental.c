@@ -0,0 +1,120 @@
+/* incremental.c - test that the log can be truncated in bounded steps
+ * and that an interrupted truncation resumes correctly */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define SEGSIZE 100000
+#define NTRANS 50
+#define RANGE 1000
+#define STEP 4096
+#define LOGPATH "rvm_segments/stepseg.log"
+
+
+static void fill(char* seg, int t)
+{
+     memset(seg + t * RANGE, 'A' + t % 26, RANGE);
+}
+
+static long log_size()
+{
+     struct stat st;
+     stat(LOGPATH, &st);
+     return st.st_size;
+}
+
+
+/* proc1 commits, truncates in steps, commits again and crashes halfway
+ * through a second round of truncation */
+void proc1() 
+{
+     rvm_t rvm;
+     trans_t trans;
+     char* segs[1];
+     int t, steps = 0;
+     
+     rvm = rvm_init("rvm_segments");
+     rvm_destroy(rvm, "stepseg");
+     segs[0] = (char *) rvm_map(rvm, "stepseg", SEGSIZE);
+
+     for (t = 0; t < NTRANS; t++) {
+	  trans = rvm_begin_trans(rvm, 1, (void **) segs);
+	  rvm_about_to_modify(trans, segs[0], t * RANGE, RANGE);
+	  fill(segs[0], t);
+	  rvm_commit_trans(trans);
+
+	  /* interleave bounded steps with new commits */
+	  if (t == NTRANS / 2) {
+	       while (rvm_truncate_log_step(rvm, STEP) == 1)
+		    steps++;
+	       if (steps < 2 || log_size() != 0) {
+		    printf("ERROR: truncation was not incremental\n");
+		    exit(2);
+	       }
+	  }
+     }
+
+     long before = log_size();
+     if (rvm_truncate_log_step(rvm, STEP) != 1 || log_size() != before) {
+	  printf("ERROR: step did not stop within the budget\n");
+	  exit(2);
+     }
+
+     abort();
+}
+
+
+/* proc2 maps the segment, which finishes the interrupted truncation */
+void proc2() 
+{
+     char* segs[1];
+     char* expect;
+     rvm_t rvm;
+     int t;
+     
+     rvm = rvm_init("rvm_segments");
+     segs[0] = (char *) rvm_map(rvm, "stepseg", SEGSIZE);
+
+     expect = malloc(SEGSIZE);
+     memset(expect, '0', SEGSIZE);
+     for (t = 0; t < NTRANS; t++)
+	  fill(expect, t);
+     if (memcmp(segs[0], expect, SEGSIZE)) {
+	  printf("ERROR: segment does not match committed data\n");
+	  exit(2);
+     }
+     if (log_size() != 0) {
+	  printf("ERROR: log not cleared\n");
+	  exit(2);
+     }
+
+     printf("OK\n");
+     exit(0);
+}
+
+
+int main(int argc, char **argv)
+{
+     int pid;
+
+     pid = fork();
+     if(pid < 0) {
+	  perror("fork");
+	  exit(2);
+     }
+     if(pid == 0) {
+	  proc1();
+	  exit(0);
+     }
+
+     waitpid(pid, NULL, 0);
+
+     proc2();
+
+     return 0;
+}
@@ -0,0 +1,179 @@
+/* index.c - test the recoverable hash map and B+-tree. Keys go in
+ * over many transactions, splitting tree nodes and growing the hash
+ * table, some are deleted, an aborted transaction leaves both indexes
+ * as they were, and both are recovered after a crash */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#define SEGSIZE (256 * 4096)
+#define NKEYS 3000
+#define BATCH 100
+
+/* the root block: offsets of the two indexes */
+typedef struct {
+     int map;
+     int tree;
+} root_t;
+
+
+static long long key_of(int i)
+{
+     return (long long) ((i * 7919) % NKEYS) * 3 - 4000;
+}
+
+static long long value_of(long long key)
+{
+     return key * 1000003 + 17;
+}
+
+/* every fifth key is deleted */
+static int deleted(int i)
+{
+     return i % 5 == 0;
+}
+
+static void check(char* seg, root_t* root, const char* when)
+{
+     int i;
+     long long value;
+     for (i = 0; i < NKEYS; i++) {
+	  long long key = key_of(i);
+	  int want = !deleted(i);
+	  if (rvm_hash_get(seg, root->map, key, &value) != want
+	      || (want && value != value_of(key))) {
+	       printf("ERROR: hash map key %lld wrong %s\n", key, when);
+	       exit(2);
+	  }
+	  if (rvm_btree_get(seg, root->tree, key, &value) != want
+	      || (want && value != value_of(key))) {
+	       printf("ERROR: b+-tree key %lld wrong %s\n", key, when);
+	       exit(2);
+	  }
+	  /* keys in between were never inserted */
+	  if (rvm_hash_get(seg, root->map, key + 1, NULL) != 0
+	      || rvm_btree_get(seg, root->tree, key + 1, NULL) != 0) {
+	       printf("ERROR: key %lld found %s\n", key + 1, when);
+	       exit(2);
+	  }
+     }
+     int count = NKEYS - NKEYS / 5;
+     if (rvm_hash_count(seg, root->map) != count || rvm_btree_count(seg, root->tree) != count) {
+	  printf("ERROR: counts wrong %s\n", when);
+	  exit(2);
+     }
+}
+
+/* proc1 fills both indexes, deletes some keys and crashes */
+void proc1() 
+{
+     rvm_t rvm;
+     trans_t trans;
+     char* seg[1];
+     int i;
+     
+     rvm = rvm_init("rvm_segments");
+     rvm_destroy(rvm, "indexseg");
+     seg[0] = (char *) rvm_map(rvm, "indexseg", SEGSIZE);
+
+     trans = rvm_begin_trans(rvm, 1, (void **) seg);
+     int r = rvm_seg_alloc(trans, seg[0], sizeof(root_t));
+     root_t* root = (root_t*) (seg[0] + r);
+     rvm_about_to_modify(trans, seg[0], r, sizeof(root_t));
+     root->map = rvm_hash_create(trans, seg[0], 0);
+     root->tree = rvm_btree_create(trans, seg[0]);
+     rvm_seg_set_root(trans, seg[0], r);
+     rvm_commit_trans(trans);
+
+     for (i = 0; i < NKEYS; i++) {
+	  if (i % BATCH == 0)
+	       trans = rvm_begin_trans(rvm, 1, (void **) seg);
+	  long long key = key_of(i);
+	  /* a stale value first, overwritten in place */
+	  if (rvm_hash_put(trans, seg[0], root->map, key, -1) < 0
+	      || rvm_hash_put(trans, seg[0], root->map, key, value_of(key)) < 0
+	      || rvm_btree_put(trans, seg[0], root->tree, key, -1) < 0
+	      || rvm_btree_put(trans, seg[0], root->tree, key, value_of(key)) < 0) {
+	       printf("ERROR: insert of key %lld failed\n", key);
+	       exit(2);
+	  }
+	  if (i % BATCH == BATCH - 1)
+	       rvm_commit_trans(trans);
+     }
+
+     trans = rvm_begin_trans(rvm, 1, (void **) seg);
+     for (i = 0; i < NKEYS; i++) {
+	  if (!deleted(i))
+	       continue;
+	  if (rvm_hash_del(trans, seg[0], root->map, key_of(i)) != 1
+	      || rvm_btree_del(trans, seg[0], root->tree, key_of(i)) != 1) {
+	       printf("ERROR: delete of key %lld failed\n", key_of(i));
+	       exit(2);
+	  }
+     }
+     if (rvm_hash_del(trans, seg[0], root->map, key_of(0)) != 0
+	 || rvm_btree_del(trans, seg[0], root->tree, key_of(0)) != 0) {
+	  printf("ERROR: deleted key deleted again\n");
+	  exit(2);
+     }
+     rvm_commit_trans(trans);
+     check(seg[0], root, "after deletes");
+
+     /* an aborted transaction that grows both indexes and deletes from
+      * them changes nothing */
+     trans = rvm_begin_trans(rvm, 1, (void **) seg);
+     for (i = 0; i < NKEYS; i++) {
+	  rvm_hash_put(trans, seg[0], root->map, key_of(i) + 1, 0);
+	  rvm_btree_put(trans, seg[0], root->tree, key_of(i) + 1, 0);
+	  if (i % 7 == 1) {
+	       rvm_hash_del(trans, seg[0], root->map, key_of(i));
+	       rvm_btree_del(trans, seg[0], root->tree, key_of(i));
+	  }
+     }
+     rvm_abort_trans(trans);
+     check(seg[0], root, "after abort");
+
+     abort();
+}
+
+
+/* proc2 checks the recovered indexes */
+void proc2() 
+{
+     rvm_t rvm;
+     char* seg[1];
+     
+     rvm = rvm_init("rvm_segments");
+     seg[0] = (char *) rvm_map(rvm, "indexseg", SEGSIZE);
+     root_t* root = (root_t*) (seg[0] + rvm_seg_root(seg[0]));
+     check(seg[0], root, "after recovery");
+
+     printf("OK\n");
+     exit(0);
+}
+
+
+int main(int argc, char **argv)
+{
+     int pid;
+
+     pid = fork();
+     if(pid < 0) {
+	  perror("fork");
+	  exit(2);
+     }
+     if(pid == 0) {
+	  proc1();
+	  exit(0);
+     }
+
+     waitpid(pid, NULL, 0);
+
+     proc2();
+
+     return 0;
+}
@@ -0,0 +1,147 @@
+/* lazy.c - test that a lazily recovered segment loads pages on first
+ * access with their logged changes applied */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#define PAGES 64
+#define SEGSIZE (PAGES * 4096)
+#define TEST_STRING "hello, lazy page"
+#define BIG_OFFSET (20 * 4096 + 100)
+#define BIG_RANGE (3 * 4096)
+
+
+/* offset of the string logged for page p */
+static int page_off(int p) { return p * 4096 + p; }
+
+
+/* proc1 logs a change on every other page plus a compressed range that
+ * spans several pages, then crashes without truncating */
+void proc1() 
+{
+     rvm_t rvm;
+     trans_t trans;
+     char* segs[1];
+     int p;
+     
+     rvm = rvm_init("rvm_segments");
+     rvm_destroy(rvm, "lazyseg");
+     rvm_set_option(rvm, RVM_OPT_COMPRESS, 1024);
+     segs[0] = (char *) rvm_map(rvm, "lazyseg", SEGSIZE);
+
+     for (p = 0; p < PAGES; p += 2) {
+	  trans = rvm_begin_trans(rvm, 1, (void **) segs);
+	  rvm_about_to_modify(trans, segs[0], page_off(p), 100);
+	  sprintf(segs[0] + page_off(p), TEST_STRING " %d", p);
+	  rvm_commit_trans(trans);
+     }
+     trans = rvm_begin_trans(rvm, 1, (void **) segs);
+     rvm_about_to_modify(trans, segs[0], BIG_OFFSET, BIG_RANGE);
+     memset(segs[0] + BIG_OFFSET, 'z', BIG_RANGE);
+     rvm_commit_trans(trans);
+
+     abort();
+}
+
+
+static void check(char* seg, int p)
+{
+     char expect[100];
+     if (p % 2 || (p * 4096 >= BIG_OFFSET - 4096 && p * 4096 < BIG_OFFSET + BIG_RANGE))
+	  return; /* no string, or overwritten by the big range */
+     sprintf(expect, TEST_STRING " %d", p);
+     if (strcmp(seg + page_off(p), expect)) {
+	  printf("ERROR: page %d not recovered\n", p);
+	  exit(2);
+     }
+}
+
+
+/* proc2 maps lazily and checks that pages come in one by one */
+void proc2() 
+{
+     char* segs[1];
+     rvm_t rvm;
+     segstat_t stats;
+     trans_t trans;
+     int p;
+     
+     rvm = rvm_init("rvm_segments");
+     rvm_set_option(rvm, RVM_OPT_LAZY_RECOVERY, 1);
+     segs[0] = (char *) rvm_map(rvm, "lazyseg", SEGSIZE);
+
+     rvm_seg_stats(rvm, segs[0], &stats);
+     if (stats.pages_total != SEGSIZE / sysconf(_SC_PAGESIZE) || stats.pages_loaded != 0) {
+	  printf("ERROR: pages loaded before access\n");
+	  exit(2);
+     }
+
+     check(segs[0], 10);
+     rvm_seg_stats(rvm, segs[0], &stats);
+     if (stats.pages_loaded != 1) {
+	  printf("ERROR: expected one page loaded, got %d\n", stats.pages_loaded);
+	  exit(2);
+     }
+
+     /* replacing the log must not lose pages that are not loaded yet */
+     rvm_truncate_log(rvm);
+
+     /* a new commit on a page that was never touched */
+     trans = rvm_begin_trans(rvm, 1, (void **) segs);
+     rvm_about_to_modify(trans, segs[0], page_off(PAGES - 1), 100);
+     strcpy(segs[0] + page_off(PAGES - 1), TEST_STRING);
+     rvm_commit_trans(trans);
+
+     for (p = 0; p < PAGES; p++)
+	  check(segs[0], p);
+     for (p = 0; p < BIG_RANGE; p++) {
+	  if (segs[0][BIG_OFFSET + p] != 'z') {
+	       printf("ERROR: compressed range not recovered at %d\n", p);
+	       exit(2);
+	  }
+     }
+     if (strcmp(segs[0] + page_off(PAGES - 1), TEST_STRING)) {
+	  printf("ERROR: new commit lost\n");
+	  exit(2);
+     }
+     rvm_unmap(rvm, segs[0]);
+
+     /* eager recovery sees the same state */
+     rvm_set_option(rvm, RVM_OPT_LAZY_RECOVERY, 0);
+     segs[0] = (char *) rvm_map(rvm, "lazyseg", SEGSIZE);
+     for (p = 0; p < PAGES; p++)
+	  check(segs[0], p);
+     if (strcmp(segs[0] + page_off(PAGES - 1), TEST_STRING)) {
+	  printf("ERROR: new commit not persisted\n");
+	  exit(2);
+     }
+
+     printf("OK\n");
+     exit(0);
+}
+
+
+int main(int argc, char **argv)
+{
+     int pid;
+
+     pid = fork();
+     if(pid < 0) {
+	  perror("fork");
+	  exit(2);
+     }
+     if(pid == 0) {
+	  proc1();
+	  exit(0);
+     }
+
+     waitpid(pid, NULL, 0);
+
+     proc2();
+
+     return 0;
+}
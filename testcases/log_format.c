@@ -0,0 +1,148 @@
+/* log_format.c - test that recovery reads logs mixing the compact
+ * records written now with records in the older format, an int size
+ * and offset in front of each, with and without sequence numbers and
+ * spanning several records. Empty ranges declared in a transaction
+ * leave no record behind to break its frame */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#define SEGSIZE 10000
+#define OLD_LSN 0x20000000 /* flags of the older record header */
+#define OLD_MORE 0x10000000
+
+/* append an older format record to the log */
+static void old_record(int fd, int flags, int offset, const char* data, long long lsn)
+{
+     int header[2] = { (int) strlen(data) | flags, offset };
+     if (write(fd, header, sizeof(header)) != sizeof(header)
+	 || ((flags & OLD_LSN) && write(fd, &lsn, sizeof(lsn)) != sizeof(lsn))
+	 || write(fd, data, strlen(data)) != (ssize_t) strlen(data)) {
+	  printf("ERROR: log write failed\n");
+	  exit(2);
+     }
+}
+
+static void commit(rvm_t rvm, char** seg, int offset, const char* data)
+{
+     trans_t trans = rvm_begin_trans(rvm, 1, (void **) seg);
+     rvm_about_to_modify(trans, seg[0], offset, strlen(data));
+     memcpy(seg[0] + offset, data, strlen(data));
+     rvm_commit_trans(trans);
+}
+
+/* proc1 writes compact records around older ones and crashes */
+void proc1() 
+{
+     rvm_t rvm;
+     char* seg[1];
+     
+     rvm = rvm_init("rvm_segments");
+     rvm_destroy(rvm, "logseg");
+     seg[0] = (char *) rvm_map(rvm, "logseg", SEGSIZE);
+
+     commit(rvm, seg, 0, "compact first");
+     commit(rvm, seg, 100, "overwritten by an older record");
+
+     /* records without sequence numbers between compact ones */
+     int fd = open("rvm_segments/logseg.log", O_WRONLY | O_APPEND);
+     old_record(fd, OLD_MORE, 100, "plain record", 0);
+     old_record(fd, 0, 120, "and its end", 0);
+     close(fd);
+
+     /* a transaction with many small ranges, back and forth */
+     trans_t trans = rvm_begin_trans(rvm, 1, (void **) seg);
+     int i;
+     for (i = 0; i < 40; i++) {
+	  int offset = 5000 + (i % 2 ? 2000 - i * 8 : i * 8);
+	  rvm_about_to_modify(trans, seg[0], offset, 4);
+	  sprintf(seg[0] + offset, "%03d", i);
+     }
+     rvm_about_to_modify(trans, seg[0], 400, 3000);
+     memset(seg[0] + 400, 'x', 3000);
+     rvm_commit_trans(trans);
+
+     /* empty ranges declared first would be logged last */
+     range_t empty[2] = { { seg[0], 8100, 0 }, { seg[0], SEGSIZE, 0 } };
+     trans = rvm_begin_trans(rvm, 1, (void **) seg);
+     rvm_about_to_modify(trans, seg[0], 8000, 0);
+     rvm_about_to_modify_v(trans, empty, 2);
+     rvm_about_to_modify(trans, seg[0], 8000, 6);
+     strcpy(seg[0] + 8000, "hello");
+     rvm_commit_trans(trans);
+     commit(rvm, seg, 8010, "world");
+
+     /* sequence numbered records, past those of the compact ones */
+     fd = open("rvm_segments/logseg.log", O_WRONLY | O_APPEND);
+     old_record(fd, OLD_LSN | OLD_MORE, 200, "older transaction, ", 1000);
+     old_record(fd, OLD_LSN, 300, "second record", 1001);
+     close(fd);
+
+     abort();
+}
+
+
+/* proc2 checks every record landed */
+void proc2() 
+{
+     rvm_t rvm;
+     char* seg[1];
+     char buf[8];
+     int i;
+     
+     rvm = rvm_init("rvm_segments");
+     seg[0] = (char *) rvm_map(rvm, "logseg", SEGSIZE);
+
+     if (strncmp(seg[0], "compact first", 13) || strncmp(seg[0] + 100, "plain record", 12)
+	 || strncmp(seg[0] + 120, "and its end", 11)
+	 || strncmp(seg[0] + 200, "older transaction, ", 19)
+	 || strncmp(seg[0] + 300, "second record", 13)
+	 || strcmp(seg[0] + 8000, "hello") || strncmp(seg[0] + 8010, "world", 5)) {
+	  printf("ERROR: records not recovered\n");
+	  exit(2);
+     }
+     for (i = 0; i < 40; i++) {
+	  int offset = 5000 + (i % 2 ? 2000 - i * 8 : i * 8);
+	  sprintf(buf, "%03d", i);
+	  if (memcmp(seg[0] + offset, buf, 4)) {
+	       printf("ERROR: small range %d not recovered\n", i);
+	       exit(2);
+	  }
+     }
+     for (i = 0; i < 3000; i++) {
+	  if (seg[0][400 + i] != 'x') {
+	       printf("ERROR: large range not recovered\n");
+	       exit(2);
+	  }
+     }
+
+     printf("OK\n");
+     exit(0);
+}
+
+
+int main(int argc, char **argv)
+{
+     int pid;
+
+     pid = fork();
+     if(pid < 0) {
+	  perror("fork");
+	  exit(2);
+     }
+     if(pid == 0) {
+	  proc1();
+	  exit(0);
+     }
+
+     waitpid(pid, NULL, 0);
+
+     proc2();
+
+     return 0;
+}
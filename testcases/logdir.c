@@ -0,0 +1,91 @@
+/* logdir.c - test logs kept apart from the data files. Records go to
+ * the log directory only, and a plain rvm_init of the data directory
+ * finds them again after a crash */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+
+static void commit_str(rvm_t rvm, char** seg, int offset, const char* str)
+{
+     trans_t trans = rvm_begin_trans(rvm, 1, (void **) seg);
+     rvm_about_to_modify(trans, seg[0], offset, strlen(str) + 1);
+     strcpy(seg[0] + offset, str);
+     rvm_commit_trans(trans);
+}
+
+/* proc1 commits, truncates, commits again and crashes */
+void proc1() 
+{
+     rvm_t rvm;
+     char* seg[1];
+     struct stat st;
+     
+     rvm = rvm_init_dirs("rvm_segments", "rvm_logs");
+     rvm_destroy(rvm, "logdirseg");
+     seg[0] = (char *) rvm_map(rvm, "logdirseg", 10000);
+
+     commit_str(rvm, seg, 0, "truncated");
+     if (stat("rvm_logs/logdirseg.log", &st) != 0 || st.st_size == 0
+	 || stat("rvm_segments/logdirseg.log", &st) == 0) {
+	  printf("ERROR: log not in the log directory\n");
+	  exit(2);
+     }
+     rvm_truncate_log(rvm);
+     commit_str(rvm, seg, 5000, "in the log");
+
+     abort();
+}
+
+
+/* proc2 recovers through the recorded log directory */
+void proc2() 
+{
+     char* seg;
+     rvm_t rvm;
+     
+     rvm = rvm_init("rvm_segments");
+     seg = (char *) rvm_map(rvm, "logdirseg", 10000);
+
+     if (strcmp(seg, "truncated") || strcmp(seg + 5000, "in the log")) {
+	  printf("ERROR: segment not recovered\n");
+	  exit(2);
+     }
+
+     rvm_unmap(rvm, seg);
+     rvm_destroy(rvm, "logdirseg");
+     if (access("rvm_logs/logdirseg.log", F_OK) == 0) {
+	  printf("ERROR: log not destroyed\n");
+	  exit(2);
+     }
+
+     printf("OK\n");
+     exit(0);
+}
+
+
+int main(int argc, char **argv)
+{
+     int pid;
+
+     pid = fork();
+     if(pid < 0) {
+	  perror("fork");
+	  exit(2);
+     }
+     if(pid == 0) {
+	  proc1();
+	  exit(0);
+     }
+
+     waitpid(pid, NULL, 0);
+
+     proc2();
+
+     return 0;
+}
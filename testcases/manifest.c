@@ -0,0 +1,124 @@
+/* manifest.c - test that the directory manifest tracks segments with
+ * pending logs, ignores unrelated files and is rebuilt when missing */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#define TEST_STRING "hello, manifest"
+#define MANIFEST "rvm_segments/" MANIFEST_NAME
+
+
+/* look up the dirty flag of a segment in the manifest, -1 if absent */
+static int manifest_dirty(const char* name)
+{
+     char line[1024];
+     int size, dirty, n;
+     FILE* fp = fopen(MANIFEST, "r");
+     if (!fp)
+	  return -1;
+     while (fgets(line, sizeof(line), fp)) {
+	  line[strcspn(line, "\n")] = '\0';
+	  if (sscanf(line, "%d %d %n", &size, &dirty, &n) == 2 && !strcmp(line + n, name)) {
+	       fclose(fp);
+	       return dirty;
+	  }
+     }
+     fclose(fp);
+     return -1;
+}
+
+
+/* proc1 commits to one of two segments and crashes */
+void proc1() 
+{
+     rvm_t rvm;
+     trans_t trans;
+     char* segs[2];
+     
+     rvm = rvm_init("rvm_segments");
+     rvm_destroy(rvm, "mseg1");
+     rvm_destroy(rvm, "mseg2");
+     segs[0] = (char *) rvm_map(rvm, "mseg1", 1000);
+     segs[1] = (char *) rvm_map(rvm, "mseg2", 1000);
+
+     trans = rvm_begin_trans(rvm, 1, (void **) segs);
+     rvm_about_to_modify(trans, segs[0], 0, 100);
+     strcpy(segs[0], TEST_STRING);
+     rvm_commit_trans(trans);
+
+     abort();
+}
+
+
+/* proc2 checks the manifest, then recovers through it */
+void proc2() 
+{
+     char* segs[1];
+     rvm_t rvm;
+     FILE* fp;
+
+     if (manifest_dirty("mseg1") != 1 || manifest_dirty("mseg2") != 0) {
+	  printf("ERROR: manifest does not reflect pending logs\n");
+	  exit(2);
+     }
+
+     /* names that merely contain .log are not segments */
+     fp = fopen("rvm_segments/notes.log.bak", "w");
+     fprintf(fp, "not a log\n");
+     fclose(fp);
+     
+     rvm = rvm_init("rvm_segments");
+     segs[0] = (char *) rvm_map(rvm, "mseg1", 1000);
+     if (strcmp(segs[0], TEST_STRING)) {
+	  printf("ERROR: data not present\n");
+	  exit(2);
+     }
+     if (manifest_dirty("mseg1") != 0) {
+	  printf("ERROR: log still marked after truncation\n");
+	  exit(2);
+     }
+
+     /* a directory without a manifest is scanned once */
+     remove(MANIFEST);
+     rvm_truncate_log(rvm);
+     if (manifest_dirty("mseg1") != 0 || manifest_dirty("mseg2") != 0
+	 || manifest_dirty("notes") != -1 || manifest_dirty("notes.log.bak") != -1) {
+	  printf("ERROR: manifest not rebuilt\n");
+	  exit(2);
+     }
+
+     rvm_destroy(rvm, "mseg2");
+     if (manifest_dirty("mseg2") != -1) {
+	  printf("ERROR: destroyed segment still listed\n");
+	  exit(2);
+     }
+
+     printf("OK\n");
+     exit(0);
+}
+
+
+int main(int argc, char **argv)
+{
+     int pid;
+
+     pid = fork();
+     if(pid < 0) {
+	  perror("fork");
+	  exit(2);
+     }
+     if(pid == 0) {
+	  proc1();
+	  exit(0);
+     }
+
+     waitpid(pid, NULL, 0);
+
+     proc2();
+
+     return 0;
+}
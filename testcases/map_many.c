@@ -0,0 +1,131 @@
+/* map_many.c - test that a batch of segments is recovered and mapped
+ * by a single rvm_map_many call, and that a batch with a segment that
+ * cannot be created fails as a whole */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define NSEGS 24
+#define SEGSIZE 50000
+
+static char names[NSEGS][32];
+static const char* segnames[NSEGS];
+static int sizes[NSEGS];
+
+
+static void setup()
+{
+     int i;
+     for (i = 0; i < NSEGS; i++) {
+	  sprintf(names[i], "manyseg%d", i);
+	  segnames[i] = names[i];
+	  sizes[i] = SEGSIZE + i;
+     }
+}
+
+
+/* proc1 maps the batch, commits to every segment, then crashes */
+void proc1() 
+{
+     rvm_t rvm;
+     trans_t trans;
+     void* segs[NSEGS];
+     int i;
+     
+     rvm = rvm_init("rvm_segments");
+     for (i = 0; i < NSEGS; i++)
+	  rvm_destroy(rvm, segnames[i]);
+     if (rvm_map_many(rvm, NSEGS, segnames, sizes, segs) != 0) {
+	  printf("ERROR: batch map failed\n");
+	  exit(2);
+     }
+
+     trans = rvm_begin_trans(rvm, NSEGS, segs);
+     for (i = 0; i < NSEGS; i++) {
+	  rvm_about_to_modify(trans, segs[i], i * 100, 32);
+	  sprintf((char*) segs[i] + i * 100, "segment %d", i);
+     }
+     rvm_commit_trans(trans);
+
+     abort();
+}
+
+
+/* proc2 recovers the batch and checks every segment */
+void proc2() 
+{
+     rvm_t rvm;
+     void* segs[NSEGS];
+     char expect[32];
+     int i;
+     
+     rvm = rvm_init("rvm_segments");
+     if (rvm_map_many(rvm, NSEGS, segnames, sizes, segs) != 0) {
+	  printf("ERROR: batch map failed\n");
+	  exit(2);
+     }
+
+     for (i = 0; i < NSEGS; i++) {
+	  sprintf(expect, "segment %d", i);
+	  if (strcmp((char*) segs[i] + i * 100, expect)) {
+	       printf("ERROR: segment %d not recovered\n", i);
+	       exit(2);
+	  }
+     }
+
+     /* the batch is registered like individually mapped segments */
+     for (i = 0; i < NSEGS; i++)
+	  rvm_unmap(rvm, segs[i]);
+
+     /* a segment that cannot be opened fails the batch and stays out
+      * of the manifest */
+     const char* bad[2] = { "manyseg0", "manybad" };
+     int badsizes[2] = { SEGSIZE, SEGSIZE };
+     mkdir("rvm_segments/manybad", 0777);
+     if (rvm_map_many(rvm, 2, bad, badsizes, segs) == 0 || segs[0] || segs[1]) {
+	  printf("ERROR: batch with a bad segment mapped\n");
+	  exit(2);
+     }
+     rmdir("rvm_segments/manybad");
+     char line[256];
+     FILE* fp = fopen("rvm_segments/rvm.manifest", "r");
+     while (fp && fgets(line, sizeof(line), fp)) {
+	  if (strstr(line, "manybad")) {
+	       printf("ERROR: failed segment in the manifest: %s", line);
+	       exit(2);
+	  }
+     }
+     if (fp)
+	  fclose(fp);
+
+     printf("OK\n");
+     exit(0);
+}
+
+
+int main(int argc, char **argv)
+{
+     int pid;
+
+     setup();
+     pid = fork();
+     if(pid < 0) {
+	  perror("fork");
+	  exit(2);
+     }
+     if(pid == 0) {
+	  proc1();
+	  exit(0);
+     }
+
+     waitpid(pid, NULL, 0);
+
+     proc2();
+
+     return 0;
+}
@@ -0,0 +1,141 @@
+/* mem_checkpoint.c - test truncation that writes dirty pages from
+ * memory. One segment is checkpointed while another is inside a
+ * transaction, whose uncommitted changes must stay out of its data
+ * file. Commits after the checkpoint are recovered from the new log */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define SEGSIZE (8 * 4096 + 100)
+
+
+static void commit_str(rvm_t rvm, char** seg, int offset, const char* str)
+{
+     trans_t trans = rvm_begin_trans(rvm, 1, (void **) seg);
+     rvm_about_to_modify(trans, seg[0], offset, strlen(str) + 1);
+     strcpy(seg[0] + offset, str);
+     rvm_commit_trans(trans);
+}
+
+/* compare a string with the data file, past its size header */
+static int file_has(const char* path, int offset, const char* str)
+{
+     char buf[64];
+     int fd = open(path, O_RDONLY);
+     int n = pread(fd, buf, strlen(str) + 1, sizeof(int) + offset);
+     close(fd);
+     return n == (int) strlen(str) + 1 && strcmp(buf, str) == 0;
+}
+
+/* proc1 commits to a few pages many times, checkpoints, commits again
+ * and crashes */
+void proc1() 
+{
+     rvm_t rvm;
+     trans_t trans;
+     char* seg1[1];
+     char* seg2[1];
+     char buf[32];
+     struct stat st;
+     int i;
+     
+     rvm = rvm_init("rvm_segments");
+     rvm_set_option(rvm, RVM_OPT_MEM_CHECKPOINT, 1);
+     rvm_destroy(rvm, "ckseg1");
+     rvm_destroy(rvm, "ckseg2");
+     seg1[0] = (char *) rvm_map(rvm, "ckseg1", SEGSIZE);
+     seg2[0] = (char *) rvm_map(rvm, "ckseg2", SEGSIZE);
+
+     for (i = 0; i < 500; i++) {
+	  sprintf(buf, "first %d", i);
+	  commit_str(rvm, seg1, 0, buf);
+	  sprintf(buf, "tail %d", i);
+	  commit_str(rvm, seg1, SEGSIZE - 20, buf);
+	  sprintf(buf, "middle %d", i);
+	  commit_str(rvm, seg1, 4 * 4096 - 4, buf);
+     }
+     commit_str(rvm, seg2, 10, "committed");
+
+     /* seg2 is in a transaction while the logs are truncated */
+     trans = rvm_begin_trans(rvm, 1, (void **) seg2);
+     rvm_about_to_modify(trans, seg2[0], 10, 20);
+     strcpy(seg2[0] + 10, "uncommitted");
+     rvm_truncate_log(rvm);
+
+     stat("rvm_segments/ckseg1.log", &st);
+     if (st.st_size != 0) {
+	  printf("ERROR: log not dropped\n");
+	  exit(2);
+     }
+     if (!file_has("rvm_segments/ckseg1", 0, "first 499")
+	 || !file_has("rvm_segments/ckseg1", SEGSIZE - 20, "tail 499")
+	 || !file_has("rvm_segments/ckseg1", 4 * 4096 - 4, "middle 499")) {
+	  printf("ERROR: dirty pages not written\n");
+	  exit(2);
+     }
+     if (!file_has("rvm_segments/ckseg2", 10, "committed")) {
+	  printf("ERROR: uncommitted data reached the data file\n");
+	  exit(2);
+     }
+     rvm_abort_trans(trans);
+
+     commit_str(rvm, seg1, 2 * 4096, "after checkpoint");
+     commit_str(rvm, seg2, 100, "seg2 after");
+
+     abort();
+}
+
+
+/* proc2 checks every segment */
+void proc2() 
+{
+     char* seg1;
+     char* seg2;
+     rvm_t rvm;
+     
+     rvm = rvm_init("rvm_segments");
+     seg1 = (char *) rvm_map(rvm, "ckseg1", SEGSIZE);
+     seg2 = (char *) rvm_map(rvm, "ckseg2", SEGSIZE);
+
+     if (strcmp(seg1, "first 499") || strcmp(seg1 + SEGSIZE - 20, "tail 499")
+	 || strcmp(seg1 + 4 * 4096 - 4, "middle 499")
+	 || strcmp(seg1 + 2 * 4096, "after checkpoint")) {
+	  printf("ERROR: ckseg1 not recovered\n");
+	  exit(2);
+     }
+     if (strcmp(seg2 + 10, "committed") || strcmp(seg2 + 100, "seg2 after")) {
+	  printf("ERROR: ckseg2 not recovered\n");
+	  exit(2);
+     }
+
+     printf("OK\n");
+     exit(0);
+}
+
+
+int main(int argc, char **argv)
+{
+     int pid;
+
+     pid = fork();
+     if(pid < 0) {
+	  perror("fork");
+	  exit(2);
+     }
+     if(pid == 0) {
+	  proc1();
+	  exit(0);
+     }
+
+     waitpid(pid, NULL, 0);
+
+     proc2();
+
+     return 0;
+}
@@ -0,0 +1,136 @@
+/* modify_v.c - test declaring many ranges with rvm_about_to_modify_v,
+ * including overlapping ones, for abort and for commit */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#define SEGSIZE 10000
+#define NRANGES 300
+
+
+/* fields of 8 bytes spread over both segments, every third one
+ * overlapping its neighbour */
+static void make_ranges(char** segs, range_t* ranges)
+{
+     int i;
+     for (i = 0; i < NRANGES; i++) {
+	  ranges[i].segbase = segs[i % 2];
+	  ranges[i].offset = (i * 37) % (SEGSIZE - 16) + (i % 3 == 0 ? 4 : 0);
+	  ranges[i].size = 8;
+     }
+}
+
+static void scribble(range_t* ranges, char c)
+{
+     int i;
+     for (i = 0; i < NRANGES; i++)
+	  memset((char*) ranges[i].segbase + ranges[i].offset, c, ranges[i].size);
+}
+
+
+/* proc1 aborts one batch of changes, commits a second, then crashes */
+void proc1() 
+{
+     rvm_t rvm;
+     trans_t trans;
+     char* segs[2];
+     char* before[2];
+     range_t ranges[NRANGES];
+     range_t bad;
+     int i;
+     
+     rvm = rvm_init("rvm_segments");
+     rvm_destroy(rvm, "vseg0");
+     rvm_destroy(rvm, "vseg1");
+     segs[0] = (char *) rvm_map(rvm, "vseg0", SEGSIZE);
+     segs[1] = (char *) rvm_map(rvm, "vseg1", SEGSIZE);
+     make_ranges(segs, ranges);
+
+     for (i = 0; i < 2; i++) {
+	  before[i] = malloc(SEGSIZE);
+	  memcpy(before[i], segs[i], SEGSIZE);
+     }
+
+     trans = rvm_begin_trans(rvm, 2, (void **) segs);
+     bad.segbase = segs[0];
+     bad.offset = SEGSIZE - 4;
+     bad.size = 8;
+     if (rvm_about_to_modify_v(trans, &bad, 1) != -1) {
+	  printf("ERROR: range past the segment end accepted\n");
+	  exit(2);
+     }
+     rvm_about_to_modify_v(trans, ranges, NRANGES);
+     scribble(ranges, 'x');
+     rvm_abort_trans(trans);
+     for (i = 0; i < 2; i++) {
+	  if (memcmp(before[i], segs[i], SEGSIZE)) {
+	       printf("ERROR: abort did not restore segment %d\n", i);
+	       exit(2);
+	  }
+     }
+
+     trans = rvm_begin_trans(rvm, 2, (void **) segs);
+     rvm_about_to_modify_v(trans, ranges, NRANGES);
+     scribble(ranges, 'y');
+     rvm_commit_trans(trans);
+
+     abort();
+}
+
+
+/* proc2 checks that exactly the declared ranges were committed */
+void proc2() 
+{
+     char* segs[2];
+     char* expect[2];
+     range_t ranges[NRANGES];
+     rvm_t rvm;
+     int i;
+     
+     rvm = rvm_init("rvm_segments");
+     segs[0] = (char *) rvm_map(rvm, "vseg0", SEGSIZE);
+     segs[1] = (char *) rvm_map(rvm, "vseg1", SEGSIZE);
+
+     for (i = 0; i < 2; i++) {
+	  expect[i] = malloc(SEGSIZE);
+	  memset(expect[i], '0', SEGSIZE);
+     }
+     make_ranges(expect, ranges);
+     scribble(ranges, 'y');
+
+     for (i = 0; i < 2; i++) {
+	  if (memcmp(expect[i], segs[i], SEGSIZE)) {
+	       printf("ERROR: segment %d does not match\n", i);
+	       exit(2);
+	  }
+     }
+
+     printf("OK\n");
+     exit(0);
+}
+
+
+int main(int argc, char **argv)
+{
+     int pid;
+
+     pid = fork();
+     if(pid < 0) {
+	  perror("fork");
+	  exit(2);
+     }
+     if(pid == 0) {
+	  proc1();
+	  exit(0);
+     }
+
+     waitpid(pid, NULL, 0);
+
+     proc2();
+
+     return 0;
+}
@@ -0,0 +1,86 @@
+/* redo_only.c - test that redo-only transactions persist their changes
+ * and refuse to abort */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#define TEST_STRING "hello, redo"
+#define TEST_STRING2 "no way back"
+#define OFFSET2 1000
+
+
+/* proc1 writes data in a redo-only transaction, commits it, then exits */
+void proc1() 
+{
+     rvm_t rvm;
+     trans_t trans;
+     char* segs[1];
+     
+     rvm = rvm_init("rvm_segments");
+     rvm_destroy(rvm, "redoseg");
+     segs[0] = (char *) rvm_map(rvm, "redoseg", 10000);
+
+     trans = rvm_begin_trans_flags(rvm, 1, (void **) segs, RVM_TRANS_NOUNDO);
+     rvm_about_to_modify(trans, segs[0], 0, 100);
+     sprintf(segs[0], TEST_STRING);
+     rvm_about_to_modify(trans, segs[0], OFFSET2, 100);
+     sprintf(segs[0]+OFFSET2, TEST_STRING2);
+
+     /* abort is refused and the transaction stays usable */
+     if (rvm_abort_trans(trans) != -1) {
+	  printf("ERROR: redo-only transaction aborted\n");
+	  exit(2);
+     }
+     rvm_commit_trans(trans);
+
+     abort();
+}
+
+
+/* proc2 opens the segment and reads from it */
+void proc2() 
+{
+     char* segs[1];
+     rvm_t rvm;
+     
+     rvm = rvm_init("rvm_segments");
+
+     segs[0] = (char *) rvm_map(rvm, "redoseg", 10000);
+     if(strcmp(segs[0], TEST_STRING)) {
+	  printf("ERROR: first string not present\n");
+	  exit(2);
+     }
+     if(strcmp(segs[0]+OFFSET2, TEST_STRING2)) {
+	  printf("ERROR: second string not present\n");
+	  exit(2);
+     }
+
+     printf("OK\n");
+     exit(0);
+}
+
+
+int main(int argc, char **argv)
+{
+     int pid;
+
+     pid = fork();
+     if(pid < 0) {
+	  perror("fork");
+	  exit(2);
+     }
+     if(pid == 0) {
+	  proc1();
+	  exit(0);
+     }
+
+     waitpid(pid, NULL, 0);
+
+     proc2();
+
+     return 0;
+}
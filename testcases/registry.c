@@ -0,0 +1,103 @@
+/* registry.c - test that many rvm instances can be opened and closed,
+ * that slots are reused and that closed handles are rejected */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NINST 250
+#define TEST_STRING "hello, tenant"
+
+
+int main(int argc, char **argv)
+{
+     static rvm_t rvms[NINST];
+     char* segs[1];
+     trans_t trans;
+     int i;
+
+     /* more instances than the old fixed table could hold, all live */
+     for (i = 0; i < NINST; i++) {
+	  rvms[i] = rvm_init("rvm_segments");
+	  segs[0] = (char *) rvm_map(rvms[i], "tenantseg", 100);
+	  if (!segs[0]) {
+	       printf("ERROR: map failed for instance %d\n", i);
+	       exit(2);
+	  }
+     }
+
+     /* closing releases the slot for reuse */
+     int rid = rvms[NINST / 2].rid;
+     if (rvm_close(rvms[NINST / 2]) != 0) {
+	  printf("ERROR: close failed\n");
+	  exit(2);
+     }
+     rvm_t reused = rvm_init("rvm_segments");
+     if (reused.rid != rid) {
+	  printf("ERROR: slot not reused\n");
+	  exit(2);
+     }
+
+     /* the stale handle must not reach the new instance */
+     if (rvm_map(rvms[NINST / 2], "tenantseg", 100) != NULL) {
+	  printf("ERROR: closed handle accepted\n");
+	  exit(2);
+     }
+     if (rvm_close(rvms[NINST / 2]) == 0) {
+	  printf("ERROR: double close accepted\n");
+	  exit(2);
+     }
+
+     /* an instance with an open transaction cannot be closed */
+     segs[0] = (char *) rvm_map(reused, "tenantseg", 100);
+     trans = rvm_begin_trans(reused, 1, (void **) segs);
+     rvm_about_to_modify(trans, segs[0], 0, 50);
+     strcpy(segs[0], TEST_STRING);
+     if (rvm_close(reused) == 0) {
+	  printf("ERROR: closed with open transaction\n");
+	  exit(2);
+     }
+     rvm_commit_trans(trans);
+
+     /* a begin that fails releases the segments it already claimed */
+     char* pair[2];
+     pair[0] = (char *) rvm_map(reused, "tenantseg2", 100);
+     pair[1] = segs[0];
+     trans = rvm_begin_trans(reused, 1, (void **) segs);
+     if (rvm_begin_trans(reused, 2, (void **) pair) != (trans_t) -1) {
+	  printf("ERROR: segment in use accepted\n");
+	  exit(2);
+     }
+     rvm_abort_trans(trans);
+     trans = rvm_begin_trans(reused, 1, (void **) pair);
+     if (trans == (trans_t) -1) {
+	  printf("ERROR: failed begin kept its segments\n");
+	  exit(2);
+     }
+     rvm_commit_trans(trans);
+     rvm_unmap(reused, pair[0]);
+     rvm_destroy(reused, "tenantseg2");
+
+     if (rvm_close(reused) != 0) {
+	  printf("ERROR: close after commit failed\n");
+	  exit(2);
+     }
+
+     for (i = 0; i < NINST; i++)
+	  if (i != NINST / 2)
+	       rvm_close(rvms[i]);
+
+     /* the committed data is visible to a fresh instance */
+     rvm_t rvm = rvm_init("rvm_segments");
+     segs[0] = (char *) rvm_map(rvm, "tenantseg", 100);
+     if (strcmp(segs[0], TEST_STRING)) {
+	  printf("ERROR: data not present\n");
+	  exit(2);
+     }
+     rvm_close(rvm);
+
+     printf("OK\n");
+     return 0;
+}
@@ -0,0 +1,197 @@
+/* resize.c - test growing mapped segments in place. One grows into
+ * address space reserved when it was mapped, another by extending its
+ * mapping if the addresses after it are free. The base stays put, and
+ * data written before and after the growth is recovered after a crash.
+ * A growth that fails, in memory, in the data file or on the standby,
+ * leaves the segment and its reservation as they were. Data past the
+ * mapped length of a segment mapped smaller than its file survives */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define SMALL 5000
+#define LARGE (40 * 4096 + 123)
+#define RESERVE (1024 * 1024)
+
+static void put(rvm_t rvm, char** seg, int offset, const char* data)
+{
+     trans_t trans = rvm_begin_trans(rvm, 1, (void **) seg);
+     rvm_about_to_modify(trans, seg[0], offset, strlen(data) + 1);
+     strcpy(seg[0] + offset, data);
+     rvm_commit_trans(trans);
+}
+
+/* whether a write at p faults, tried in a child */
+static int faults(char* p)
+{
+     int pid = fork(), status;
+     if (pid == 0) {
+	  *p = 1;
+	  _exit(0);
+     }
+     waitpid(pid, &status, 0);
+     return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+/* proc1 grows both segments while writing to them and crashes */
+void proc1() 
+{
+     rvm_t rvm;
+     char* seg[1];
+     char* other[1];
+     segstat_t st;
+     int i;
+     
+     rvm = rvm_init("rvm_segments");
+     rvm_destroy(rvm, "reserved");
+     rvm_destroy(rvm, "plain");
+     rvm_set_option(rvm, RVM_OPT_RESERVE, RESERVE);
+     seg[0] = (char *) rvm_map(rvm, "reserved", SMALL);
+     rvm_set_option(rvm, RVM_OPT_RESERVE, 0);
+     other[0] = (char *) rvm_map(rvm, "plain", SMALL);
+
+     put(rvm, seg, 10, "before growth");
+     char* base = seg[0];
+     if (rvm_resize(rvm, seg[0], LARGE) != 0 || seg[0] != base) {
+	  printf("ERROR: resize within the reservation failed\n");
+	  exit(2);
+     }
+     rvm_seg_stats(rvm, seg[0], &st);
+     if (st.length != LARGE) {
+	  printf("ERROR: stats show %d bytes\n", st.length);
+	  exit(2);
+     }
+     for (i = SMALL; i < LARGE; i++) {
+	  if (seg[0][i] != '0') {
+	       printf("ERROR: grown part not filled\n");
+	       exit(2);
+	  }
+     }
+     put(rvm, seg, LARGE - 20, "at the end");
+     put(rvm, seg, SMALL - 4, "across the old end");
+
+     /* a transaction open across the growth */
+     trans_t trans = rvm_begin_trans(rvm, 1, (void **) other);
+     rvm_about_to_modify(trans, other[0], 0, 10);
+     strcpy(other[0], "aborted");
+     if (rvm_resize(rvm, other[0], RESERVE * 2) == 0) {
+	  rvm_about_to_modify(trans, other[0], RESERVE * 2 - 100, 10);
+	  strcpy(other[0] + RESERVE * 2 - 100, "aborted");
+	  rvm_abort_trans(trans);
+	  if (other[0][0] != '0' || other[0][RESERVE * 2 - 100] != '0') {
+	       printf("ERROR: abort across growth\n");
+	       exit(2);
+	  }
+	  put(rvm, other, RESERVE * 2 - 100, "grown by mremap");
+     } else {
+	  /* the addresses after the mapping were taken */
+	  rvm_abort_trans(trans);
+	  put(rvm, other, 0, "not grown");
+     }
+
+     if (rvm_resize(rvm, seg[0], SMALL) != 0 || rvm_resize(rvm, seg[0], 3 * RESERVE) == 0
+	 || seg[0] != base) {
+	  printf("ERROR: shrink or growth past the reservation accepted\n");
+	  exit(2);
+     }
+
+     /* a data file that cannot grow, held at its size by the limit */
+     struct rlimit lim, old;
+     getrlimit(RLIMIT_FSIZE, &old);
+     lim = old;
+     lim.rlim_cur = sizeof(int) + LARGE;
+     signal(SIGXFSZ, SIG_IGN);
+     setrlimit(RLIMIT_FSIZE, &lim);
+     int failed = rvm_resize(rvm, seg[0], LARGE + 8192);
+     setrlimit(RLIMIT_FSIZE, &old);
+     rvm_seg_stats(rvm, seg[0], &st);
+     if (failed == 0 || st.length != LARGE) {
+	  printf("ERROR: growth of the data file failed unnoticed\n");
+	  exit(2);
+     }
+     if (!faults(seg[0] + LARGE + 8192) || !faults(seg[0] + RESERVE - 10)) {
+	  printf("ERROR: reservation writable after a failed growth\n");
+	  exit(2);
+     }
+
+     /* mapped smaller than its file, the rest of the file is kept */
+     char* part[1];
+     rvm_destroy(rvm, "partial");
+     part[0] = (char *) rvm_map(rvm, "partial", 8192);
+     put(rvm, part, 6000, "data");
+     rvm_unmap(rvm, part[0]);
+     part[0] = (char *) rvm_map(rvm, "partial", 4096);
+     if (rvm_resize(rvm, part[0], 8192) != 0 || strcmp(part[0] + 6000, "data")) {
+	  printf("ERROR: growth overwrote data of the file\n");
+	  exit(2);
+     }
+
+     /* a standby segment that cannot grow fails the growth */
+     rvm_set_standby(rvm, "rvm_resize_standby");
+     remove("rvm_resize_standby/partial");
+     mkdir("rvm_resize_standby/partial", 0777);
+     failed = rvm_resize(rvm, part[0], 3 * 8192);
+     rvm_seg_stats(rvm, part[0], &st);
+     if (failed == 0 || st.length != 8192) {
+	  printf("ERROR: growth of the standby failed unnoticed\n");
+	  exit(2);
+     }
+     rmdir("rvm_resize_standby/partial");
+
+     abort();
+}
+
+
+/* proc2 finds the grown data */
+void proc2() 
+{
+     rvm_t rvm;
+     char* seg[1];
+     char* other[1];
+     
+     rvm = rvm_init("rvm_segments");
+     seg[0] = (char *) rvm_map(rvm, "reserved", LARGE);
+     other[0] = (char *) rvm_map(rvm, "plain", RESERVE * 2);
+     if (strcmp(seg[0] + 10, "before growth")
+	 || strcmp(seg[0] + LARGE - 20, "at the end")
+	 || strcmp(seg[0] + SMALL - 4, "across the old end")) {
+	  printf("ERROR: grown segment not recovered\n");
+	  exit(2);
+     }
+     if (strcmp(other[0], "not grown") && strcmp(other[0] + RESERVE * 2 - 100, "grown by mremap")) {
+	  printf("ERROR: extended segment not recovered\n");
+	  exit(2);
+     }
+
+     printf("OK\n");
+     exit(0);
+}
+
+
+int main(int argc, char **argv)
+{
+     int pid;
+
+     pid = fork();
+     if(pid < 0) {
+	  perror("fork");
+	  exit(2);
+     }
+     if(pid == 0) {
+	  proc1();
+	  exit(0);
+     }
+
+     waitpid(pid, NULL, 0);
+
+     proc2();
+
+     return 0;
+}
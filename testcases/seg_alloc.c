@@ -0,0 +1,151 @@
+/* seg_alloc.c - test the allocator inside a segment. Blocks of every
+ * size class and large blocks are allocated and freed, an aborted
+ * transaction gives back what it allocated, and the heap with its
+ * free lists is recovered after a crash */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#define SEGSIZE (128 * 4096)
+#define NBLOCKS 200
+
+/* the root block: offsets of the blocks and their sizes */
+typedef struct {
+     int offsets[NBLOCKS]; /* negated once freed */
+     int sizes[NBLOCKS];
+     int aborted; /* offset an aborted transaction got */
+} root_t;
+
+
+static int size_of(int i)
+{
+     return i % 10 == 9 ? 5000 + i : 1 + (i * 37) % 2048;
+}
+
+/* proc1 builds a heap, frees every third block and crashes */
+void proc1() 
+{
+     rvm_t rvm;
+     trans_t trans;
+     char* seg[1];
+     int i;
+     
+     rvm = rvm_init("rvm_segments");
+     rvm_destroy(rvm, "heapseg");
+     seg[0] = (char *) rvm_map(rvm, "heapseg", SEGSIZE);
+
+     trans = rvm_begin_trans(rvm, 1, (void **) seg);
+     int r = rvm_seg_alloc(trans, seg[0], sizeof(root_t));
+     root_t* root = (root_t*) (seg[0] + r);
+     rvm_about_to_modify(trans, seg[0], r, sizeof(root_t));
+     rvm_seg_set_root(trans, seg[0], r);
+     for (i = 0; i < NBLOCKS; i++) {
+	  int off = rvm_seg_alloc(trans, seg[0], size_of(i));
+	  if (off < 0 || off % 8) {
+	       printf("ERROR: allocation %d failed\n", i);
+	       exit(2);
+	  }
+	  rvm_about_to_modify(trans, seg[0], off, size_of(i));
+	  memset(seg[0] + off, i, size_of(i));
+	  root->offsets[i] = off;
+	  root->sizes[i] = size_of(i);
+     }
+     rvm_commit_trans(trans);
+
+     /* an aborted allocation leaves the heap as it was */
+     trans = rvm_begin_trans(rvm, 1, (void **) seg);
+     int lost = rvm_seg_alloc(trans, seg[0], 100);
+     rvm_abort_trans(trans);
+     trans = rvm_begin_trans(rvm, 1, (void **) seg);
+     rvm_about_to_modify(trans, seg[0], rvm_seg_root(seg[0]), sizeof(root_t));
+     root->aborted = rvm_seg_alloc(trans, seg[0], 100);
+     if (root->aborted != lost) {
+	  printf("ERROR: aborted allocation kept\n");
+	  exit(2);
+     }
+     rvm_commit_trans(trans);
+
+     trans = rvm_begin_trans(rvm, 1, (void **) seg);
+     rvm_about_to_modify(trans, seg[0], rvm_seg_root(seg[0]), sizeof(root_t));
+     for (i = 0; i < NBLOCKS; i += 3) {
+	  rvm_seg_free(trans, seg[0], root->offsets[i]);
+	  root->offsets[i] = -root->offsets[i];
+     }
+     if (rvm_seg_free(trans, seg[0], root->offsets[1] + 8) == 0) {
+	  printf("ERROR: free of a bad offset accepted\n");
+	  exit(2);
+     }
+     if (rvm_seg_alloc(trans, seg[0], SEGSIZE) >= 0) {
+	  printf("ERROR: allocation beyond the segment accepted\n");
+	  exit(2);
+     }
+     rvm_commit_trans(trans);
+
+     abort();
+}
+
+
+/* proc2 checks the blocks and reuses the freed ones */
+void proc2() 
+{
+     rvm_t rvm;
+     trans_t trans;
+     char* seg[1];
+     int i, j;
+     
+     rvm = rvm_init("rvm_segments");
+     seg[0] = (char *) rvm_map(rvm, "heapseg", SEGSIZE);
+     root_t* root = (root_t*) (seg[0] + rvm_seg_root(seg[0]));
+
+     for (i = 0; i < NBLOCKS; i++) {
+	  if (root->offsets[i] < 0)
+	       continue;
+	  for (j = 0; j < root->sizes[i]; j++) {
+	       if (seg[0][root->offsets[i] + j] != (char) i) {
+		    printf("ERROR: block %d not recovered\n", i);
+		    exit(2);
+	       }
+	  }
+     }
+
+     /* freed blocks are handed out again before the heap grows */
+     trans = rvm_begin_trans(rvm, 1, (void **) seg);
+     int off = rvm_seg_alloc(trans, seg[0], size_of(0));
+     rvm_commit_trans(trans);
+     int found = 0;
+     for (i = 0; i < NBLOCKS; i++)
+	  found |= off == -root->offsets[i];
+     if (!found) {
+	  printf("ERROR: freed block not reused\n");
+	  exit(2);
+     }
+
+     printf("OK\n");
+     exit(0);
+}
+
+
+int main(int argc, char **argv)
+{
+     int pid;
+
+     pid = fork();
+     if(pid < 0) {
+	  perror("fork");
+	  exit(2);
+     }
+     if(pid == 0) {
+	  proc1();
+	  exit(0);
+     }
+
+     waitpid(pid, NULL, 0);
+
+     proc2();
+
+     return 0;
+}
@@ -0,0 +1,137 @@
+/* shared.c - test segments shared between processes. Worker processes
+ * increment a common counter in their own transactions and see each
+ * other's commits without remapping. A worker that dies inside a
+ * transaction leaves the lock to the next process, which finds the
+ * committed state restored */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#define SEGSIZE 10000
+#define NWORKERS 4
+#define NTRANS 300
+
+static char* map_shared_seg(rvm_t* rvm)
+{
+     *rvm = rvm_init("rvm_segments");
+     rvm_set_option(*rvm, RVM_OPT_SHARED, 1);
+     return (char *) rvm_map(*rvm, "shseg", SEGSIZE);
+}
+
+static void increment(rvm_t rvm, char** segs, int slot)
+{
+     trans_t trans = rvm_begin_trans(rvm, 1, (void **) segs);
+     rvm_about_to_modify(trans, segs[0], 0, sizeof(int));
+     rvm_about_to_modify(trans, segs[0], 64 + slot * sizeof(int), sizeof(int));
+     (*(int*) segs[0])++;
+     ((int*) (segs[0] + 64))[slot]++;
+     rvm_commit_trans(trans);
+}
+
+static void worker(int slot)
+{
+     rvm_t rvm;
+     char* segs[1];
+     int i;
+
+     segs[0] = map_shared_seg(&rvm);
+     for (i = 0; i < NTRANS; i++)
+	  increment(rvm, segs, slot);
+     rvm_unmap(rvm, segs[0]);
+     exit(0);
+}
+
+/* dies with the segment locked and a half-done change in memory */
+static void crasher()
+{
+     rvm_t rvm;
+     char* segs[1];
+
+     segs[0] = map_shared_seg(&rvm);
+     trans_t trans = rvm_begin_trans(rvm, 1, (void **) segs);
+     rvm_about_to_modify(trans, segs[0], 0, sizeof(int));
+     *(int*) segs[0] = -1;
+     abort();
+}
+
+/* slot 0 also counts the increments made after the workers */
+static void check(const char* what, char* seg, int extra)
+{
+     int i;
+     if (*(int*) seg != NWORKERS * NTRANS + extra) {
+	  printf("ERROR: %s: counter is %d\n", what, *(int*) seg);
+	  exit(2);
+     }
+     for (i = 0; i < NWORKERS; i++) {
+	  if (((int*) (seg + 64))[i] != NTRANS + (i == 0 ? extra : 0)) {
+	       printf("ERROR: %s: worker %d count is %d\n", what, i, ((int*) (seg + 64))[i]);
+	       exit(2);
+	  }
+     }
+}
+
+int main(int argc, char **argv)
+{
+     rvm_t rvm;
+     char* segs[1];
+     segstat_t stats;
+     int i, pid;
+
+     rvm = rvm_init("rvm_segments");
+     rvm_destroy(rvm, "shseg");
+     rvm_close(rvm);
+
+     segs[0] = map_shared_seg(&rvm);
+     trans_t trans = rvm_begin_trans(rvm, 1, (void **) segs);
+     rvm_about_to_modify(trans, segs[0], 0, 64 + NWORKERS * sizeof(int));
+     memset(segs[0], 0, 64 + NWORKERS * sizeof(int));
+     rvm_commit_trans(trans);
+     rvm_seg_stats(rvm, segs[0], &stats);
+     if (stats.alloc_mode != RVM_ALLOC_SHARED) {
+	  printf("ERROR: segment is not shared\n");
+	  exit(2);
+     }
+
+     for (i = 0; i < NWORKERS; i++) {
+	  pid = fork();
+	  if (pid < 0) {
+	       perror("fork");
+	       exit(2);
+	  }
+	  if (pid == 0)
+	       worker(i);
+     }
+     while (wait(NULL) > 0)
+	  ;
+     /* the commits of the workers show up in this mapping */
+     check("after workers", segs[0], 0);
+
+     pid = fork();
+     if (pid == 0)
+	  crasher();
+     waitpid(pid, NULL, 0);
+
+     /* taking the lock restores the committed state */
+     increment(rvm, segs, 0);
+     check("after crash", segs[0], 1);
+
+     /* with every process gone a new one reloads from the files */
+     rvm_unmap(rvm, segs[0]);
+     rvm_close(rvm);
+     pid = fork();
+     if (pid == 0) {
+	  segs[0] = map_shared_seg(&rvm);
+	  check("reloaded", segs[0], 1);
+	  exit(0);
+     }
+     waitpid(pid, &i, 0);
+     if (!WIFEXITED(i) || WEXITSTATUS(i) != 0)
+	  exit(2);
+
+     printf("OK\n");
+     return 0;
+}
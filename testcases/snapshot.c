@@ -0,0 +1,144 @@
+/* snapshot.c - test read snapshots. A snapshot taken in the middle of
+ * a transaction sees the last committed state, and keeps seeing it
+ * while later transactions commit and abort. A reader thread then
+ * checks an invariant kept by every transaction of a running writer */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define SEGSIZE (16 * 4096)
+#define A_OFF (9 * 4096 + 100)
+#define B_OFF (3 * 4096 + 8)
+#define TOTAL 1000000
+#define NTRANS 20000
+
+static rvm_t rvm;
+static char* segs[1];
+static volatile int writer_done = 0;
+
+static int read_int(snapshot_t snap, int offset)
+{
+     int v;
+     if (rvm_snapshot_read(snap, segs[0], offset, &v, sizeof(int)) != 0) {
+	  printf("ERROR: snapshot read failed\n");
+	  exit(2);
+     }
+     return v;
+}
+
+/* take snapshots while the writer moves amounts from a to b */
+static void* reader(void* arg)
+{
+     while (!writer_done) {
+	  snapshot_t snap = rvm_begin_read_snapshot(rvm, 1, (void **) segs);
+	  int a = read_int(snap, A_OFF);
+	  sched_yield();
+	  int b = read_int(snap, B_OFF);
+	  if (a + b != TOTAL || read_int(snap, A_OFF) != a) {
+	       printf("ERROR: inconsistent snapshot a=%d b=%d\n", a, b);
+	       exit(2);
+	  }
+	  rvm_end_read_snapshot(snap);
+     }
+     return NULL;
+}
+
+static void transfer(int amount, int commit)
+{
+     trans_t trans = rvm_begin_trans(rvm, 1, (void **) segs);
+     rvm_about_to_modify(trans, segs[0], A_OFF, sizeof(int));
+     *(int*) (segs[0] + A_OFF) -= amount;
+     rvm_about_to_modify(trans, segs[0], B_OFF, sizeof(int));
+     *(int*) (segs[0] + B_OFF) += amount;
+     if (commit)
+	  rvm_commit_trans(trans);
+     else
+	  rvm_abort_trans(trans);
+}
+
+int main(int argc, char **argv)
+{
+     trans_t trans;
+     char* before;
+     char* buf;
+     pthread_t thread;
+     int i;
+
+     rvm = rvm_init("rvm_segments");
+     rvm_destroy(rvm, "snapseg");
+     segs[0] = (char *) rvm_map(rvm, "snapseg", SEGSIZE);
+
+     trans = rvm_begin_trans(rvm, 1, (void **) segs);
+     rvm_about_to_modify(trans, segs[0], 0, SEGSIZE);
+     for (i = 0; i < SEGSIZE; i++)
+	  segs[0][i] = i % 251;
+     *(int*) (segs[0] + A_OFF) = TOTAL;
+     *(int*) (segs[0] + B_OFF) = 0;
+     rvm_commit_trans(trans);
+     before = malloc(SEGSIZE);
+     buf = malloc(SEGSIZE);
+     memcpy(before, segs[0], SEGSIZE);
+
+     /* begin a snapshot halfway through a transaction, then keep
+      * changing the same page and others */
+     trans = rvm_begin_trans(rvm, 1, (void **) segs);
+     rvm_about_to_modify(trans, segs[0], 10, 20);
+     memset(segs[0] + 10, 'x', 20);
+     rvm_about_to_modify(trans, segs[0], 20, 20);
+     memset(segs[0] + 20, 'y', 20);
+     snapshot_t snap = rvm_begin_read_snapshot(rvm, 1, (void **) segs);
+     rvm_about_to_modify(trans, segs[0], 30, 4000);
+     memset(segs[0] + 30, 'z', 4000);
+     rvm_commit_trans(trans);
+
+     trans = rvm_begin_trans(rvm, 1, (void **) segs);
+     rvm_about_to_modify(trans, segs[0], 5 * 4096, 3 * 4096);
+     memset(segs[0] + 5 * 4096, 'w', 3 * 4096);
+     rvm_abort_trans(trans);
+     transfer(7, 1);
+
+     if (rvm_snapshot_read(snap, segs[0], 0, buf, SEGSIZE) != 0
+	 || memcmp(buf, before, SEGSIZE) != 0) {
+	  printf("ERROR: snapshot changed\n");
+	  exit(2);
+     }
+     if (rvm_snapshot_read(snap, segs[0], SEGSIZE - 4, buf, 8) != -1) {
+	  printf("ERROR: read past the segment end accepted\n");
+	  exit(2);
+     }
+     rvm_unmap(rvm, segs[0]); /* refused while the snapshot is open */
+     rvm_end_read_snapshot(snap);
+
+     /* a new snapshot sees the committed changes */
+     snap = rvm_begin_read_snapshot(rvm, 1, (void **) segs);
+     if (read_int(snap, A_OFF) != TOTAL - 7 || rvm_snapshot_read(snap, segs[0], 40, buf, 1) != 0
+	 || buf[0] != 'z') {
+	  printf("ERROR: new snapshot does not see commits\n");
+	  exit(2);
+     }
+     rvm_end_read_snapshot(snap);
+
+     /* redo-only transactions have no pre-images to build a snapshot from */
+     trans = rvm_begin_trans_flags(rvm, 1, (void **) segs, RVM_TRANS_NOUNDO);
+     rvm_about_to_modify(trans, segs[0], 0, 4);
+     if (rvm_begin_read_snapshot(rvm, 1, (void **) segs) != NULL) {
+	  printf("ERROR: snapshot of an open redo-only transaction\n");
+	  exit(2);
+     }
+     rvm_commit_trans(trans);
+
+     pthread_create(&thread, NULL, reader, NULL);
+     for (i = 0; i < NTRANS; i++)
+	  transfer(i % 13 + 1, i % 5 != 0);
+     writer_done = 1;
+     pthread_join(thread, NULL);
+
+     rvm_unmap(rvm, segs[0]);
+     rvm_close(rvm);
+     printf("OK\n");
+     return 0;
+}
@@ -0,0 +1,137 @@
+/* sparse.c - test sparse segments. A large segment takes next to no
+ * disk, reads as zero where never written, and zeroed pages are punched
+ * out again by log replay and by checkpoints from memory. The data is
+ * recovered after a crash */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define SEGSIZE (64 * 1024 * 1024)
+#define FAR (SEGSIZE / 2)
+#define PATH "rvm_segments/sparseseg"
+
+
+static long disk_bytes()
+{
+     struct stat st;
+     stat(PATH, &st);
+     return (long) st.st_blocks * 512;
+}
+
+static void commit_fill(rvm_t rvm, char** seg, int offset, int c, int size)
+{
+     trans_t trans = rvm_begin_trans(rvm, 1, (void **) seg);
+     rvm_about_to_modify(trans, seg[0], offset, size);
+     memset(seg[0] + offset, c, size);
+     rvm_commit_trans(trans);
+}
+
+static void check_fill(char* seg, int offset, int c, int size, const char* what)
+{
+     int i;
+     for (i = 0; i < size; i++) {
+	  if (seg[offset + i] != (char) c) {
+	       printf("ERROR: %s at %d\n", what, offset + i);
+	       exit(2);
+	  }
+     }
+}
+
+/* proc1 writes two far apart pages, checkpoints, zeroes one of them
+ * again and crashes with a committed update in the log */
+void proc1()
+{
+     rvm_t rvm;
+     char* seg[1];
+
+     rvm = rvm_init("rvm_segments");
+     rvm_set_option(rvm, RVM_OPT_SPARSE, 1);
+     rvm_destroy(rvm, "sparseseg");
+     seg[0] = (char *) rvm_map(rvm, "sparseseg", SEGSIZE);
+     if (disk_bytes() > 64 * 1024) {
+	  printf("ERROR: new segment takes %ld bytes\n", disk_bytes());
+	  exit(2);
+     }
+     check_fill(seg[0], 0, 0, 4096, "new segment not zero");
+     check_fill(seg[0], SEGSIZE - 4096, 0, 4096, "new segment not zero");
+
+     commit_fill(rvm, seg, 0, 'a', 3 * 4096);
+     commit_fill(rvm, seg, FAR, 'b', 8 * 4096);
+     rvm_truncate_log(rvm);
+     long full = disk_bytes();
+     if (full < 11 * 4096 || full > 1024 * 1024) {
+	  printf("ERROR: checkpoint left %ld bytes\n", full);
+	  exit(2);
+     }
+
+     /* replaying the log punches the zeroed pages out */
+     commit_fill(rvm, seg, FAR, 0, 8 * 4096);
+     rvm_truncate_log(rvm);
+     if (disk_bytes() > full - 8 * 4096) {
+	  printf("ERROR: zero pages kept, %ld bytes\n", disk_bytes());
+	  exit(2);
+     }
+
+     commit_fill(rvm, seg, 4096, 'c', 100);
+     abort();
+}
+
+
+/* proc2 recovers the data, then checkpoints from memory */
+void proc2()
+{
+     rvm_t rvm;
+     char* seg[1];
+
+     rvm = rvm_init("rvm_segments");
+     rvm_set_option(rvm, RVM_OPT_MEM_CHECKPOINT, 1);
+     seg[0] = (char *) rvm_map(rvm, "sparseseg", SEGSIZE);
+     check_fill(seg[0], 0, 'a', 4096, "first page not recovered");
+     check_fill(seg[0], 4096, 'c', 100, "last commit not recovered");
+     check_fill(seg[0], 4096 + 100, 'a', 2 * 4096 - 100, "data not recovered");
+     check_fill(seg[0], FAR, 0, 8 * 4096, "zeroed pages not recovered");
+     check_fill(seg[0], SEGSIZE - 4096, 0, 4096, "hole not zero");
+
+     /* a checkpoint from memory punches zero pages as well */
+     rvm_truncate_log(rvm);
+     long before = disk_bytes();
+     commit_fill(rvm, seg, 0, 0, 3 * 4096);
+     rvm_truncate_log(rvm);
+     if (disk_bytes() > before - 3 * 4096) {
+	  printf("ERROR: checkpoint kept zero pages, %ld bytes\n", disk_bytes());
+	  exit(2);
+     }
+     rvm_unmap(rvm, seg[0]);
+     seg[0] = (char *) rvm_map(rvm, "sparseseg", SEGSIZE);
+     check_fill(seg[0], 0, 0, 3 * 4096, "punched pages not zero");
+
+     printf("OK\n");
+     exit(0);
+}
+
+
+int main(int argc, char **argv)
+{
+     int pid;
+
+     pid = fork();
+     if(pid < 0) {
+	  perror("fork");
+	  exit(2);
+     }
+     if(pid == 0) {
+	  proc1();
+	  exit(0);
+     }
+
+     waitpid(pid, NULL, 0);
+
+     proc2();
+
+     return 0;
+}
@@ -0,0 +1,170 @@
+/* standby.c - test log shipping. A primary ships its commits to a
+ * standby directory, which applies them while the primary runs: first
+ * through an instance of its own, then through the standby applier of
+ * the primary, including an async commit to two segments. After the
+ * primary crashes the standby maps up to date segments, with nothing
+ * left to replay */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define SEGSIZE 100000
+#define NTRANS 50
+
+
+static void commit_slot(rvm_t rvm, char** segs, int i, int async)
+{
+     trans_t trans = rvm_begin_trans(rvm, 1, (void **) segs);
+     rvm_about_to_modify(trans, segs[0], 1000 + i * 16, 16);
+     sprintf(segs[0] + 1000 + i * 16, "record %d", i);
+     if (async)
+	  rvm_wait(rvm_commit_trans_async(trans));
+     else
+	  rvm_commit_trans(trans);
+}
+
+/* wait for the standby applier to catch up with shipped records */
+static void wait_applied(rvm_t rvm, long long shipped)
+{
+     shipstat_t stats;
+     int i;
+     for (i = 0; i < 500; i++) {
+	  rvm_standby_stats(rvm, &stats);
+	  if (stats.lag_records == 0 && stats.lag_bytes == 0)
+	       break;
+	  usleep(10000);
+     }
+     if (stats.lag_records != 0 || stats.lag_bytes != 0
+	 || stats.records_shipped != shipped) {
+	  printf("ERROR: standby applier lags %lld records\n", stats.lag_records);
+	  exit(2);
+     }
+}
+
+/* proc1 is the primary */
+void proc1() 
+{
+     rvm_t rvm, standby;
+     trans_t trans;
+     char* segs[2];
+     shipstat_t stats;
+     int i;
+     
+     rvm = rvm_init("rvm_segments");
+     rvm_set_option(rvm, RVM_OPT_DIRECT_LOG, 1);
+     rvm_destroy(rvm, "sbseg");
+     rvm_destroy(rvm, "sbpair");
+     segs[0] = (char *) rvm_map(rvm, "sbseg", SEGSIZE);
+     segs[1] = (char *) rvm_map(rvm, "sbpair", SEGSIZE);
+
+     /* committed before shipping starts, reaches the standby through
+      * the seed copy of the log */
+     trans = rvm_begin_trans(rvm, 1, (void **) segs);
+     rvm_about_to_modify(trans, segs[0], 0, 100);
+     strcpy(segs[0], "seeded");
+     rvm_commit_trans(trans);
+
+     if (rvm_set_standby(rvm, "rvm_standby") != 0) {
+	  printf("ERROR: cannot set standby\n");
+	  exit(2);
+     }
+     for (i = 0; i < NTRANS; i++)
+	  commit_slot(rvm, segs, i, i % 2);
+
+     rvm_standby_stats(rvm, &stats);
+     if (stats.records_shipped != NTRANS || stats.lag_records != NTRANS + 1
+	 || stats.bytes_shipped <= 0 || stats.lag_bytes <= 0) {
+	  printf("ERROR: stats before replay %lld %lld %lld\n", stats.records_shipped,
+		 stats.lag_records, stats.lag_bytes);
+	  exit(2);
+     }
+
+     /* the standby catches up */
+     standby = rvm_init("rvm_standby");
+     rvm_truncate_log(standby);
+     rvm_standby_stats(rvm, &stats);
+     if (stats.lag_records != 0 || stats.lag_bytes != 0) {
+	  printf("ERROR: standby did not catch up\n");
+	  exit(2);
+     }
+
+     /* the applier keeps up from here on */
+     rvm_set_option(rvm, RVM_OPT_STANDBY_APPLY, 1);
+     for (i = NTRANS; i < 2 * NTRANS; i++)
+	  commit_slot(rvm, segs, i, i % 2);
+     wait_applied(rvm, 2 * NTRANS);
+
+     /* an async commit opens both standby logs, empty after replay */
+     trans = rvm_begin_trans(rvm, 2, (void **) segs);
+     rvm_about_to_modify(trans, segs[0], 100, 10);
+     rvm_about_to_modify(trans, segs[1], 100, 10);
+     strcpy(segs[0] + 100, "pair one");
+     strcpy(segs[1] + 100, "pair two");
+     rvm_wait(rvm_commit_trans_async(trans));
+     wait_applied(rvm, 2 * NTRANS + 2);
+
+     abort();
+}
+
+
+/* proc2 fails over to the standby */
+void proc2() 
+{
+     char* seg;
+     char* pair;
+     rvm_t rvm;
+     char expect[16];
+     int i;
+     struct stat st;
+     
+     if ((stat("rvm_standby/sbseg.log", &st) == 0 && st.st_size > 0)
+	 || (stat("rvm_standby/sbpair.log", &st) == 0 && st.st_size > 0)) {
+	  printf("ERROR: failover finds %ld bytes of log\n", (long) st.st_size);
+	  exit(2);
+     }
+     rvm = rvm_init("rvm_standby");
+     seg = (char *) rvm_map(rvm, "sbseg", SEGSIZE);
+     pair = (char *) rvm_map(rvm, "sbpair", SEGSIZE);
+
+     if (strcmp(seg, "seeded") || strcmp(seg + 100, "pair one") || strcmp(pair + 100, "pair two")) {
+	  printf("ERROR: seed lost\n");
+	  exit(2);
+     }
+     for (i = 0; i < 2 * NTRANS; i++) {
+	  sprintf(expect, "record %d", i);
+	  if (strcmp(seg + 1000 + i * 16, expect)) {
+	       printf("ERROR: record %d missing on the standby\n", i);
+	       exit(2);
+	  }
+     }
+
+     printf("OK\n");
+     exit(0);
+}
+
+
+int main(int argc, char **argv)
+{
+     int pid;
+
+     pid = fork();
+     if(pid < 0) {
+	  perror("fork");
+	  exit(2);
+     }
+     if(pid == 0) {
+	  proc1();
+	  exit(0);
+     }
+
+     waitpid(pid, NULL, 0);
+
+     proc2();
+
+     return 0;
+}
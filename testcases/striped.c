@@ -0,0 +1,226 @@
+/* striped.c - test a segment striped across two directories. Commits
+ * cross stripe boundaries, one is large enough to write the stripes in
+ * parallel, and some stripes are truncated before the crash. Recovery
+ * must find the stripes from the layout alone, and drop a commit that
+ * reached only one of its stripes or missed the commit record, also
+ * the first one after a map and one whose stripe log a plain map in
+ * the same directory finds first */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define STRIPE (16 * 4096)
+#define SEGSIZE (40 * STRIPE + 100)
+#define TORN (11 * STRIPE - 6)
+#define FIRST (15 * STRIPE - 6)
+
+
+static void commit_str(rvm_t rvm, char** seg, int offset, const char* str)
+{
+     trans_t trans = rvm_begin_trans(rvm, 1, (void **) seg);
+     rvm_about_to_modify(trans, seg[0], offset, strlen(str) + 1);
+     strcpy(seg[0] + offset, str);
+     rvm_commit_trans(trans);
+}
+
+/* run a commit of str at offset, then put the commit record at path
+ * back as it was before, as if the commit crashed before writing it */
+static void commit_unrecorded(rvm_t rvm, char** seg, int offset, const char* str,
+			      const char* path)
+{
+     char record[4096];
+     int fd = open(path, O_RDONLY);
+     int n = read(fd, record, sizeof(record));
+     close(fd);
+     commit_str(rvm, seg, offset, str);
+     fd = open(path, O_WRONLY);
+     if (n <= 0 || write(fd, record, n) != n) {
+	  printf("ERROR: cannot restore the commit record\n");
+	  exit(2);
+     }
+     close(fd);
+}
+
+/* proc1 fills the segment, commits across boundaries and crashes */
+void proc1() 
+{
+     rvm_t rvm;
+     trans_t trans;
+     char* seg[1];
+     const char* dirs[2] = { "rvm_stripes_a", "rvm_stripes_b" };
+     struct stat st;
+     
+     rvm = rvm_init("rvm_segments");
+     rvm_destroy(rvm, "striped");
+     seg[0] = (char *) rvm_map_striped(rvm, "striped", SEGSIZE, STRIPE, 2, dirs);
+     if (!seg[0]) {
+	  printf("ERROR: map failed\n");
+	  exit(2);
+     }
+
+     /* every stripe at once */
+     trans = rvm_begin_trans(rvm, 1, (void **) seg);
+     rvm_about_to_modify(trans, seg[0], 0, SEGSIZE);
+     memset(seg[0], 'x', SEGSIZE);
+     rvm_commit_trans(trans);
+
+     if (stat("rvm_stripes_a/striped.0.log", &st) != 0 || st.st_size == 0
+	 || stat("rvm_stripes_b/striped.1.log", &st) != 0 || st.st_size == 0) {
+	  printf("ERROR: stripes not logged in their directories\n");
+	  exit(2);
+     }
+
+     commit_str(rvm, seg, STRIPE - 5, "across one");
+     rvm_truncate_log(rvm);
+     commit_str(rvm, seg, 7 * STRIPE - 3, "across two");
+     commit_str(rvm, seg, SEGSIZE - 20, "last stripe");
+
+     /* aborted changes stay out of every stripe */
+     trans = rvm_begin_trans(rvm, 1, (void **) seg);
+     rvm_about_to_modify(trans, seg[0], 3 * STRIPE - 8, 16);
+     strcpy(seg[0] + 3 * STRIPE - 8, "aborted");
+     rvm_abort_trans(trans);
+
+     /* a commit across stripes 10 and 11 that crashed after logging
+      * stripe 10: stripe 11's log and the commit record are put back
+      * as they were before it */
+     stat("rvm_stripes_b/striped.11.log", &st);
+     commit_unrecorded(rvm, seg, TORN, "torn commit", "rvm_segments/striped.commit");
+     truncate("rvm_stripes_b/striped.11.log", st.st_size);
+
+     abort();
+}
+
+
+/* proc3 crashes in the first commit after mapping the segment, which
+ * reaches the logs of stripes 14 and 15 but not the commit record */
+void proc3()
+{
+     char* seg[1];
+     rvm_t rvm;
+
+     rvm = rvm_init("rvm_segments");
+     seg[0] = (char *) rvm_map_striped(rvm, "striped", SEGSIZE, 0, 0, NULL);
+     commit_unrecorded(rvm, seg, FIRST, "first commit", "rvm_segments/striped.commit");
+     abort();
+}
+
+
+/* proc4 crashes in a commit to a segment with a stripe in the rvm
+ * directory itself, before the commit record */
+void proc4()
+{
+     char* seg[1];
+     rvm_t rvm;
+     const char* dirs[2] = { "rvm_segments", "rvm_stripes_b" };
+
+     rvm = rvm_init("rvm_segments");
+     rvm_destroy(rvm, "mixed");
+     seg[0] = (char *) rvm_map_striped(rvm, "mixed", 2 * STRIPE, STRIPE, 2, dirs);
+     commit_unrecorded(rvm, seg, STRIPE - 6, "split commit", "rvm_segments/mixed.commit");
+     abort();
+}
+
+
+/* proc2 maps the segment by its layout and checks it */
+void proc2() 
+{
+     char* seg;
+     rvm_t rvm;
+     int i, pid;
+     
+     rvm = rvm_init("rvm_segments");
+     seg = (char *) rvm_map_striped(rvm, "striped", SEGSIZE, 0, 0, NULL);
+     if (!seg) {
+	  printf("ERROR: map failed\n");
+	  exit(2);
+     }
+
+     if (strcmp(seg + STRIPE - 5, "across one") || strcmp(seg + 7 * STRIPE - 3, "across two")
+	 || strcmp(seg + SEGSIZE - 20, "last stripe")) {
+	  printf("ERROR: commits not recovered\n");
+	  exit(2);
+     }
+     for (i = 0; i < SEGSIZE; i += 4096) {
+	  if (i == STRIPE || i == 7 * STRIPE)
+	       continue; /* overwritten by the commits */
+	  if (seg[i] != 'x' || seg[i + 1] != 'x') {
+	       printf("ERROR: stripe %d not recovered\n", i / STRIPE);
+	       exit(2);
+	  }
+     }
+     if (memcmp(seg + 3 * STRIPE - 8, "xxxxxxxx", 8)) {
+	  printf("ERROR: aborted changes recovered\n");
+	  exit(2);
+     }
+     if (memcmp(seg + TORN, "xxxxxxxxxxxx", 12)) {
+	  printf("ERROR: commit torn across stripes recovered in part\n");
+	  exit(2);
+     }
+
+     rvm_unmap(rvm, seg);
+     pid = fork();
+     if (pid == 0)
+	  proc3();
+     waitpid(pid, NULL, 0);
+     seg = (char *) rvm_map_striped(rvm, "striped", SEGSIZE, 0, 0, NULL);
+     if (!seg || memcmp(seg + FIRST, "xxxxxxxxxxxx", 12)) {
+	  printf("ERROR: unrecorded first commit after a map recovered\n");
+	  exit(2);
+     }
+
+     /* the truncation of a plain map leaves the stripe in the rvm
+      * directory to its striped segment */
+     pid = fork();
+     if (pid == 0)
+	  proc4();
+     waitpid(pid, NULL, 0);
+     rvm_map(rvm, "plain", 100);
+     char* mixed = (char *) rvm_map_striped(rvm, "mixed", 2 * STRIPE, 0, 0, NULL);
+     if (!mixed || memcmp(mixed + STRIPE - 6, "000000000000", 12)) {
+	  printf("ERROR: unrecorded commit recovered in part by a plain map\n");
+	  exit(2);
+     }
+     rvm_unmap(rvm, mixed);
+     rvm_destroy(rvm, "mixed");
+
+     rvm_unmap(rvm, seg);
+     rvm_destroy(rvm, "striped");
+     if (access("rvm_stripes_b/striped.1", F_OK) == 0
+	 || access("rvm_segments/striped.stripes", F_OK) == 0
+	 || access("rvm_segments/striped.commit", F_OK) == 0) {
+	  printf("ERROR: stripes not destroyed\n");
+	  exit(2);
+     }
+
+     printf("OK\n");
+     exit(0);
+}
+
+
+int main(int argc, char **argv)
+{
+     int pid;
+
+     pid = fork();
+     if(pid < 0) {
+	  perror("fork");
+	  exit(2);
+     }
+     if(pid == 0) {
+	  proc1();
+	  exit(0);
+     }
+
+     waitpid(pid, NULL, 0);
+
+     proc2();
+
+     return 0;
+}
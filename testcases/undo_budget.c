@@ -0,0 +1,151 @@
+/* undo_budget.c - test transactions whose pre-images go over the undo
+ * budget. Spilled pre-images are rolled back by abort and seen by a
+ * read snapshot, the undo file never has a name in the directory, where
+ * another process could open it, and a large
+ * committed transaction is recovered after a crash */
+
+#include "rvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/wait.h>
+
+#define SEGSIZE (256 * 4096)
+#define BUDGET (16 * 4096)
+#define RANGE 4000
+
+
+/* whether a file of the directory is named like an undo file */
+static int undo_file_named()
+{
+     DIR* dir = opendir("rvm_segments");
+     struct dirent* e;
+     int found = 0;
+     while ((e = readdir(dir)))
+	  found |= strstr(e->d_name, ".undo") != NULL;
+     closedir(dir);
+     return found;
+}
+
+/* fill the segment range by range, some ranges declared in batches */
+static void fill(rvm_t rvm, char** seg, char c, int use_v)
+{
+     trans_t trans = rvm_begin_trans(rvm, 1, (void **) seg);
+     range_t ranges[8];
+     int off, n = 0;
+     for (off = 0; off + RANGE <= SEGSIZE; off += RANGE) {
+	  if (use_v) {
+	       ranges[n].segbase = seg[0];
+	       ranges[n].offset = off;
+	       ranges[n].size = RANGE;
+	       if (++n == 8) {
+		    rvm_about_to_modify_v(trans, ranges, n);
+		    n = 0;
+	       }
+	  } else {
+	       rvm_about_to_modify(trans, seg[0], off, RANGE);
+	  }
+     }
+     if (n)
+	  rvm_about_to_modify_v(trans, ranges, n);
+     memset(seg[0], c, off);
+     rvm_commit_trans(trans);
+}
+
+static int all_of(char* p, char c, int n)
+{
+     int i;
+     for (i = 0; i < n; i++)
+	  if (p[i] != c)
+	       return 0;
+     return 1;
+}
+
+/* proc1 commits, aborts and commits transactions far over the budget,
+ * then crashes */
+void proc1() 
+{
+     rvm_t rvm;
+     trans_t trans;
+     char* seg[1];
+     char buf[RANGE];
+     int off, end = SEGSIZE / RANGE * RANGE;
+     
+     rvm = rvm_init("rvm_segments");
+     rvm_set_option(rvm, RVM_OPT_UNDO_BUDGET, BUDGET);
+     rvm_destroy(rvm, "undoseg");
+     seg[0] = (char *) rvm_map(rvm, "undoseg", SEGSIZE);
+     fill(rvm, seg, 'a', 0);
+
+     /* everything past the budget comes back from the undo file */
+     trans = rvm_begin_trans(rvm, 1, (void **) seg);
+     for (off = 0; off < end; off += RANGE)
+	  rvm_about_to_modify(trans, seg[0], off, RANGE);
+     memset(seg[0], 'b', end);
+     snapshot_t snap = rvm_begin_read_snapshot(rvm, 1, (void **) seg);
+     rvm_snapshot_read(snap, seg[0], end - RANGE, buf, RANGE);
+     if (!all_of(buf, 'a', RANGE)) {
+	  printf("ERROR: snapshot misses a spilled pre-image\n");
+	  exit(2);
+     }
+     rvm_end_read_snapshot(snap);
+     if (undo_file_named()) {
+	  printf("ERROR: undo file visible in the directory\n");
+	  exit(2);
+     }
+     rvm_abort_trans(trans);
+     if (!all_of(seg[0], 'a', end)) {
+	  printf("ERROR: abort did not restore spilled pre-images\n");
+	  exit(2);
+     }
+     if (undo_file_named()) {
+	  printf("ERROR: undo file left behind\n");
+	  exit(2);
+     }
+
+     fill(rvm, seg, 'c', 1);
+     abort();
+}
+
+
+/* proc2 checks the last commit */
+void proc2() 
+{
+     char* seg;
+     rvm_t rvm;
+     
+     rvm = rvm_init("rvm_segments");
+     seg = (char *) rvm_map(rvm, "undoseg", SEGSIZE);
+
+     if (!all_of(seg, 'c', SEGSIZE / RANGE * RANGE)) {
+	  printf("ERROR: large transaction not recovered\n");
+	  exit(2);
+     }
+
+     printf("OK\n");
+     exit(0);
+}
+
+
+int main(int argc, char **argv)
+{
+     int pid;
+
+     pid = fork();
+     if(pid < 0) {
+	  perror("fork");
+	  exit(2);
+     }
+     if(pid == 0) {
+	  proc1();
+	  exit(0);
+     }
+
+     waitpid(pid, NULL, 0);
+
+     proc2();
+
+     return 0;
+}